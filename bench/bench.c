@@ -0,0 +1,431 @@
+#include "command_handler.h"
+#include "restore.h"
+#include "stats.h"
+#include "tree.h"
+#include "worker.h"
+
+#include <limits.h>
+
+#define BENCH_CHURN_OPS 2000            // scripted changes of churn benchmark, multiplied by scale
+#define BENCH_CHURN_MAX_SIZE 8192       // largest file written by churn
+#define BENCH_WAIT_MS (5 * 60 * 1000)  // longest wait for worker
+
+typedef struct BenchOptions
+{
+    char* dir;      // dir where trees are generated
+    int scale;      // multiplies size of trees and churn
+    uint64_t seed;  // seed of trees and churn
+    int threads;    // threads of copy and restore
+    char* label;    // label of results, e.g. commit
+    char* tree;     // only tree with this name, NULL for all trees
+} BenchOptions;
+
+static const char* tree_names[] = {"tiny", "huge", "deep", "symlinks"};
+
+static void bench_usage(char* name)
+{
+    fprintf(stderr, "Usage: %s [--dir=PATH] [--scale=N] [--seed=N] [--threads=N] [--label=STR] [--tree=NAME]\n", name);
+    fprintf(stderr, "Trees: tiny, huge, deep, symlinks\n");
+    exit(EXIT_FAILURE);
+}
+
+static void parse_bench_options(int argc, char** argv, BenchOptions* opts)
+{
+    opts->dir = ".";
+    opts->scale = 1;
+    opts->seed = 1;
+    opts->threads = 1;
+    opts->label = "local";
+    opts->tree = NULL;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strncmp(argv[i], "--dir=", 6) == 0)
+            opts->dir = argv[i] + 6;
+        else if (strncmp(argv[i], "--scale=", 8) == 0 && atoi(argv[i] + 8) > 0)
+            opts->scale = atoi(argv[i] + 8);
+        else if (strncmp(argv[i], "--seed=", 7) == 0)
+            opts->seed = strtoull(argv[i] + 7, NULL, 10);
+        else if (strncmp(argv[i], "--threads=", 10) == 0 && atoi(argv[i] + 10) > 0
+                 && atoi(argv[i] + 10) <= POOL_MAX_THREADS)
+            opts->threads = atoi(argv[i] + 10);
+        else if (strncmp(argv[i], "--label=", 8) == 0)
+            opts->label = argv[i] + 8;
+        else if (strncmp(argv[i], "--tree=", 7) == 0 && tree_spec(argv[i] + 7) != NULL)
+            opts->tree = argv[i] + 7;
+        else
+            bench_usage(argv[0]);
+    }
+}
+
+// start result line, it's one JSON object, fields are added by the benchmark
+static void result_begin(BenchOptions* opts, const char* bench, const char* tree)
+{
+    fprintf(stdout, "{\"label\":\"%s\",\"bench\":\"%s\",\"tree\":\"%s\",\"scale\":%d,\"seed\":%llu,\"threads\":%d",
+            opts->label, bench, tree, opts->scale, (unsigned long long)opts->seed, opts->threads);
+}
+
+static void result_end()
+{
+    fprintf(stdout, "}\n");
+    fflush(stdout);
+}
+
+static double seconds_since(long long start_us) { return (monotonic_us() - start_us) / 1e6; }
+
+// per second rate, 0 when nothing was measured
+static double rate(double count, double seconds) { return seconds > 0 ? count / seconds : 0; }
+
+// generate tree, its shape is a result too
+static void bench_generate(BenchOptions* opts, TreeSpec* spec, char* src, TreeInfo* info)
+{
+    long long start = monotonic_us();
+    tree_generate(spec, opts->scale, opts->seed, src, info);
+    double secs = seconds_since(start);
+
+    result_begin(opts, "generate", spec->name);
+    fprintf(stdout, ",\"dirs\":%lu,\"files\":%lu,\"symlinks\":%lu,\"bytes\":%llu,\"seconds\":%.6f", info->dirs,
+            info->files, info->symlinks, info->bytes, secs);
+    result_end();
+}
+
+// initial copy of the whole tree, like add does before watching
+static void bench_copy(BenchOptions* opts, TreeSpec* spec, char* src, char* target, Log* logs)
+{
+    if (mkdir(target, 0755) != 0)
+    {
+        ERR("mkdir");
+        exit(EXIT_FAILURE);
+    }
+
+    CopyStats stats = {0, 0, 0, 0};
+    CopyStats* own = copy_stats;
+    copy_stats = &stats;
+
+    long long start = monotonic_us();
+    copy_dir_parallel(src, target, src, target, opts->threads, logs);
+    double secs = seconds_since(start);
+    copy_stats = own;
+
+    result_begin(opts, "copy", spec->name);
+    fprintf(stdout, ",\"files\":%llu,\"bytes\":%llu,\"seconds\":%.6f,\"files_per_s\":%.1f,\"mb_per_s\":%.2f",
+            atomic_load(&stats.files), atomic_load(&stats.bytes), secs, rate(atomic_load(&stats.files), secs),
+            rate(atomic_load(&stats.bytes) / 1e6, secs));
+    result_end();
+}
+
+// restore of src from target in a restorer process, like restore command
+static void bench_restore(BenchOptions* opts, TreeSpec* spec, const char* name, char* src, char* target,
+                          StatsTable* table, Log* logs)
+{
+    RestoreProgress* progress = progress_init(src, target);
+    // restorer counts its copies in shared memory
+    WorkerStats* slot = stats_claim(table);
+    if (slot == NULL)
+    {
+        fprintf(stderr, "No free stats slot\n");
+        exit(EXIT_FAILURE);
+    }
+
+    fflush(stdout);
+    log_flush(logs);
+    long long start = monotonic_us();
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        ERR("fork");
+        exit(EXIT_FAILURE);
+    }
+    if (pid == 0)
+    {
+        copy_stats = &slot->copy;
+        restore_better(progress, opts->threads, logs);
+        exit(EXIT_FAILURE);
+    }
+
+    int status;
+    if (waitpid(pid, &status, 0) < 0)
+    {
+        ERR("waitpid");
+        exit(EXIT_FAILURE);
+    }
+    double secs = seconds_since(start);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS)
+    {
+        fprintf(stderr, "Restorer failed\n");
+        exit(EXIT_FAILURE);
+    }
+
+    unsigned long long checked = atomic_load(&progress->files);
+    unsigned long long copied = atomic_load(&slot->copy.files);
+    unsigned long long bytes = atomic_load(&slot->copy.bytes);
+    result_begin(opts, name, spec->name);
+    fprintf(stdout, ",\"checked\":%llu,\"copied\":%llu,\"bytes\":%llu,\"seconds\":%.6f,\"files_per_s\":%.1f", checked,
+            copied, bytes, secs, rate(checked, secs));
+    result_end();
+
+    stats_release(slot, STATS_STARTING);
+    free_progress(progress);
+}
+
+// wait until cond of worker slot holds, worker that takes too long ends benchmark
+static void wait_for(int (*cond)(WorkerStats*, char*), WorkerStats* slot, char* path)
+{
+    long long deadline = monotonic_ms() + BENCH_WAIT_MS;
+    while (!cond(slot, path))
+    {
+        if (monotonic_ms() > deadline)
+        {
+            fprintf(stderr, "Worker didn't catch up in %d ms\n", BENCH_WAIT_MS);
+            exit(EXIT_FAILURE);
+        }
+        struct timespec ts = {0, 200000};
+        nanosleep(&ts, NULL);
+    }
+}
+
+// worker watches source, initial copy is done
+static int worker_ready(WorkerStats* slot, char* path) { return atomic_load(&slot->watches) > 0; }
+
+// file of path exists
+static int file_exists(WorkerStats* slot, char* path) { return access(path, F_OK) == 0; }
+
+// path of name in dir, PATH_MAX bytes long
+static void bench_path(char* path, char* dir, const char* name)
+{
+    if (snprintf(path, PATH_MAX, "%s/%s", dir, name) >= PATH_MAX)
+    {
+        fprintf(stderr, "Path in %s is too long\n", dir);
+        exit(EXIT_FAILURE);
+    }
+}
+
+// path of churn file n in dir
+static void churn_path(char* path, char* dir, int n)
+{
+    char name[32];
+    snprintf(name, sizeof(name), "c%d", n);
+    bench_path(path, dir, name);
+}
+
+// scripted changes in dir of the source: creates, writes, renames, deletes and chmods of files
+static unsigned long churn(BenchOptions* opts, char* dir)
+{
+    if (mkdir(dir, 0755) != 0)
+    {
+        ERR("mkdir");
+        exit(EXIT_FAILURE);
+    }
+
+    int count = BENCH_CHURN_OPS * opts->scale;
+    int* live = malloc(sizeof(int) * count);
+    if (live == NULL)
+    {
+        ERR("malloc");
+        exit(EXIT_FAILURE);
+    }
+    int size = 0;
+    int next = 0;
+
+    Rng rng;
+    rng_seed(&rng, opts->seed);
+    char path[PATH_MAX], other[PATH_MAX];
+    for (int i = 0; i < count; i++)
+    {
+        int kind = rng_next(&rng) % 100;
+        int pick = size > 0 ? rng_next(&rng) % size : 0;
+
+        // 40% creates, always create when there is nothing to change
+        if (kind < 40 || size == 0)
+        {
+            churn_path(path, dir, next);
+            tree_write_file(path, rng_next(&rng) % BENCH_CHURN_MAX_SIZE, &rng);
+            live[size++] = next++;
+            continue;
+        }
+
+        churn_path(path, dir, live[pick]);
+        // 20% rewrites
+        if (kind < 60)
+            tree_write_file(path, rng_next(&rng) % BENCH_CHURN_MAX_SIZE, &rng);
+        // 15% renames
+        else if (kind < 75)
+        {
+            churn_path(other, dir, next);
+            if (rename(path, other) != 0)
+            {
+                ERR("rename");
+                exit(EXIT_FAILURE);
+            }
+            live[pick] = next++;
+        }
+        // 15% deletes
+        else if (kind < 90)
+        {
+            if (unlink(path) != 0)
+            {
+                ERR("unlink");
+                exit(EXIT_FAILURE);
+            }
+            live[pick] = live[--size];
+        }
+        // 10% chmods
+        else if (chmod(path, kind % 2 ? 0600 : 0644) != 0)
+        {
+            ERR("chmod");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    free(live);
+    return count;
+}
+
+// event handling of a worker that watches src, from the first change until the last one is in the target
+static void bench_churn(BenchOptions* opts, TreeSpec* spec, char* src, char* target, StatsTable* table, Log* logs)
+{
+    WorkerStats* slot = stats_claim(table);
+    if (slot == NULL)
+    {
+        fprintf(stderr, "No free stats slot\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // worker frees its paths
+    char** targets = malloc(sizeof(char*));
+    char* worker_src = strdup(src);
+    if (targets == NULL || worker_src == NULL || (targets[0] = strdup(target)) == NULL)
+    {
+        ERR("malloc");
+        exit(EXIT_FAILURE);
+    }
+    WorkerOptions wopts = {opts->threads, 0, 0, WATCH_INOTIFY, 0, NULL, NULL};
+    if (mkdir(target, 0755) != 0)
+    {
+        ERR("mkdir");
+        exit(EXIT_FAILURE);
+    }
+
+    fflush(stdout);
+    log_flush(logs);
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        ERR("fork");
+        exit(EXIT_FAILURE);
+    }
+    if (pid == 0)
+        start_worker(worker_src, targets, 1, &wopts, slot, logs);
+    stats_own(slot, pid);
+    free(worker_src);
+    free(targets[0]);
+    free(targets);
+
+    wait_for(worker_ready, slot, NULL);
+
+    char dir[PATH_MAX], done[PATH_MAX], done_copy[PATH_MAX];
+    bench_path(dir, src, "churn");
+    bench_path(done, src, "churn-done");
+    bench_path(done_copy, target, "churn-done");
+
+    // ops of one worker are applied in order, copy of the last file means all changes are in the target
+    long long start = monotonic_us();
+    unsigned long changes = churn(opts, dir);
+    Rng rng;
+    rng_seed(&rng, opts->seed);
+    tree_write_file(done, 1, &rng);
+    wait_for(file_exists, slot, done_copy);
+    double secs = seconds_since(start);
+
+    unsigned long long events = atomic_load(&slot->events);
+    LatencyHist* copy = &slot->latency[LATENCY_COPY];
+    result_begin(opts, "churn", spec->name);
+    fprintf(stdout,
+            ",\"changes\":%lu,\"events\":%llu,\"ops\":%llu,\"seconds\":%.6f,\"events_per_s\":%.1f,"
+            "\"copy_p50_ms\":%.3f,\"copy_p99_ms\":%.3f,\"copy_max_ms\":%.3f",
+            changes, events, atomic_load(&slot->ops), secs, rate(events, secs), latency_percentile(copy, 0.5) / 1e3,
+            latency_percentile(copy, 0.99) / 1e3, atomic_load(&copy->max) / 1e3);
+    result_end();
+
+    if (kill(pid, SIGTERM) < 0 || waitpid(pid, NULL, 0) < 0)
+    {
+        ERR("kill");
+        exit(EXIT_FAILURE);
+    }
+    stats_release(slot, pid);
+}
+
+// every benchmark on one tree, tree is removed at the end
+static void bench_tree(BenchOptions* opts, TreeSpec* spec, char* work, StatsTable* table, Log* logs)
+{
+    char src[PATH_MAX], target[PATH_MAX], churn_target[PATH_MAX];
+    snprintf(src, sizeof(src), "%s/%s-src", work, spec->name);
+    snprintf(target, sizeof(target), "%s/%s-target", work, spec->name);
+    snprintf(churn_target, sizeof(churn_target), "%s/%s-churn", work, spec->name);
+
+    TreeInfo info;
+    bench_generate(opts, spec, src, &info);
+    bench_copy(opts, spec, src, target, logs);
+
+    // source that matches the backup is only compared
+    bench_restore(opts, spec, "restore_noop", src, target, table, logs);
+    // empty source gets every file
+    rm_dir_recursive(src);
+    if (mkdir(src, 0755) != 0)
+    {
+        ERR("mkdir");
+        exit(EXIT_FAILURE);
+    }
+    bench_restore(opts, spec, "restore_full", src, target, table, logs);
+
+    bench_churn(opts, spec, src, churn_target, table, logs);
+
+    rm_dir_recursive(src);
+    rm_dir_recursive(target);
+    rm_dir_recursive(churn_target);
+    // manifest of worker target
+    char manifest[PATH_MAX + 16];
+    snprintf(manifest, sizeof(manifest), "%s.manifest", churn_target);
+    unlink(manifest);
+}
+
+int main(int argc, char** argv)
+{
+    BenchOptions opts;
+    parse_bench_options(argc, argv, &opts);
+
+    // workers end on SIGTERM, like workers of the shell
+    set_handler(sig_handler, SIGTERM);
+
+    char work[PATH_MAX];
+    snprintf(work, sizeof(work), "%s/sop-bench-XXXXXX", opts.dir);
+    if (mkdtemp(work) == NULL)
+    {
+        ERR("mkdtemp");
+        exit(EXIT_FAILURE);
+    }
+    // trees get real paths, symlinks inside them are absolute
+    char* real = realpath(work, NULL);
+    if (real == NULL)
+    {
+        ERR("realpath");
+        exit(EXIT_FAILURE);
+    }
+
+    char log_path[PATH_MAX];
+    snprintf(log_path, sizeof(log_path), "%s/bench.log", real);
+    Log* logs = log_open(log_path, LOG_LEVEL_WARN);
+    StatsTable* table = stats_init();
+
+    for (int i = 0; i < (int)(sizeof(tree_names) / sizeof(tree_names[0])); i++)
+    {
+        if (opts.tree == NULL || strcmp(opts.tree, tree_names[i]) == 0)
+            bench_tree(&opts, tree_spec(tree_names[i]), real, table, logs);
+    }
+
+    log_close(logs);
+    free_stats(table);
+    rm_dir_recursive(real);
+    free(real);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,559 @@
+#include "dict.h"
+#include "parser.h"
+#include "tree.h"
+#include "watchers.h"
+
+#include <limits.h>
+
+#define MICRO_FANOUT 16              // subdirs of every dir in watch trees
+#define MICRO_LOOKUPS 1000000        // lookups of every watch benchmark
+#define MICRO_RENAMES 100000         // renames of leaf dirs
+#define MICRO_DICT_WORK 10000000     // nodes visited by every dict benchmark, bounds its ops
+#define MICRO_PARSE_BYTES 100000000  // bytes parsed by every parser benchmark, bounds its ops
+#define MICRO_JOIN_OPS 1000000       // joins of every path helper benchmark
+
+typedef struct MicroOptions
+{
+    long max;       // largest number of watches and dict entries
+    uint64_t seed;  // seed of keys picked by benchmarks
+    char* label;    // label of results, e.g. commit
+    char* only;     // only benchmarks with this prefix, NULL for all
+} MicroOptions;
+
+// allocations seen by malloc wrappers, benchmarks are single-threaded
+static unsigned long long alloc_count;
+static unsigned long long alloc_bytes;
+
+// glibc allocator, every allocation of the process goes through wrappers below
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t n, size_t size);
+void* __libc_realloc(void* ptr, size_t size);
+void __libc_free(void* ptr);
+
+void* malloc(size_t size)
+{
+    alloc_count++;
+    alloc_bytes += size;
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t n, size_t size)
+{
+    alloc_count++;
+    alloc_bytes += n * size;
+    return __libc_calloc(n, size);
+}
+
+void* realloc(void* ptr, size_t size)
+{
+    alloc_count++;
+    alloc_bytes += size;
+    return __libc_realloc(ptr, size);
+}
+
+void free(void* ptr) { __libc_free(ptr); }
+
+// measurement of one benchmark, counters hold values at start until meter_stop
+typedef struct Meter
+{
+    long long ns;               // start, then elapsed time in ns
+    unsigned long long allocs;  // allocations
+    unsigned long long bytes;   // allocated bytes
+} Meter;
+
+// results of benchmarks are kept away from the optimizer
+static volatile unsigned long long sink;
+
+static long long monotonic_ns()
+{
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0)
+    {
+        ERR("clock_gettime");
+        exit(EXIT_FAILURE);
+    }
+
+    return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void micro_usage(char* name)
+{
+    fprintf(stderr, "Usage: %s [--max=N] [--seed=N] [--label=STR] [--only=PREFIX]\n", name);
+    fprintf(stderr, "Benchmarks: watch_insert, watch_search, watch_search_path, watch_rename_leaf,\n");
+    fprintf(stderr, "            watch_rename_subtree, watch_delete, dict_insert, dict_search, dict_delete,\n");
+    fprintf(stderr, "            parse_command, join_paths\n");
+    exit(EXIT_FAILURE);
+}
+
+static void parse_micro_options(int argc, char** argv, MicroOptions* opts)
+{
+    opts->max = 1000000;
+    opts->seed = 1;
+    opts->label = "local";
+    opts->only = NULL;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strncmp(argv[i], "--max=", 6) == 0 && atol(argv[i] + 6) > 0)
+            opts->max = atol(argv[i] + 6);
+        else if (strncmp(argv[i], "--seed=", 7) == 0)
+            opts->seed = strtoull(argv[i] + 7, NULL, 10);
+        else if (strncmp(argv[i], "--label=", 8) == 0)
+            opts->label = argv[i] + 8;
+        else if (strncmp(argv[i], "--only=", 7) == 0)
+            opts->only = argv[i] + 7;
+        else
+            micro_usage(argv[0]);
+    }
+}
+
+// does benchmark with given name run
+static int selected(MicroOptions* opts, const char* bench)
+{
+    return opts->only == NULL || strncmp(bench, opts->only, strlen(opts->only)) == 0;
+}
+
+// does any benchmark of group run
+static int group_selected(MicroOptions* opts, const char* group)
+{
+    return selected(opts, group) || strncmp(opts->only, group, strlen(group)) == 0;
+}
+
+static void meter_start(Meter* m)
+{
+    m->allocs = alloc_count;
+    m->bytes = alloc_bytes;
+    m->ns = monotonic_ns();
+}
+
+// stop before printing, printing allocates too
+static void meter_stop(Meter* m)
+{
+    m->ns = monotonic_ns() - m->ns;
+    m->allocs = alloc_count - m->allocs;
+    m->bytes = alloc_bytes - m->bytes;
+}
+
+// start result line, it's one JSON object, the benchmark adds its parameters
+static void result_begin(MicroOptions* opts, const char* bench)
+{
+    fprintf(stdout, "{\"label\":\"%s\",\"bench\":\"%s\",\"seed\":%llu", opts->label, bench,
+            (unsigned long long)opts->seed);
+}
+
+// end result line with cost of one of ops measured by m
+static void result_end(Meter* m, long ops)
+{
+    fprintf(stdout, ",\"ops\":%ld,\"ns_per_op\":%.1f,\"allocs_per_op\":%.3f,\"bytes_per_op\":%.1f}\n", ops,
+            (double)m->ns / ops, (double)m->allocs / ops, (double)m->bytes / ops);
+    fflush(stdout);
+}
+
+static long pick(Rng* rng, long n) { return (long)(rng_next(rng) % (unsigned long long)n); }
+
+// shuffle of 0..n-1
+static long* shuffled(Rng* rng, long n)
+{
+    long* order = malloc(sizeof(long) * n);
+    if (order == NULL)
+    {
+        ERR("malloc");
+        exit(EXIT_FAILURE);
+    }
+    for (long i = 0; i < n; i++)
+    {
+        order[i] = i;
+    }
+    for (long i = n - 1; i > 0; i--)
+    {
+        long j = pick(rng, i + 1);
+        long tmp = order[i];
+        order[i] = order[j];
+        order[j] = tmp;
+    }
+    return order;
+}
+
+static char* copy_string(const char* s)
+{
+    char* copy = strdup(s);
+    if (copy == NULL)
+    {
+        ERR("strdup");
+        exit(EXIT_FAILURE);
+    }
+    return copy;
+}
+
+// paths of n dirs, parent of dir i is dir (i - 1) / MICRO_FANOUT, dir 0 is /src
+static char** tree_paths(long n)
+{
+    char** paths = malloc(sizeof(char*) * n);
+    if (paths == NULL)
+    {
+        ERR("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    char name[32];
+    paths[0] = copy_string("/src");
+    for (long i = 1; i < n; i++)
+    {
+        snprintf(name, sizeof(name), "d%ld", i);
+        paths[i] = join_paths(paths[(i - 1) / MICRO_FANOUT], name);
+    }
+    return paths;
+}
+
+static void free_paths(char** paths, long n)
+{
+    for (long i = 0; i < n; i++)
+    {
+        free(paths[i]);
+    }
+    free(paths);
+}
+
+// rename dir to path-moved and back pairs times
+static void rename_back_and_forth(Watchers* w, char* path, long pairs)
+{
+    char moved[PATH_MAX];
+    snprintf(moved, sizeof(moved), "%s-moved", path);
+    for (long i = 0; i < pairs; i++)
+    {
+        update_watch_paths(w, path, moved);
+        update_watch_paths(w, moved, path);
+    }
+}
+
+// watches of subtree of dir i
+static long subtree_size(long i, long n)
+{
+    long size = 0;
+    long first = i, last = i;
+    while (first < n)
+    {
+        size += (last < n ? last : n - 1) - first + 1;
+        first = first * MICRO_FANOUT + 1;
+        last = last * MICRO_FANOUT + MICRO_FANOUT;
+    }
+    return size;
+}
+
+// watch table of n dirs, without a kernel watch behind any of them
+static void micro_watchers(MicroOptions* opts, long n)
+{
+    Rng rng;
+    rng_seed(&rng, opts->seed);
+    Meter m;
+
+    // paths are owned by watches, lookups use own copies
+    char** owned = tree_paths(n);
+    char** paths = tree_paths(n);
+    Watchers* w = watchers_init(WATCH_INOTIFY);
+    if (w == NULL)
+        exit(EXIT_FAILURE);
+
+    meter_start(&m);
+    for (long i = 0; i < n; i++)
+    {
+        new_watch_entry(w, i + 1, owned[i]);
+    }
+    meter_stop(&m);
+    free(owned);
+    if (selected(opts, "watch_insert"))
+    {
+        result_begin(opts, "watch_insert");
+        fprintf(stdout, ",\"size\":%ld", n);
+        result_end(&m, n);
+    }
+
+    if (selected(opts, "watch_search"))
+    {
+        unsigned long long found = 0;
+        meter_start(&m);
+        for (long i = 0; i < MICRO_LOOKUPS; i++)
+        {
+            found += search_watch(w, pick(&rng, n) + 1) != NULL;
+        }
+        meter_stop(&m);
+        sink += found;
+        result_begin(opts, "watch_search");
+        fprintf(stdout, ",\"size\":%ld", n);
+        result_end(&m, MICRO_LOOKUPS);
+    }
+
+    if (selected(opts, "watch_search_path"))
+    {
+        unsigned long long found = 0;
+        meter_start(&m);
+        for (long i = 0; i < MICRO_LOOKUPS; i++)
+        {
+            found += search_watch_path(w, paths[pick(&rng, n)]) != NULL;
+        }
+        meter_stop(&m);
+        sink += found;
+        result_begin(opts, "watch_search_path");
+        fprintf(stdout, ",\"size\":%ld", n);
+        result_end(&m, MICRO_LOOKUPS);
+    }
+
+    // dirs from first leaf on have no subdirs
+    long first_leaf = (n - 1) / MICRO_FANOUT + 1;
+    if (selected(opts, "watch_rename_leaf") && first_leaf < n)
+    {
+        meter_start(&m);
+        for (long i = 0; i < MICRO_RENAMES / 2; i++)
+        {
+            rename_back_and_forth(w, paths[first_leaf + pick(&rng, n - first_leaf)], 1);
+        }
+        meter_stop(&m);
+        result_begin(opts, "watch_rename_leaf");
+        fprintf(stdout, ",\"size\":%ld", n);
+        result_end(&m, MICRO_RENAMES);
+    }
+
+    // dir 1 has the largest subtree below the root
+    if (selected(opts, "watch_rename_subtree") && n > 1)
+    {
+        long subtree = subtree_size(1, n);
+        long pairs = MICRO_LOOKUPS / subtree / 2;
+        if (pairs < 1)
+            pairs = 1;
+        meter_start(&m);
+        rename_back_and_forth(w, paths[1], pairs);
+        meter_stop(&m);
+        result_begin(opts, "watch_rename_subtree");
+        fprintf(stdout, ",\"size\":%ld,\"subtree\":%ld", n, subtree);
+        result_end(&m, pairs * 2);
+    }
+
+    // watches have no kernel watch, so all are deleted before free_watchers
+    long* order = shuffled(&rng, n);
+    meter_start(&m);
+    for (long i = 0; i < n; i++)
+    {
+        delete_watch(w, order[i] + 1);
+    }
+    meter_stop(&m);
+    if (selected(opts, "watch_delete"))
+    {
+        result_begin(opts, "watch_delete");
+        fprintf(stdout, ",\"size\":%ld", n);
+        result_end(&m, n);
+    }
+
+    free(order);
+    free_watchers(w);
+    free_paths(paths, n);
+}
+
+// dict of n workers, searched like end and restore do and emptied like exits do
+static void micro_dict(MicroOptions* opts, long n)
+{
+    Rng rng;
+    rng_seed(&rng, opts->seed);
+    Meter m;
+
+    char** srcs = malloc(sizeof(char*) * n);
+    char** targets = malloc(sizeof(char*) * n);
+    if (srcs == NULL || targets == NULL)
+    {
+        ERR("malloc");
+        exit(EXIT_FAILURE);
+    }
+    char path[64];
+    for (long i = 0; i < n; i++)
+    {
+        snprintf(path, sizeof(path), "/home/user/src/%ld", i);
+        srcs[i] = copy_string(path);
+        snprintf(path, sizeof(path), "/mnt/backup/target/%ld", i);
+        targets[i] = copy_string(path);
+    }
+
+    // list is searched from its head, every op visits n / 2 nodes on average
+    long ops = MICRO_DICT_WORK / n;
+    if (ops < 10)
+        ops = 10;
+    if (ops > n / 2)
+        ops = n / 2;
+
+    Dict* dict = create_dict();
+    meter_start(&m);
+    for (long i = 0; i < n; i++)
+    {
+        insert(dict, srcs[i], targets[i], i + 1, -1);
+    }
+    meter_stop(&m);
+    if (selected(opts, "dict_insert"))
+    {
+        result_begin(opts, "dict_insert");
+        fprintf(stdout, ",\"size\":%ld", n);
+        result_end(&m, n);
+    }
+
+    if (selected(opts, "dict_search"))
+    {
+        unsigned long long found = 0;
+        meter_start(&m);
+        for (long i = 0; i < ops; i++)
+        {
+            long k = pick(&rng, n);
+            found += search(dict, srcs[k], targets[k]);
+        }
+        meter_stop(&m);
+        sink += found;
+        result_begin(opts, "dict_search");
+        fprintf(stdout, ",\"size\":%ld", n);
+        result_end(&m, ops);
+    }
+
+    if (selected(opts, "dict_delete"))
+    {
+        long* order = shuffled(&rng, n);
+        unsigned long long found = 0;
+        meter_start(&m);
+        for (long i = 0; i < ops; i++)
+        {
+            found += delete(dict, srcs[order[i]], targets[order[i]]);
+        }
+        meter_stop(&m);
+        sink += found;
+        free(order);
+        result_begin(opts, "dict_delete");
+        fprintf(stdout, ",\"size\":%ld", n);
+        result_end(&m, ops);
+    }
+
+    free_dict(dict);
+    free_paths(srcs, n);
+    free_paths(targets, n);
+}
+
+// add command with args quoted args of arg_len chars with spaces, ends with new line like read lines
+static char* command_line(int args, int arg_len)
+{
+    size_t len = 4 + (size_t)args * (arg_len + 3) + 2;
+    char* line = malloc(len);
+    if (line == NULL)
+    {
+        ERR("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    char* p = line + sprintf(line, "add");
+    for (int i = 0; i < args; i++)
+    {
+        *p++ = ' ';
+        *p++ = '"';
+        for (int j = 0; j < arg_len; j++)
+        {
+            *p++ = j % 8 == 7 ? ' ' : j % 8 == 0 ? '/' : 'a' + (i + j) % 26;
+        }
+        *p++ = '"';
+    }
+    *p++ = '\n';
+    *p = '\0';
+    return line;
+}
+
+// parse_command of lines with args arguments of arg_len chars
+static void micro_parse(MicroOptions* opts, int args, int arg_len)
+{
+    Meter m;
+    char* line = command_line(args, arg_len);
+    size_t len = strlen(line) + 1;
+    char* cmd = malloc(len);
+    if (cmd == NULL)
+    {
+        ERR("malloc");
+        exit(EXIT_FAILURE);
+    }
+    long ops = MICRO_PARSE_BYTES / len;
+    if (ops > 1000000)
+        ops = 1000000;
+
+    char* argv[MAX_ARGS];
+    unsigned long long parsed = 0;
+    meter_start(&m);
+    for (long i = 0; i < ops; i++)
+    {
+        // parser trims its input in place
+        memcpy(cmd, line, len);
+        int argc = parse_command(cmd, argv);
+        parsed += argc;
+        free_argv(argv, argc);
+    }
+    meter_stop(&m);
+    sink += parsed;
+
+    result_begin(opts, "parse_command");
+    fprintf(stdout, ",\"args\":%d,\"arg_len\":%d", args + 1, arg_len);
+    result_end(&m, ops);
+    free(cmd);
+    free(line);
+}
+
+// join_paths of a dir depth levels deep and a file name
+static void micro_join(MicroOptions* opts, int depth)
+{
+    Meter m;
+    char dir[PATH_MAX];
+    int len = 0;
+    for (int i = 0; i < depth; i++)
+    {
+        len += snprintf(dir + len, sizeof(dir) - len, "/dir%03d", i);
+    }
+
+    unsigned long long joined = 0;
+    meter_start(&m);
+    for (long i = 0; i < MICRO_JOIN_OPS; i++)
+    {
+        char* path = join_paths(dir, "file.txt");
+        joined += path[len];
+        free(path);
+    }
+    meter_stop(&m);
+    sink += joined;
+
+    result_begin(opts, "join_paths");
+    fprintf(stdout, ",\"depth\":%d,\"path_len\":%d", depth, len + 9);
+    result_end(&m, MICRO_JOIN_OPS);
+}
+
+int main(int argc, char** argv)
+{
+    MicroOptions opts;
+    parse_micro_options(argc, argv, &opts);
+
+    for (long n = 1000; n <= opts.max; n *= 10)
+    {
+        if (group_selected(&opts, "watch_"))
+            micro_watchers(&opts, n);
+    }
+    for (long n = 1000; n <= opts.max; n *= 10)
+    {
+        if (group_selected(&opts, "dict_"))
+            micro_dict(&opts, n);
+    }
+
+    // argument lines up to MAX_ARGS - 1 args, the parser refuses more
+    int args[] = {2, 8, MAX_ARGS - 2};
+    int arg_lens[] = {16, 256, PATH_MAX};
+    for (int i = 0; i < 3 && selected(&opts, "parse_command"); i++)
+    {
+        for (int j = 0; j < 3; j++)
+        {
+            micro_parse(&opts, args[i], arg_lens[j]);
+        }
+    }
+
+    // paths of 7 chars per level, up to PATH_MAX
+    int depths[] = {1, 8, 64, 512};
+    for (int i = 0; i < 4 && selected(&opts, "join_paths"); i++)
+    {
+        micro_join(&opts, depths[i]);
+    }
+
+    return EXIT_SUCCESS;
+}
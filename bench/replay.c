@@ -0,0 +1,408 @@
+#include "resync.h"
+#include "trace.h"
+#include "worker.h"
+
+#include <limits.h>
+
+typedef struct ReplayOptions
+{
+    char* trace;   // recorded trace
+    char* dir;     // dir where source and target are made, tmpfs keeps disk out of results
+    int pace;      // buffers are handled at recorded times instead of at once
+    int debounce;  // debounce window of replaying worker, like add --debounce=
+    char* label;   // label of results, e.g. commit
+} ReplayOptions;
+
+// recorded wds of watches mapped to wds of replaying worker
+typedef struct WdMap
+{
+    int* wds;  // replay wd of every recorded wd, -1 if it's unknown
+    int cap;   // size of wds
+} WdMap;
+
+// state of the source that events are applied to before they're handled
+typedef struct Replay
+{
+    Worker* wk;             // replaying worker
+    char* src;              // source of recorded worker
+    size_t src_len;         // length of src
+    WdMap map;              // wds of recorded watches
+    uint32_t cookie;        // cookie of move waiting for its IN_MOVED_TO, 0 if none
+    char* move_path;        // path of waiting move in replay source
+    unsigned long buffers;  // replayed buffers
+} Replay;
+
+static void replay_usage(char* name)
+{
+    fprintf(stderr, "Usage: %s [--dir=PATH] [--pace] [--debounce=MS] [--label=STR] <trace>\n", name);
+    exit(EXIT_FAILURE);
+}
+
+static void parse_replay_options(int argc, char** argv, ReplayOptions* opts)
+{
+    opts->trace = NULL;
+    opts->dir = "/dev/shm";
+    opts->pace = 0;
+    opts->debounce = 0;
+    opts->label = "local";
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strncmp(argv[i], "--dir=", 6) == 0)
+            opts->dir = argv[i] + 6;
+        else if (strcmp(argv[i], "--pace") == 0)
+            opts->pace = 1;
+        else if (strncmp(argv[i], "--debounce=", 11) == 0 && atoi(argv[i] + 11) >= 0
+                 && atoi(argv[i] + 11) <= COALESCE_MAX_DEBOUNCE)
+            opts->debounce = atoi(argv[i] + 11);
+        else if (strncmp(argv[i], "--label=", 8) == 0)
+            opts->label = argv[i] + 8;
+        else if (strncmp(argv[i], "--", 2) != 0 && opts->trace == NULL)
+            opts->trace = argv[i];
+        else
+            replay_usage(argv[0]);
+    }
+    if (opts->trace == NULL)
+        replay_usage(argv[0]);
+}
+
+static void map_set(WdMap* map, int from, int to)
+{
+    if (from < 0)
+        return;
+    if (from >= map->cap)
+    {
+        int cap = map->cap > 0 ? map->cap : 64;
+        while (cap <= from)
+        {
+            cap *= 2;
+        }
+        int* wds = realloc(map->wds, sizeof(int) * cap);
+        if (wds == NULL)
+        {
+            ERR("realloc");
+            exit(EXIT_FAILURE);
+        }
+        for (int i = map->cap; i < cap; i++)
+        {
+            wds[i] = -1;
+        }
+        map->wds = wds;
+        map->cap = cap;
+    }
+    map->wds[from] = to;
+}
+
+// replay wd of recorded wd, -1 keeps overflow events and unknown watches without watch
+static int map_get(WdMap* map, int from) { return from >= 0 && from < map->cap ? map->wds[from] : -1; }
+
+// path in replay source of path in recorded source, NULL if it's outside of it
+static char* replay_path(Replay* r, const char* path, size_t len)
+{
+    if (len < r->src_len || memcmp(path, r->src, r->src_len) != 0
+        || (len > r->src_len && path[r->src_len] != '/'))
+        return NULL;
+
+    size_t root_len = strlen(r->wk->src);
+    char* copy = malloc(root_len + len - r->src_len + 1);
+    if (copy == NULL)
+    {
+        ERR("malloc");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(copy, r->wk->src, root_len);
+    memcpy(copy + root_len, path + r->src_len, len - r->src_len);
+    copy[root_len + len - r->src_len] = '\0';
+    return copy;
+}
+
+// file or dir at path, it's fine when it's there already
+static void make_path(char* path, int dir)
+{
+    if (dir)
+    {
+        mkdir(path, 0755);
+        return;
+    }
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0644);
+    if (fd >= 0)
+        close(fd);
+}
+
+static void remove_path(char* path)
+{
+    struct stat st;
+    if (lstat(path, &st) != 0)
+        return;
+    if (S_ISDIR(st.st_mode))
+        rm_dir_recursive(path);
+    else
+        unlink(path);
+}
+
+static void clear_move(Replay* r)
+{
+    free(r->move_path);
+    r->move_path = NULL;
+    r->cookie = 0;
+}
+
+// make change of event in the replay source, so the worker finds what the recorded one found
+// only names are recreated, files are empty
+static void apply_event(Replay* r, struct inotify_event* event, char* path)
+{
+    int dir = event->mask & IN_ISDIR;
+
+    // waiting move without its pair left the source
+    if (r->cookie != 0 && !(event->mask & IN_MOVED_TO && event->cookie == r->cookie))
+    {
+        remove_path(r->move_path);
+        clear_move(r);
+    }
+
+    if (event->mask & IN_CREATE)
+    {
+        make_path(path, dir);
+    }
+    else if (event->mask & IN_DELETE)
+    {
+        remove_path(path);
+    }
+    else if (event->mask & IN_MOVED_FROM)
+    {
+        make_path(path, dir);
+        r->cookie = event->cookie;
+        r->move_path = strdup(path);
+        if (r->move_path == NULL)
+        {
+            ERR("strdup");
+            exit(EXIT_FAILURE);
+        }
+    }
+    else if (event->mask & IN_MOVED_TO)
+    {
+        // pair renames, moved in from outside of the source is made
+        if (event->cookie == r->cookie && r->cookie != 0)
+        {
+            rename(r->move_path, path);
+            clear_move(r);
+        }
+        else
+        {
+            make_path(path, dir);
+        }
+    }
+    else if (!dir && event->mask & (IN_CLOSE_WRITE | IN_MODIFY | IN_ATTRIB))
+    {
+        make_path(path, 0);
+    }
+}
+
+// map wds of buffer to replay watches and apply its changes to the replay source
+static void apply_buffer(Replay* r, char* buffer, ssize_t len)
+{
+    for (ssize_t i = 0; i < len; i += sizeof(struct inotify_event) + ((struct inotify_event*)&buffer[i])->len)
+    {
+        struct inotify_event* event = (struct inotify_event*)&buffer[i];
+        event->wd = map_get(&r->map, event->wd);
+
+        Watch* watch = search_watch(r->wk->watchers, event->wd);
+        if (watch == NULL || event->mask & (IN_Q_OVERFLOW | IN_IGNORED))
+            continue;
+
+        char* path = event->len > 0 ? join_paths(watch->path, event->name) : strdup(watch->path);
+        if (path == NULL)
+        {
+            ERR("strdup");
+            exit(EXIT_FAILURE);
+        }
+        apply_event(r, event, path);
+        free(path);
+    }
+}
+
+// dirs watched at the start of recording, before its first events
+static void make_initial_tree(Replay* r, Trace* t)
+{
+    TraceRecord record;
+    const char* data;
+    while (trace_next(t, &record, &data) && record.type == TRACE_WATCH)
+    {
+        char* path = replay_path(r, data, record.len);
+        if (path != NULL)
+            make_path(path, 1);
+        free(path);
+    }
+    trace_rewind(t);
+}
+
+// handle buffer like a worker does after it's read, returns us it took
+static long long handle_buffer(Replay* r, char* buffer, ssize_t len)
+{
+    Worker* wk = r->wk;
+    long long start = monotonic_us();
+
+    wk->event_us = start;
+    handle_events(wk, buffer, len);
+    if (wk->rescan)
+        resync_source(wk);
+    finish_move(wk, monotonic_ms());
+    run_pending_ops(wk, monotonic_ms());
+    log_tick(wk->logs, monotonic_ms());
+    r->buffers++;
+
+    return monotonic_us() - start;
+}
+
+// replay all records of trace, returns us spent in the worker
+static long long replay_trace(Replay* r, Trace* t, int pace)
+{
+    Worker* wk = r->wk;
+    long long busy = 0;
+    long long start = monotonic_us();
+    long long first = -1;
+
+    TraceRecord record;
+    const char* data;
+    char buffer[EVENT_BUF_LEN];
+    while (trace_next(t, &record, &data))
+    {
+        if (record.type == TRACE_WATCH)
+        {
+            // recorded worker watched new dir while it handled the previous buffer, replaying one did too
+            char* path = replay_path(r, data, record.len);
+            Watch* watch = path != NULL ? search_watch_path(wk->watchers, path) : NULL;
+            map_set(&r->map, record.wd, watch != NULL ? watch->wd : -1);
+            free(path);
+            continue;
+        }
+        if (record.type != TRACE_EVENTS || record.len > sizeof(buffer))
+        {
+            fprintf(stderr, "Broken record in trace\n");
+            exit(EXIT_FAILURE);
+        }
+
+        // buffer is handled when it was read, relative to the first one
+        if (first < 0)
+            first = record.time_us;
+        long long wait = start + record.time_us - first - monotonic_us();
+        if (pace && wait > 0)
+        {
+            struct timespec ts = {wait / 1000000, wait % 1000000 * 1000};
+            while (nanosleep(&ts, &ts) != 0 && errno == EINTR)
+            {
+            }
+        }
+
+        memcpy(buffer, data, record.len);
+        apply_buffer(r, buffer, record.len);
+        busy += handle_buffer(r, buffer, record.len);
+    }
+
+    // move without pair and ops waiting for their window finish like at exit
+    long long end = monotonic_us();
+    if (r->cookie != 0)
+        remove_path(r->move_path);
+    clear_move(r);
+    finish_move(wk, LLONG_MAX);
+    run_pending_ops(wk, LLONG_MAX);
+    return busy + monotonic_us() - end;
+}
+
+static const char* base_name(const char* path)
+{
+    const char* slash = strrchr(path, '/');
+    return slash != NULL ? slash + 1 : path;
+}
+
+static char* make_dir(char* root, const char* name)
+{
+    char* path = join_paths(root, (char*)name);
+    if (mkdir(path, 0755) != 0)
+    {
+        ERR("mkdir");
+        exit(EXIT_FAILURE);
+    }
+    return path;
+}
+
+int main(int argc, char** argv)
+{
+    ReplayOptions opts;
+    parse_replay_options(argc, argv, &opts);
+
+    Trace* t = trace_load(opts.trace);
+    if (t == NULL)
+        exit(EXIT_FAILURE);
+
+    char work[PATH_MAX];
+    if (snprintf(work, sizeof(work), "%s/sop-replay-XXXXXX", opts.dir) >= (int)sizeof(work) || mkdtemp(work) == NULL)
+    {
+        ERR("mkdtemp");
+        exit(EXIT_FAILURE);
+    }
+    char* real = realpath(work, NULL);
+    if (real == NULL)
+    {
+        ERR("realpath");
+        exit(EXIT_FAILURE);
+    }
+    char* src = make_dir(real, "src");
+    char* target = make_dir(real, "target");
+    char* log_path = join_paths(real, "replay.log");
+    Log* logs = log_open(log_path, LOG_LEVEL_WARN);
+
+    // latency of replayed ops goes to stats of replaying worker
+    WorkerStats* stats = calloc(1, sizeof(WorkerStats));
+    if (stats == NULL)
+    {
+        ERR("calloc");
+        exit(EXIT_FAILURE);
+    }
+    copy_stats = &stats->copy;
+
+    Worker wk = {src, target, logs, NULL, NULL, NULL, NULL, NULL, 0, 0, 0, NULL, 0, 0, 0, 0, 0, 0, stats, 0, NULL, NULL, 0, WATCH_OWN};
+    Replay r = {&wk, t->src, strlen(t->src), {NULL, 0}, 0, NULL, 0};
+
+    // source starts with dirs the recorded worker watched, target is its copy
+    make_initial_tree(&r, t);
+    wk.checkpoint = realtime_ns();
+    copy_dir(src, target, src, target, logs);
+    wk.manifest = manifest_start(target);
+    wk.cache = delta_cache_init();
+    wk.pending = coalescer_init(opts.debounce);
+    wk.watchers = watchers_init(WATCH_INOTIFY);
+    if (wk.watchers == NULL)
+        exit(EXIT_FAILURE);
+    add_watch_recursive(wk.watchers, strdup(src));
+
+    long long start = monotonic_us();
+    long long busy = replay_trace(&r, t, opts.pace);
+    double wall = (monotonic_us() - start) / 1e6;
+    double secs = busy / 1e6;
+
+    LatencyHist* copies = &stats->latency[LATENCY_COPY];
+    fprintf(stdout,
+            "{\"label\":\"%s\",\"bench\":\"replay\",\"trace\":\"%s\",\"pace\":%d,\"debounce\":%d,\"buffers\":%lu,"
+            "\"events\":%lu,\"ops\":%lu,\"seconds\":%.6f,\"wall_seconds\":%.6f,\"events_per_s\":%.1f,"
+            "\"copy_p50_ms\":%.3f,\"copy_p99_ms\":%.3f}\n",
+            opts.label, base_name(opts.trace), opts.pace, opts.debounce, r.buffers, wk.events, wk.ops, secs, wall,
+            secs > 0 ? wk.events / secs : 0, latency_percentile(copies, 0.5) / 1000.0,
+            latency_percentile(copies, 0.99) / 1000.0);
+
+    free_watchers(wk.watchers);
+    free_delta_cache(wk.cache);
+    free_coalescer(wk.pending);
+    manifest_close(wk.manifest);
+    log_close(logs);
+    free(r.map.wds);
+    free(stats);
+    trace_close(t);
+    rm_dir_recursive(real);
+    free(log_path);
+    free(src);
+    free(target);
+    free(real);
+    return EXIT_SUCCESS;
+}
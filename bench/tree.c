@@ -0,0 +1,179 @@
+#include "tree.h"
+
+#include <limits.h>
+
+#define TREE_BUF_LEN (64 * 1024)  // bytes of file data written at once
+
+static TreeSpec specs[] = {
+    // many tiny files in a wide tree
+    {"tiny", 100, 10, 100, 0, 4096, 0},
+    // a few huge files
+    {"huge", 0, 1, 4, 16 * 1024 * 1024, 16 * 1024 * 1024, 0},
+    // one chain of nested dirs
+    {"deep", 128, 1, 4, 0, 16384, 0},
+    // files mixed with every kind of symlink
+    {"symlinks", 20, 5, 20, 0, 4096, 20},
+    {NULL, 0, 0, 0, 0, 0, 0},
+};
+
+void rng_seed(Rng* rng, uint64_t seed) { rng->state = seed != 0 ? seed : 0x9e3779b97f4a7c15ULL; }
+
+// xorshift64*, quick and good enough for file data and sizes
+uint64_t rng_next(Rng* rng)
+{
+    rng->state ^= rng->state >> 12;
+    rng->state ^= rng->state << 25;
+    rng->state ^= rng->state >> 27;
+    return rng->state * 0x2545f4914f6cdd1dULL;
+}
+
+// spec of tree with given name, NULL if there isn't one
+TreeSpec* tree_spec(const char* name)
+{
+    for (TreeSpec* spec = specs; spec->name != NULL; spec++)
+    {
+        if (strcmp(spec->name, name) == 0)
+            return spec;
+    }
+    return NULL;
+}
+
+// write file of size random bytes
+void tree_write_file(char* path, size_t size, Rng* rng)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        ERR("open");
+        exit(EXIT_FAILURE);
+    }
+
+    uint64_t buf[TREE_BUF_LEN / sizeof(uint64_t)];
+    while (size > 0)
+    {
+        size_t len = size < TREE_BUF_LEN ? size : TREE_BUF_LEN;
+        for (size_t i = 0; i < (len + 7) / 8; i++)
+        {
+            buf[i] = rng_next(rng);
+        }
+
+        size_t done = 0;
+        while (done < len)
+        {
+            ssize_t n = write(fd, (char*)buf + done, len - done);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0)
+            {
+                ERR("write");
+                exit(EXIT_FAILURE);
+            }
+            done += n;
+        }
+        size -= len;
+    }
+
+    if (close(fd) < 0)
+    {
+        ERR("close");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// files and symlinks of one dir
+static void fill_dir(TreeSpec* spec, size_t scale_size, char* root, char* dir, Rng* rng, TreeInfo* info)
+{
+    char path[PATH_MAX];
+    for (int i = 0; i < spec->files; i++)
+    {
+        size_t size = spec->min_size + rng_next(rng) % (spec->max_size - spec->min_size + 1);
+        size *= scale_size;
+        snprintf(path, sizeof(path), "%s/f%d", dir, i);
+        tree_write_file(path, size, rng);
+        info->files++;
+        info->bytes += size;
+    }
+
+    char link[PATH_MAX];
+    for (int i = 0; i < spec->symlinks; i++)
+    {
+        switch (i % 4)
+        {
+            case 0:
+                snprintf(link, sizeof(link), "f%d", i % (spec->files > 0 ? spec->files : 1));
+                break;
+            case 1:
+                snprintf(link, sizeof(link), "%s/f0", root);
+                break;
+            case 2:
+                snprintf(link, sizeof(link), "/tmp");
+                break;
+            default:
+                snprintf(link, sizeof(link), "missing-%d", i);
+                break;
+        }
+        snprintf(path, sizeof(path), "%s/l%d", dir, i);
+        if (symlink(link, path) != 0)
+        {
+            ERR("symlink");
+            exit(EXIT_FAILURE);
+        }
+        info->symlinks++;
+    }
+}
+
+// generate tree of spec in root, root mustn't exist, the same seed and scale give the same tree
+void tree_generate(TreeSpec* spec, int scale, uint64_t seed, char* root, TreeInfo* info)
+{
+    Rng rng;
+    rng_seed(&rng, seed);
+    memset(info, 0, sizeof(TreeInfo));
+
+    // trees without dirs get larger files instead of more dirs
+    int dirs = spec->dirs * scale;
+    size_t scale_size = spec->dirs == 0 ? scale : 1;
+
+    // paths of all dirs, parent of dir i is dir (i - 1) / fanout, dir 0 is root
+    char** paths = malloc(sizeof(char*) * (dirs + 1));
+    if (paths == NULL)
+    {
+        ERR("malloc");
+        exit(EXIT_FAILURE);
+    }
+    if (mkdir(root, 0755) != 0)
+    {
+        ERR("mkdir");
+        exit(EXIT_FAILURE);
+    }
+    paths[0] = strdup(root);
+    if (paths[0] == NULL)
+    {
+        ERR("strdup");
+        exit(EXIT_FAILURE);
+    }
+
+    char name[32];
+    for (int i = 1; i <= dirs; i++)
+    {
+        snprintf(name, sizeof(name), "d%d", i);
+        paths[i] = join_paths(paths[(i - 1) / spec->fanout], name);
+        if (strlen(paths[i]) > PATH_MAX - NAME_MAX)
+        {
+            fprintf(stderr, "Tree %s is too deep for scale %d\n", spec->name, scale);
+            exit(EXIT_FAILURE);
+        }
+        if (mkdir(paths[i], 0755) != 0)
+        {
+            ERR("mkdir");
+            exit(EXIT_FAILURE);
+        }
+        info->dirs++;
+    }
+
+    for (int i = 0; i <= dirs; i++)
+    {
+        fill_dir(spec, scale_size, root, paths[i], &rng, info);
+        free(paths[i]);
+    }
+    free(paths);
+}
@@ -0,0 +1,45 @@
+#ifndef TREE_H
+#define TREE_H
+
+#include "utils.h"
+
+#include <stdint.h>
+
+// shape of generated tree, scale multiplies dirs or, for trees without dirs, file sizes
+typedef struct TreeSpec
+{
+    const char* name;  // name of tree in results
+    int dirs;          // dirs without root
+    int fanout;        // subdirs of every dir, 1 makes one deep chain
+    int files;         // regular files in every dir
+    size_t min_size;   // smallest file
+    size_t max_size;   // largest file
+    int symlinks;      // symlinks in every dir: relative, absolute inside and outside of tree, dangling
+} TreeSpec;
+
+// what generated tree contains
+typedef struct TreeInfo
+{
+    unsigned long dirs;        // dirs without root
+    unsigned long files;       // regular files
+    unsigned long symlinks;    // symlinks
+    unsigned long long bytes;  // bytes of regular files
+} TreeInfo;
+
+// random numbers of one tree, same seed gives the same tree
+typedef struct Rng
+{
+    uint64_t state;  // xorshift64* state, never 0
+} Rng;
+
+void rng_seed(Rng* rng, uint64_t seed);
+
+uint64_t rng_next(Rng* rng);
+
+TreeSpec* tree_spec(const char* name);
+
+void tree_generate(TreeSpec* spec, int scale, uint64_t seed, char* root, TreeInfo* info);
+
+void tree_write_file(char* path, size_t size, Rng* rng);
+
+#endif
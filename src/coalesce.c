@@ -0,0 +1,287 @@
+#include "coalesce.h"
+
+#include <limits.h>
+
+// create empty coalescer with window of debounce ms
+Coalescer* coalescer_init(int debounce)
+{
+    Coalescer* c = malloc(sizeof(Coalescer));
+    if (c == NULL)
+    {
+        ERR("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    c->head = NULL;
+    c->tail = NULL;
+    c->index = calloc(COALESCE_BUCKETS, sizeof(PendingOp*));
+    if (c->index == NULL)
+    {
+        ERR("calloc");
+        exit(EXIT_FAILURE);
+    }
+    c->size = 0;
+    c->debounce = debounce;
+    c->seq = 0;
+    c->merged = 0;
+
+    return c;
+}
+
+// free coalescer with ops that weren't executed
+void free_coalescer(Coalescer* c)
+{
+    if (c == NULL)
+        return;
+
+    PendingOp* p = c->head;
+    while (p != NULL)
+    {
+        PendingOp* next = p->next;
+        free(p->op.path);
+        free(p);
+        p = next;
+    }
+
+    free(c->index);
+    free(c);
+}
+
+// how much op rewrites a regular file, op with higher rank includes the lower ones
+static int file_rank(OpType type)
+{
+    switch (type)
+    {
+        case OP_ATTRIB:
+            return 1;
+        case OP_UPDATE_FILE:
+            return 2;
+        case OP_COPY_FILE:
+            return 3;
+        default:
+            return 0;
+    }
+}
+
+// FNV-1a hash of path
+static uint64_t path_hash(const char* path)
+{
+    uint64_t hash = 1469598103934665603ULL;
+    for (; *path != '\0'; path++)
+    {
+        hash ^= (unsigned char)*path;
+        hash *= 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+// bucket of index where ops with given hash of path are
+static PendingOp** bucket(Coalescer* c, uint64_t hash) { return &c->index[hash & (COALESCE_BUCKETS - 1)]; }
+
+// put op in index by its path
+static void index_pending(Coalescer* c, PendingOp* p)
+{
+    p->hash = path_hash(p->op.path);
+    PendingOp** b = bucket(c, p->hash);
+    p->same_hash = *b;
+    *b = p;
+}
+
+// take op out of index
+static void unindex_pending(Coalescer* c, PendingOp* p)
+{
+    PendingOp** link = bucket(c, p->hash);
+    while (*link != p)
+        link = &(*link)->same_hash;
+    *link = p->same_hash;
+}
+
+// newest pending op for path, only ops of its bucket are compared
+static PendingOp* find_pending(Coalescer* c, char* path)
+{
+    uint64_t hash = path_hash(path);
+    PendingOp* found = NULL;
+
+    for (PendingOp* p = *bucket(c, hash); p != NULL; p = p->same_hash)
+    {
+        if (p->hash == hash && (found == NULL || p->seq > found->seq) && strcmp(p->op.path, path) == 0)
+            found = p;
+    }
+
+    return found;
+}
+
+// take pending op out of queue and index, its path stays with caller
+static void unlink_pending(Coalescer* c, PendingOp* p)
+{
+    if (p->prev == NULL)
+        c->head = p->next;
+    else
+        p->prev->next = p->next;
+    if (p->next == NULL)
+        c->tail = p->prev;
+    else
+        p->next->prev = p->prev;
+    unindex_pending(c, p);
+    c->size--;
+}
+
+// remove pending op from queue
+static void remove_pending(Coalescer* c, PendingOp* p)
+{
+    unlink_pending(c, p);
+    free(p->op.path);
+    free(p);
+}
+
+// add op at the end of queue, existed is 0 when the target can't have the file yet
+static void append_pending(Coalescer* c, OpType type, char* path, long long now, long long queued, int existed)
+{
+    PendingOp* p = malloc(sizeof(PendingOp));
+    if (p == NULL)
+    {
+        ERR("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    p->op.type = type;
+    p->op.from = NULL;
+    p->op.queued = queued;
+    p->op.path = strdup(path);
+    if (p->op.path == NULL)
+    {
+        ERR("strdup");
+        exit(EXIT_FAILURE);
+    }
+    p->existed = existed;
+    p->deadline = now + c->debounce;
+    p->seq = c->seq++;
+    p->next = NULL;
+    p->prev = c->tail;
+
+    if (c->tail == NULL)
+        c->head = p;
+    else
+        c->tail->next = p;
+    c->tail = p;
+    index_pending(c, p);
+    c->size++;
+}
+
+// merge op of file event with pending op of the same path, or queue it
+// merged op keeps time of its first event, its latency covers the whole window
+// created is set for op of IN_CREATE, only such file can't be in the target yet
+// file moved in over a backed up one replaces it, so its delete still has to run
+void coalesce_add(Coalescer* c, OpType type, char* path, long long now, long long queued, int created)
+{
+    PendingOp* p = find_pending(c, path);
+
+    if (p == NULL)
+    {
+        append_pending(c, type, path, now, queued, !created);
+        return;
+    }
+
+    if (type == OP_DELETE_FILE)
+    {
+        c->merged++;
+        // file created and deleted in one window - nothing to do
+        if (!p->existed)
+            remove_pending(c, p);
+        else
+            p->op.type = OP_DELETE_FILE;
+        return;
+    }
+
+    // file was deleted and created again, delete has to run first
+    if (p->op.type == OP_DELETE_FILE)
+    {
+        append_pending(c, type, path, now, queued, !created);
+        return;
+    }
+
+    // symlink changes aren't merged with file changes
+    if (p->op.type == OP_SYMLINK || type == OP_SYMLINK)
+    {
+        if (p->op.type == type || type == OP_ATTRIB)
+        {
+            c->merged++;
+            return;
+        }
+        append_pending(c, type, path, now, queued, !created);
+        return;
+    }
+
+    // keep op that rewrites more of the file
+    c->merged++;
+    if (file_rank(type) > file_rank(p->op.type))
+        p->op.type = type;
+}
+
+// take oldest op with deadline before now, 1 if op was taken, caller frees op path
+// now equal LLONG_MAX takes all ops
+int coalesce_next(Coalescer* c, long long now, Op* op)
+{
+    PendingOp* p = c->head;
+    if (p == NULL || p->deadline > now)
+        return 0;
+
+    *op = p->op;
+    unlink_pending(c, p);
+    free(p);
+
+    return 1;
+}
+
+// ms until the oldest pending op is due, -1 if nothing is pending
+int coalesce_timeout(Coalescer* c, long long now)
+{
+    if (c->head == NULL)
+        return -1;
+    if (c->head->deadline <= now)
+        return 0;
+
+    long long left = c->head->deadline - now;
+    return left > INT_MAX ? INT_MAX : (int)left;
+}
+
+// drop all pending ops of path, they were superseded
+void coalesce_drop(Coalescer* c, char* path)
+{
+    PendingOp* p = NULL;
+
+    while ((p = find_pending(c, path)) != NULL)
+    {
+        c->merged++;
+        remove_pending(c, p);
+    }
+}
+
+// change paths of pending ops of moved file or directory old_path to new_path
+// move copies missing entries to new path, so they're treated as backed up
+void coalesce_rename(Coalescer* c, const char* old_path, const char* new_path)
+{
+    size_t old_len = strlen(old_path);
+
+    for (PendingOp* p = c->head; p != NULL; p = p->next)
+    {
+        if (strncmp(p->op.path, old_path, old_len) != 0 || (p->op.path[old_len] != '/' && p->op.path[old_len] != '\0'))
+            continue;
+
+        char* path = malloc(strlen(new_path) + strlen(p->op.path + old_len) + 1);
+        if (path == NULL)
+        {
+            ERR("malloc");
+            exit(EXIT_FAILURE);
+        }
+        strcpy(path, new_path);
+        strcat(path, p->op.path + old_len);
+
+        unindex_pending(c, p);
+        free(p->op.path);
+        p->op.path = path;
+        p->existed = 1;
+        index_pending(c, p);
+    }
+}
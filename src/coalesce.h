@@ -0,0 +1,50 @@
+#ifndef COALESCE_H
+#define COALESCE_H
+
+#include "op.h"
+#include "utils.h"
+
+#include <stdint.h>
+
+#define COALESCE_MAX_PENDING 4096
+#define COALESCE_MAX_DEBOUNCE 60000  // longest debounce window in ms
+#define COALESCE_BUCKETS 1024        // buckets of index of pending ops by path, power of 2
+
+typedef struct PendingOp
+{
+    Op op;                        // op waiting for the end of its window, path is owned
+    int existed;                  // target file could exist before first event of window
+    long long deadline;           // time when op is executed, in ms
+    uint64_t hash;                // hash of path
+    unsigned long seq;            // order in which ops were queued
+    struct PendingOp* next;       // next pending op, ops are in order of first event
+    struct PendingOp* prev;       // previous pending op
+    struct PendingOp* same_hash;  // next op in the same bucket of index
+} PendingOp;
+
+typedef struct Coalescer
+{
+    PendingOp* head;         // oldest pending op
+    PendingOp* tail;         // newest pending op
+    PendingOp** index;       // buckets of pending ops by hash of path
+    int size;                // number of pending ops
+    int debounce;            // window in ms, 0 merges only events of one read
+    unsigned long seq;       // seq of the next queued op
+    unsigned long merged;    // events merged into pending ops or dropped with them
+} Coalescer;
+
+Coalescer* coalescer_init(int debounce);
+
+void free_coalescer(Coalescer* c);
+
+void coalesce_add(Coalescer* c, OpType type, char* path, long long now, long long queued, int created);
+
+int coalesce_next(Coalescer* c, long long now, Op* op);
+
+int coalesce_timeout(Coalescer* c, long long now);
+
+void coalesce_drop(Coalescer* c, char* path);
+
+void coalesce_rename(Coalescer* c, const char* old_path, const char* new_path);
+
+#endif
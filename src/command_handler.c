@@ -1,15 +1,148 @@
 #include "command_handler.h"
 
-// handle add command
-void handle_add(Dict* dict, char** argv, int argc, FILE* logs)
+// parse --name=value options of add command, returns index of first path or -1 on error
+int parse_options(char** argv, int argc, WorkerOptions* opts)
 {
-    if (argc < 3)
+    // default options
+    opts->threads = 1;
+    opts->fanout = 0;
+    opts->debounce = 0;
+    opts->backend = WATCH_INOTIFY;
+    opts->resume = 0;
+    opts->trace = NULL;
+    opts->watchers = NULL;
+
+    int i = 1;
+    for (; i < argc && strncmp(argv[i], "--", 2) == 0; i++)
+    {
+        if (strncmp(argv[i], "--threads=", 10) == 0)
+        {
+            opts->threads = atoi(argv[i] + 10);
+            if (opts->threads < 1 || opts->threads > POOL_MAX_THREADS)
+            {
+                fprintf(stdout, "Number of threads must be between 1 and %d\n", POOL_MAX_THREADS);
+                return -1;
+            }
+        }
+        else if (strncmp(argv[i], "--debounce=", 11) == 0)
+        {
+            opts->debounce = atoi(argv[i] + 11);
+            if (opts->debounce < 0 || opts->debounce > COALESCE_MAX_DEBOUNCE)
+            {
+                fprintf(stdout, "Debounce window must be between 0 and %d ms\n", COALESCE_MAX_DEBOUNCE);
+                return -1;
+            }
+        }
+        else if (strcmp(argv[i], "--backend=inotify") == 0)
+        {
+            opts->backend = WATCH_INOTIFY;
+        }
+        else if (strcmp(argv[i], "--backend=fanotify") == 0)
+        {
+            opts->backend = WATCH_FANOTIFY;
+        }
+        else if (strcmp(argv[i], "--fanout") == 0)
+        {
+            opts->fanout = 1;
+        }
+        else if (strcmp(argv[i], "--resume") == 0)
+        {
+            opts->resume = 1;
+        }
+        else if (strncmp(argv[i], "--trace=", 8) == 0 && argv[i][8] != '\0')
+        {
+            opts->trace = argv[i] + 8;
+        }
+        else
+        {
+            fprintf(stdout, "Unrecognised option: %s\n", argv[i]);
+            return -1;
+        }
+    }
+
+    return i;
+}
+
+// fork worker for src and targets, returns pid of worker or -1
+static pid_t spawn_worker(char* src, char** targets, int count, WorkerOptions* opts, WorkerStats* stats, Log* logs)
+{
+    // create child worker, it mustn't print buffered output or log records again
+    fflush(stdout);
+    log_flush(logs);
+    pid_t pid = fork();
+
+    switch (pid)
+    {
+        case 0:
+            set_handler(SIG_IGN, SIGINT); // only parent handles SIGINT
+
+            // real path of source directory
+            char* src_path = realpath(src, NULL);
+            if (src_path == NULL)
+            {
+                ERR("realpath, worker didn't start");
+                exit(EXIT_FAILURE);
+            }
+
+            char** target_paths = malloc(sizeof(char*) * count);
+            if (target_paths == NULL)
+            {
+                ERR("malloc");
+                exit(EXIT_FAILURE);
+            }
+            for (int i = 0; i < count; i++)
+            {
+                // check if target directory exists/is empty
+                if (check_dir(targets[i], opts->resume) != 0)
+                    exit(EXIT_FAILURE);
+
+                // real path of target directory
+                target_paths[i] = realpath(targets[i], NULL);
+                if (target_paths[i] == NULL)
+                {
+                    ERR("realpath, worker didn't start");
+                    exit(EXIT_FAILURE);
+                }
+            }
+
+            start_worker(src_path, target_paths, count, opts, stats, logs);
+            exit(EXIT_FAILURE);
+        case -1:
+            ERR("fork, worker didn't start");
+            stats_release(stats, STATS_STARTING);
+            return -1;
+        default:
+            break;
+    }
+
+    stats_own(stats, pid);
+    return pid;
+}
+
+// "Restore" or "Backup" for active src&target pair
+static const char* active_kind(Dict* dict, char* src, char* target)
+{
+    Node* node = search_node(dict, src, target);
+    return node != NULL && node->progress != NULL ? "Restore" : "Backup";
+}
+
+// handle add command, pairs go to engine when it's enabled
+void handle_add(Dict* dict, char** argv, int argc, StatsTable* stats, Engine* engine, Log* logs)
+{
+    WorkerOptions opts;
+    int first = parse_options(argv, argc, &opts);
+    if (first < 0)
+    {
+        return;
+    }
+
+    if (argc - first < 2)
     {
         fprintf(stdout, "Not enough arguments for add\n");
         return;
     }
 
-    char* src = argv[1];
+    char* src = argv[first];
 
     if (check_path(src) < 0)
     {
@@ -17,58 +150,102 @@ void handle_add(Dict* dict, char** argv, int argc, FILE* logs)
         return;
     }
 
-    for (int i = 2; i < argc; i++)
+    // one worker reads source for all targets
+    if (opts.fanout)
+    {
+        char* targets[FANOUT_MAX_TARGETS];
+        int count = 0;
+        for (int i = first + 1; i < argc; i++)
+        {
+            // check if backup for given src&target pair already exists
+            if (search(dict, src, argv[i]) != 0)
+            {
+                fprintf(stdout, "%s for %s to %s already exists!\n", active_kind(dict, src, argv[i]), src, argv[i]);
+                continue;
+            }
+            if (count == FANOUT_MAX_TARGETS)
+            {
+                fprintf(stdout, "Too many targets, fan-out supports up to %d\n", FANOUT_MAX_TARGETS);
+                return;
+            }
+            targets[count++] = argv[i];
+        }
+        if (count == 0)
+        {
+            return;
+        }
+
+        WorkerStats* slot = stats_claim(stats);
+        pid_t pid = spawn_worker(src, targets, count, &opts, slot, logs);
+        if (pid < 0)
+        {
+            return;
+        }
+
+        // add to dictionary, index is used by end command
+        for (int i = 0; i < count; i++)
+        {
+            insert(dict, src, targets[i], pid, i)->stats = slot;
+        }
+        fprintf(stdout, "Started fan-out backup for %s to %d targets, with worker %d.\n", src, count, pid);
+        return;
+    }
+
+    for (int i = first + 1; i < argc; i++)
     {
         char* target = argv[i];
         // check if backup for given src&target pair already exists
         if (search(dict, src, target) != 0)
         {
-            fprintf(stdout, "Backup for %s to %s already exists!\n", src, target);
+            fprintf(stdout, "%s for %s to %s already exists!\n", active_kind(dict, src, target), src, target);
             continue;
         }
-        // create child worker:
-        pid_t pid = fork();
 
-        switch (pid)
-        {
-            case 0:
-                set_handler(SIG_IGN, SIGINT); // only parent handles SIGINT
+        WorkerStats* slot = stats_claim(stats);
 
-                // check if target directory exists/is empty
-                if (check_dir(target) != 0)
-                    exit(EXIT_FAILURE);
+        // engine thread serves pair, index of node is its id
+        if (engine != NULL)
+        {
+            int id = engine_add(engine, src, target, &opts, slot, logs);
+            if (id < 0)
+            {
+                continue;
+            }
 
-                // real path of source directory and target directory
-                char* src_path = realpath(src, NULL);
-                if (src_path == NULL)
-                {
-                    ERR("realpath, worker didn't start");
-                    exit(EXIT_FAILURE);
-                }
-                char* target_path = realpath(target, NULL);
-                if (target_path == NULL)
-                {
-                    ERR("realpath, worker didn't start");
-                    exit(EXIT_FAILURE);
-                }
+            insert(dict, src, target, engine->pid, id)->stats = slot;
+            fprintf(stdout, "Started backup for %s to %s, in engine %d.\n", src, target, engine->pid);
+            continue;
+        }
 
-                start_worker(src_path, target_path, logs);
-                exit(EXIT_FAILURE);
-            case -1:
-                ERR("fork, worker didn't start");
-                return;
-            default:
-                break;
+        pid_t pid = spawn_worker(src, &target, 1, &opts, slot, logs);
+        if (pid < 0)
+        {
+            return;
         }
 
         // add to dictionary
-        insert(dict, src, target, pid);
+        insert(dict, src, target, pid, -1)->stats = slot;
         fprintf(stdout, "Started backup for %s to %s, with worker %d.\n", src, target, pid);
     }
 }
 
+// remove pair of engine from dictionary and end it, engine stops with its last pair
+// returns 1 when engine keeps running
+static int end_engine_pair(Dict* dict, Engine* engine, char* src, char* target, int id)
+{
+    delete(dict, src, target);
+    if (count_pid(dict, engine->pid) > 0)
+    {
+        engine_end(engine, id);
+        return 1;
+    }
+
+    engine_stop(engine);
+    return 0;
+}
+
 // handle end command
-void handle_end(Dict* dict, char** argv, int argc)
+void handle_end(Dict* dict, char** argv, int argc, Engine* engine)
 {
     if (argc < 3)
     {
@@ -94,15 +271,49 @@ void handle_end(Dict* dict, char** argv, int argc)
             return;
         }
 
-        // find pid of worker and delete it from dictionary
-        pid_t pid = delete(dict, src, target);
+        // find worker of src&target
+        Node* node = search_node(dict, src, target);
 
         // if backup for src&target doesn't exist continue
-        if (pid == 0)
+        if (node == NULL)
         {
             fprintf(stdout, "There isn't an active backup for %s -> %s\n", src, target);
             continue;
         }
+        if (node->progress != NULL)
+        {
+            fprintf(stdout, "%s -> %s is a restore, it's stopped by cancel\n", src, target);
+            continue;
+        }
+
+        // pair of engine - engine stops with its last pair
+        if (engine != NULL && node->pid == engine->pid)
+        {
+            pid_t pid = node->pid;
+            if (end_engine_pair(dict, engine, src, target, node->index))
+                fprintf(stdout, "Ended backup for %s to %s, engine %d keeps running.\n", src, target, pid);
+            else
+                fprintf(stdout, "Ended backup for %s to %s, stopped engine %d.\n", src, target, pid);
+            continue;
+        }
+
+        // fan-out worker with other targets - stop only this target
+        if (node->index >= 0 && count_pid(dict, node->pid) > 1)
+        {
+            pid_t pid = node->pid;
+            union sigval value = {.sival_int = node->index};
+            delete(dict, src, target);
+            if (sigqueue(pid, TARGET_END_SIGNAL, value) < 0)
+            {
+                ERR_KILL("sigqueue");
+            }
+
+            fprintf(stdout, "Ended backup for %s to %s, worker %d keeps running.\n", src, target, pid);
+            continue;
+        }
+
+        // delete worker from dictionary
+        pid_t pid = delete(dict, src, target);
 
         // kill worker process
         if (kill(pid, SIGTERM) < 0)
@@ -132,17 +343,68 @@ void handle_list(Dict* dict)
     print_dict(dict);
 }
 
-// handle restore
-void handle_restore(Dict* dict, char** argv, int argc, FILE* logs)
+// handle stats command, counters are read from shared memory without stopping workers
+void handle_stats(Dict* dict)
 {
-    if (argc < 3)
+    if (dict->size == 0)
+    {
+        fprintf(stdout, "No active copies.\n");
+        return;
+    }
+
+    fprintf(stdout, "Worker stats:\n");
+    print_dict_stats(dict, print_stats, stdout);
+}
+
+// handle latency command, percentiles are printed or all histograms are written to file
+void handle_latency(Dict* dict, char** argv, int argc)
+{
+    if (dict->size == 0)
+    {
+        fprintf(stdout, "No active copies.\n");
+        return;
+    }
+
+    if (argc < 2)
+    {
+        fprintf(stdout, "Latency from event read to op applied in target:\n");
+        print_dict_stats(dict, print_latencies, stdout);
+        return;
+    }
+
+    FILE* out = fopen(argv[1], "w");
+    if (out == NULL)
+    {
+        fprintf(stdout, "Can't open %s: %s\n", argv[1], strerror(errno));
+        return;
+    }
+    fprintf(out, "# <pid> <op> count=N sum_us=N p50_us=N p99_us=N p999_us=N max_us=N\n");
+    fprintf(out, "# <pid> <op> bucket <low_us> <high_us> <count>\n");
+    print_dict_stats(dict, dump_latencies, out);
+    if (fclose(out) != 0)
+    {
+        ERR("fclose");
+        return;
+    }
+    fprintf(stdout, "Latency histograms written to %s\n", argv[1]);
+}
+
+// handle restore command, restore runs in background and is shown by list
+void handle_restore(Dict* dict, char** argv, int argc, Log* logs)
+{
+    // only --threads= is used by restore
+    WorkerOptions opts;
+    int first = parse_options(argv, argc, &opts);
+    if (first < 0)
+        return;
+    if (argc - first < 2)
     {
         fprintf(stdout, "Not enough arguments for restore\n");
         return;
     }
 
-    char* src = argv[1];
-    char* target = argv[2];
+    char* src = argv[first];
+    char* target = argv[first + 1];
 
     // check if paths are correct
     if (check_path(src) < 0)
@@ -156,48 +418,153 @@ void handle_restore(Dict* dict, char** argv, int argc, FILE* logs)
         return;
     }
 
-    // check if there is a running copy
-    if (search(dict, src, target) != 0)
+    // check if there is a running copy or restore
+    Node* node = search_node(dict, src, target);
+    if (node != NULL)
     {
-        fprintf(stdout, "Backup for %s to %s is active!\n", src, target);
+        fprintf(stdout, "%s for %s to %s is active!\n", active_kind(dict, src, target), src, target);
         handle_list(dict);
         return;
     }
 
-    // create restorer child
+    // real path of source directory and target directory
+    char* src_path = realpath(src, NULL);
+    char* target_path = realpath(target, NULL);
+    if (src_path == NULL || target_path == NULL)
+    {
+        ERR("realpath, restore didn't happen");
+        free(src_path);
+        free(target_path);
+        return;
+    }
+
+    // restores of the same tree would fight over it
+    for (Node* p = dict->head; p != NULL; p = p->next)
+    {
+        if (p->progress != NULL
+            && (path_cmp(p->progress->src, src_path) == 0 || path_cmp(src_path, p->progress->src) == 0))
+        {
+            fprintf(stdout, "Restore of %s is running, it overlaps %s\n", p->progress->src, src_path);
+            free(src_path);
+            free(target_path);
+            return;
+        }
+    }
+
+    RestoreProgress* progress = progress_init(src_path, target_path);
+    free(src_path);
+    free(target_path);
+
+    // create restorer child, it mustn't print buffered output or log records again
+    fflush(stdout);
+    log_flush(logs);
     pid_t pid = fork();
 
     switch (pid)
     {
         case 0:
-            // restore
-            fprintf(stdout, "Restoring %s to %s.", target, src);
+            set_handler(SIG_IGN, SIGINT); // only parent handles SIGINT
             write_log(logs, src, target, "New restorer", "");
-            // restore(dict, src, target, logs);
-            restore_better(dict, src, target, logs);
-            break;
+            restore_better(progress, opts.threads, logs);
+            exit(EXIT_FAILURE);
         case -1:
             ERR("fork, restore didn't happen");
+            free_progress(progress);
             return;
         default:
             break;
     }
 
-    // block and wait for restorer
-    pid_t wait_pid = waitpid(pid, NULL, 0);
-    while (wait_pid < 0 && errno == EINTR)
+    // add to dictionary, list shows its progress
+    node = insert(dict, src, target, pid, -1);
+    node->progress = progress;
+    fprintf(stdout, "Started restore of %s from %s, with restorer %d.\n", src, target, pid);
+}
+
+// handle cancel command, restorer stops after files it's copying
+void handle_cancel(Dict* dict, char** argv, int argc)
+{
+    if (argc < 3)
+    {
+        fprintf(stdout, "Not enough arguments for cancel\n");
+        return;
+    }
+
+    char* src = argv[1];
+    char* target = argv[2];
+
+    Node* node = search_node(dict, src, target);
+    if (node == NULL || node->progress == NULL)
     {
-        wait_pid = waitpid(pid, NULL, 0);
+        fprintf(stdout, "There isn't an active restore for %s -> %s\n", src, target);
+        return;
     }
 
-    if (wait_pid < 0 && errno != ECHILD)
+    // restorer is removed from dictionary when it exits
+    if (kill(node->pid, SIGTERM) < 0 && errno != ESRCH)
     {
-        ERR("waitpid");
+        ERR_KILL("kill");
+    }
+    fprintf(stdout, "Cancelling restore of %s from %s, restorer %d.\n", src, target, node->pid);
+}
+
+// child process exited, remove it from dictionary
+void handle_child_exit(Dict* dict, pid_t pid, Engine* engine)
+{
+    Node* node = search_pid(dict, pid);
+    RestoreProgress* p = node != NULL ? node->progress : NULL;
+
+    if (engine != NULL && pid == engine->pid)
+    {
+        fprintf(stdout, "\nEngine [%d] stopped working unexpectedly!\n", pid);
+        engine_lost(engine);
+    }
+    else if (p == NULL)
+        fprintf(stdout, "\nWorker [%d] stopped working unexpectedly!\n", pid);
+    else if (atomic_load(&p->state) == RESTORE_DONE)
+        fprintf(stdout, "\nRestore of %s from %s finished, checked %llu files, %llu bytes.\n", p->src, p->target,
+                atomic_load(&p->files), atomic_load(&p->bytes));
+    else if (atomic_load(&p->state) == RESTORE_CANCELLED)
+        fprintf(stdout, "\nRestore of %s from %s cancelled after %llu of %llu files.\n", p->src, p->target,
+                atomic_load(&p->files), atomic_load(&p->total_files));
+    else
+        fprintf(stdout, "\nRestorer [%d] stopped working unexpectedly!\n", pid);
+
+    // worker that died didn't free its stats slot, engine had one slot per pair
+    for (node = dict->head; node != NULL; node = node->next)
+    {
+        if (node->pid == pid)
+            stats_release(node->stats, pid);
+    }
+    delete_pid(dict, pid);
+}
+
+// pairs that failed in engine are removed, engine frees their stats slots and keeps serving the others
+// returns number of removed pairs
+int handle_engine_failures(Dict* dict, Engine* engine)
+{
+    int removed = 0;
+    int id;
+    while ((id = engine_failed(engine)) >= 0)
+    {
+        // pair could be ended by the user already
+        Node* node = search_index(dict, engine->pid, id);
+        char* target;
+        char* src = node != NULL ? split_key(dict, node, &target) : NULL;
+        if (src == NULL)
+            continue;
+
+        pid_t pid = engine->pid;
+        fprintf(stdout, "\nBackup for %s to %s failed in engine %d, it was removed.\n", src, target, pid);
+        end_engine_pair(dict, engine, src, target, id);
+        free(src);
+        removed++;
     }
+    return removed;
 }
 
 // handle restore command, deletes src and copies target
-void restore(Dict* dict, char* src, char* target, FILE* logs)
+void restore(Dict* dict, char* src, char* target, Log* logs)
 {
     // real path of source directory and target directory
     char* src_path = realpath(src, NULL);
@@ -231,35 +598,30 @@ void restore(Dict* dict, char* src, char* target, FILE* logs)
 }
 
 // handle restore command more effectively, only copy files that did change
-void restore_better(Dict* dict, char* src, char* target, FILE* logs)
+// progress holds real paths of source and target
+void restore_better(RestoreProgress* progress, int threads, Log* logs)
 {
-    // real path of source directory and target directory
-    char* src_path = realpath(src, NULL);
-    if (src_path == NULL)
+    // manifest left by worker describes target without stat of every file
+    Manifest* manifest = manifest_open(progress->target, 0);
+    if (manifest != NULL && !manifest->header->clean)
     {
-        ERR("realpath, restore failed");
-        exit(EXIT_FAILURE);
-    }
-    char* target_path = realpath(target, NULL);
-    if (target_path == NULL)
-    {
-        ERR("realpath, restore failed");
-        exit(EXIT_FAILURE);
+        manifest_close(manifest);
+        manifest = NULL;
     }
 
-    // restore
-    // delete all files from source that don't exist in target
-    fprintf(stdout, ".");
-    delete_recursive(src_path, target_path, logs);
+    // totals for progress
+    restore_scan(progress, manifest);
+    atomic_store(&progress->state, RESTORE_RUNNING);
 
-    // restore file that needs update from target
-    fprintf(stdout, ".");
-    restore_recursive(src_path, target_path, logs);
+    // restore
+    // delete files from source that don't exist in target and copy files that need update in one walk
+    restore_tree(progress, manifest, threads, logs);
+    manifest_close(manifest);
+    atomic_store(&progress->state, last_signal == SIGTERM ? RESTORE_CANCELLED : RESTORE_DONE);
 
     // free memory
-    fprintf(stdout, ".\n");
-    free(src_path);
-    free(target_path);
+    LOG(logs, LOG_LEVEL_INFO, "Restored %llu files, %llu bytes, skipped %llu bytes of holes", copy_stats->files,
+        copy_stats->bytes, copy_stats->holes);
     exit(EXIT_SUCCESS);
 }
 
@@ -267,23 +629,31 @@ void restore_better(Dict* dict, char* src, char* target, FILE* logs)
 // src_path and target_path are paths to given files
 int needs_update(char* src_path, char* target_path)
 {
-    struct stat src_stat, target_stat;
+    return needs_update_at(AT_FDCWD, src_path, AT_FDCWD, target_path);
+}
+
+// check if file src_name in src_fd needs updating from target_name in target_fd
+int needs_update_at(int src_fd, char* src_name, int target_fd, char* target_name)
+{
+    // only size and mtime are compared
+    unsigned int mask = STATX_SIZE | STATX_MTIME;
+    struct statx src_stat, target_stat;
 
     // check if file exists in source
-    if (lstat(src_path, &src_stat) == -1)
+    if (stat_at(src_fd, src_name, mask, &src_stat) == -1)
     {
-        return 1; // doesn't exist or lstat error, so copy it from target
+        return 1; // doesn't exist or statx error, so copy it from target
     }
 
     // get target file info
-    if (lstat(target_path, &target_stat) == -1)
+    if (stat_at(target_fd, target_name, mask, &target_stat) == -1)
     {
-        return 0; // error in lstat, omit copying
+        return 0; // error in statx, omit copying
     }
 
     // check mtime and size, if they differ -> file needs updating
-    if (src_stat.st_size != target_stat.st_size || src_stat.st_mtim.tv_sec != target_stat.st_mtim.tv_sec
-        || src_stat.st_mtim.tv_nsec != target_stat.st_mtim.tv_nsec)
+    if (src_stat.stx_size != target_stat.stx_size || src_stat.stx_mtime.tv_sec != target_stat.stx_mtime.tv_sec
+        || src_stat.stx_mtime.tv_nsec != target_stat.stx_mtime.tv_nsec)
     {
         return 1; // different mtime or size -> needs change
     }
@@ -292,153 +662,20 @@ int needs_update(char* src_path, char* target_path)
     return 0;
 }
 
-// recursively delete files from src that don't exist in target
-void delete_recursive(char* src, char* target, FILE* logs)
+// check if file needs updating like needs_update_at(), target file at target_path is described by its manifest entry
+// target is read only when it has no entry
+int needs_update_known(int src_fd, char* src_name, int target_fd, char* target_name, char* target_path,
+                       Manifest* manifest)
 {
-    DIR* src_dir = opendir(src);
-    if (src_dir == NULL)
-    {
-        ERR("opendir");
-        exit(EXIT_FAILURE);
-    }
-
-    struct dirent* file_info;
-    struct stat stat_info;
-
-    // read all dir files
-    while ((file_info = readdir(src_dir)) != NULL)
-    {
-        // ignore "." and ".."
-        if (strcmp(file_info->d_name, ".") == 0 || strcmp(file_info->d_name, "..") == 0)
-        {
-            continue;
-        }
-
-        char* file_src = join_paths(src, file_info->d_name);
-        char* file_target = join_paths(target, file_info->d_name);
-
-        // get src file info
-        if (lstat(file_src, &stat_info) != 0)
-        {
-            ERR("lstat");
-            exit(EXIT_FAILURE);
-        }
-
-        // check if target file exists
-        if (lstat(file_target, &stat_info) != 0)
-        {
-            if (errno != ENOENT)
-            {
-                ERR("lstat");
-                exit(EXIT_FAILURE);
-            }
+    ManifestEntry* known = manifest != NULL ? manifest_get(manifest, manifest_rel(manifest, target_path)) : NULL;
+    if (known == NULL)
+        return needs_update_at(src_fd, src_name, target_fd, target_name);
 
-            // else it doesn't exist - delete it from src
-            if (S_ISREG(stat_info.st_mode) || S_ISLNK(stat_info.st_mode))
-            {
-                if (unlink(file_src) < 0)
-                {
-                    ERR("unlink");
-                    exit(EXIT_FAILURE);
-                }
-                write_log(logs, src, target, "Delete file ", file_src);
-            }
-            else if (S_ISDIR(stat_info.st_mode))
-            {
-                rm_dir_recursive(file_src);
-                write_log(logs, src, target, "Delete directory ", file_src);
-            }
-        }
-        // check dir
-        else if (S_ISDIR(stat_info.st_mode))
-        {
-            delete_recursive(file_src, file_target, logs);
-        }
+    struct statx src_stat;
+    if (stat_at(src_fd, src_name, STATX_SIZE | STATX_MTIME, &src_stat) == -1)
+        return 1; // doesn't exist or statx error, so copy it from target
 
-        free(file_src);
-        free(file_target);
-    }
-
-    if (closedir(src_dir) < 0)
-    {
-        ERR("closedir");
-        exit(EXIT_FAILURE);
-    }
-}
-
-// restore recursively files that needs update from target to src
-void restore_recursive(char* src, char* target, FILE* logs)
-{
-    DIR* target_dir = opendir(target);
-    if (target_dir == NULL)
-    {
-        ERR("opendir");
-        exit(EXIT_FAILURE);
-    }
-
-    struct dirent* file_info;
-    struct stat stat_info;
-
-    // read all dir files
-    while ((file_info = readdir(target_dir)) != NULL)
-    {
-        // ignore "." and ".."
-        if (strcmp(file_info->d_name, ".") == 0 || strcmp(file_info->d_name, "..") == 0)
-        {
-            continue;
-        }
-
-        char* file_src = join_paths(src, file_info->d_name);
-        char* file_target = join_paths(target, file_info->d_name);
-
-        // get target file info
-        if (lstat(file_target, &stat_info) != 0)
-        {
-            ERR("lstat");
-            exit(EXIT_FAILURE);
-        }
-
-        // check if file needs changing
-        if (needs_update(file_src, file_target) == 1)
-        {
-            // copy regular file
-            if (S_ISREG(stat_info.st_mode))
-            {
-                copy_file(file_target, file_src);
-                write_log(logs, src, target, "Restore file ", file_src);
-            }
-            // copy symlink
-            else if (S_ISLNK(stat_info.st_mode))
-            {
-                copy_symlink(file_target, file_src, target, src, logs);
-                write_log(logs, src, target, "Restore symlink ", file_src);
-            }
-        }
-        // recursive for dir
-        if (S_ISDIR(stat_info.st_mode))
-        {
-            // make sure dir exists in src
-            if (mkdir(file_src, 0777) < 0 && errno != EEXIST)
-            {
-                ERR("mkdir");
-                exit(EXIT_FAILURE);
-            }
-            copy_permissions(file_target, file_src); // set correct permissions
-
-            // run restore recursively
-            write_log(logs, src, target, "Restore directory ", file_src);
-            restore_recursive(file_src, file_target, logs);
-        }
-
-        free(file_src);
-        free(file_target);
-    }
-
-    if (closedir(target_dir) < 0)
-    {
-        ERR("closedir");
-        exit(EXIT_FAILURE);
-    }
+    return manifest_needs_update(known, &src_stat);
 }
 
 // handle exit command
@@ -448,7 +685,7 @@ void handle_exit(Dict* dict)
     Node* p = dict->head;
     while (p != NULL)
     {
-        if (kill(p->pid, SIGTERM)) // send SIGTERM to worker with pid
+        if (kill(p->pid, SIGTERM) && errno != ESRCH) // send SIGTERM to worker with pid, fan-out worker could be gone
         {
             ERR_KILL("kill");
         }
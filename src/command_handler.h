@@ -2,28 +2,46 @@
 #define COMMAND_HANDLER_H
 
 #include "dict.h"
+#include "engine.h"
+#include "restore.h"
 #include "signal_handler.h"
+#include "stats.h"
 #include "utils.h"
 #include "worker.h"
 
-void handle_add(Dict* dict, char** argv, int argc, FILE* logs);
+int parse_options(char** argv, int argc, WorkerOptions* opts);
 
-void handle_end(Dict* dict, char** argv, int argc);
+void handle_add(Dict* dict, char** argv, int argc, StatsTable* stats, Engine* engine, Log* logs);
+
+void handle_end(Dict* dict, char** argv, int argc, Engine* engine);
 
 void handle_list(Dict* dict);
 
-void handle_restore(Dict* dict, char** argv, int argc, FILE* logs);
+void handle_stats(Dict* dict);
+
+void handle_latency(Dict* dict, char** argv, int argc);
+
+void handle_restore(Dict* dict, char** argv, int argc, Log* logs);
+
+void handle_cancel(Dict* dict, char** argv, int argc);
+
+void handle_child_exit(Dict* dict, pid_t pid, Engine* engine);
+
+int handle_engine_failures(Dict* dict, Engine* engine);
 
 void handle_exit(Dict* dict);
 
 int check_path(char* path);
 
-void restore(Dict* dict, char* src, char* target, FILE* logs);
+void restore(Dict* dict, char* src, char* target, Log* logs);
+
+void restore_better(RestoreProgress* progress, int threads, Log* logs);
 
-void restore_better(Dict* dict, char* src, char* target, FILE* logs);
+int needs_update(char* src_path, char* target_path);
 
-void delete_recursive(char* src, char* target, FILE* logs);
+int needs_update_at(int src_fd, char* src_name, int target_fd, char* target_name);
 
-void restore_recursive(char* src, char* target, FILE* logs);
+int needs_update_known(int src_fd, char* src_name, int target_fd, char* target_name, char* target_path,
+                       Manifest* manifest);
 
 #endif
@@ -0,0 +1,276 @@
+#include "copy.h"
+
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+
+// copy counters of this process, worker moves them to its shared stats slot
+// every thread counts into its worker's counters, threads started for worker get them from it
+static CopyStats own_stats = {0, 0, 0, 0};
+_Thread_local CopyStats* copy_stats = &own_stats;
+
+// check if errno means that copy method isn't supported for given files
+static int unsupported(int err)
+{
+    return err == EXDEV || err == ENOSYS || err == EOPNOTSUPP || err == ENOTTY || err == EINVAL || err == EBADF
+           || err == ETXTBSY || err == EPERM;
+}
+
+// try to reflink whole file, 0 on success, -1 if not supported
+static int copy_clone(int src_fd, int dst_fd)
+{
+    if (ioctl(dst_fd, FICLONE, src_fd) == 0)
+    {
+        return 0;
+    }
+    if (unsupported(errno))
+    {
+        return -1;
+    }
+
+    ERR("ioctl FICLONE");
+    exit(EXIT_FAILURE);
+}
+
+// copy with copy_file_range() from *off to end, -1 if not supported
+static int copy_range(int src_fd, int dst_fd, off_t* off, off_t end)
+{
+    off_t start = *off;
+
+    while (*off < end)
+    {
+        off_t off_out = *off;
+        ssize_t n = copy_file_range(src_fd, off, dst_fd, &off_out, end - *off, 0);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n < 0 && unsupported(errno))
+        {
+            return -1;
+        }
+        if (n < 0)
+        {
+            ERR("copy_file_range");
+            exit(EXIT_FAILURE);
+        }
+        // nothing copied on first call - fs may not report data this way
+        if (n == 0 && *off == start)
+        {
+            return -1;
+        }
+        // end of file
+        if (n == 0)
+        {
+            break;
+        }
+    }
+
+    return 0;
+}
+
+// copy with sendfile() from *off to end, -1 if not supported
+static int copy_sendfile(int src_fd, int dst_fd, off_t* off, off_t end)
+{
+    // sendfile writes at current file offset of dst
+    if (lseek(dst_fd, *off, SEEK_SET) < 0)
+    {
+        ERR("lseek");
+        exit(EXIT_FAILURE);
+    }
+
+    while (*off < end)
+    {
+        size_t count = end - *off;
+        if (count > 0x7ffff000)
+            count = 0x7ffff000;
+
+        ssize_t n = sendfile(dst_fd, src_fd, off, count);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n < 0 && unsupported(errno))
+        {
+            return -1;
+        }
+        if (n < 0)
+        {
+            ERR("sendfile");
+            exit(EXIT_FAILURE);
+        }
+        // end of file
+        if (n == 0)
+        {
+            break;
+        }
+    }
+
+    return 0;
+}
+
+// copy with pread() / pwrite() through large buffer from *off to end
+static void copy_read_write(int src_fd, int dst_fd, off_t* off, off_t end)
+{
+    char* buf = malloc(COPY_BUF_LEN);
+    if (buf == NULL)
+    {
+        ERR("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    while (*off < end)
+    {
+        size_t count = end - *off;
+        if (count > COPY_BUF_LEN)
+            count = COPY_BUF_LEN;
+
+        ssize_t n = pread(src_fd, buf, count, *off);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n < 0)
+        {
+            ERR("pread");
+            exit(EXIT_FAILURE);
+        }
+        // end of file
+        if (n == 0)
+        {
+            break;
+        }
+
+        // write whole chunk
+        ssize_t written = 0;
+        while (written < n)
+        {
+            ssize_t w = pwrite(dst_fd, buf + written, n - written, *off + written);
+            if (w < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (w < 0)
+            {
+                ERR("pwrite");
+                exit(EXIT_FAILURE);
+            }
+            written += w;
+        }
+
+        *off += n;
+    }
+
+    free(buf);
+}
+
+// copy one data range with given method or the next ones if it isn't supported
+static CopyMethod copy_extent(int src_fd, int dst_fd, off_t off, off_t end, CopyMethod method)
+{
+    // each fallback continues from the offset where previous one stopped
+    if (method == COPY_FILE_RANGE && copy_range(src_fd, dst_fd, &off, end) == 0)
+    {
+        return COPY_FILE_RANGE;
+    }
+
+    if (method <= COPY_SENDFILE && copy_sendfile(src_fd, dst_fd, &off, end) == 0)
+    {
+        return COPY_SENDFILE;
+    }
+
+    copy_read_write(src_fd, dst_fd, &off, end);
+    return COPY_READ_WRITE;
+}
+
+// copy size bytes from src_fd to empty dst_fd, returns method that finished the copy
+// methods are tried from the cheapest: clone -> copy_file_range -> sendfile -> read/write
+// only data extents are copied, holes are recreated and their size is stored in *holes
+CopyMethod copy_data(int src_fd, int dst_fd, off_t size, off_t* holes)
+{
+    *holes = 0;
+
+    if (size == 0)
+    {
+        copy_stats->files++;
+        return COPY_NONE;
+    }
+
+    // reflink shares extents, holes included, no data is copied
+    if (copy_clone(src_fd, dst_fd) == 0)
+    {
+        copy_stats->files++;
+        copy_stats->bytes += size;
+        return COPY_CLONE;
+    }
+
+    CopyMethod method = COPY_FILE_RANGE;
+    off_t copied = 0;
+    off_t off = 0;
+
+    // walk data extents of the source
+    while (off < size)
+    {
+        off_t data = lseek(src_fd, off, SEEK_DATA);
+        if (data < 0 && errno == ENXIO)
+        {
+            break; // only hole till the end of file
+        }
+        if (data < 0 && errno == EINVAL)
+        {
+            data = off; // SEEK_DATA not supported - whole file is data
+        }
+        else if (data < 0)
+        {
+            ERR("lseek");
+            exit(EXIT_FAILURE);
+        }
+        if (data >= size)
+        {
+            break;
+        }
+
+        off_t hole = lseek(src_fd, data, SEEK_HOLE);
+        if (hole < 0 || hole > size)
+        {
+            hole = size;
+        }
+
+        method = copy_extent(src_fd, dst_fd, data, hole, method);
+        copied += hole - data;
+        off = hole;
+    }
+
+    // recreate hole at the end of file
+    if (ftruncate(dst_fd, size) != 0)
+    {
+        ERR("ftruncate");
+        exit(EXIT_FAILURE);
+    }
+
+    *holes = size - copied;
+
+    copy_stats->files++;
+    copy_stats->bytes += copied;
+    copy_stats->holes += *holes;
+    return method;
+}
+
+// name of copy method for logs
+const char* copy_method_name(CopyMethod method)
+{
+    switch (method)
+    {
+        case COPY_NONE:
+            return "none";
+        case COPY_CLONE:
+            return "clone";
+        case COPY_FILE_RANGE:
+            return "copy_file_range";
+        case COPY_SENDFILE:
+            return "sendfile";
+        case COPY_READ_WRITE:
+            return "read/write";
+    }
+
+    return "unknown";
+}
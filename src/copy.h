@@ -0,0 +1,33 @@
+#ifndef COPY_H
+#define COPY_H
+
+#include "utils.h"
+
+#include <stdatomic.h>
+
+#define COPY_BUF_LEN (1024 * 1024)
+
+typedef enum CopyMethod
+{
+    COPY_NONE,        // nothing to copy (empty file)
+    COPY_CLONE,       // reflink clone (FICLONE)
+    COPY_FILE_RANGE,  // in-kernel copy with copy_file_range()
+    COPY_SENDFILE,    // in-kernel copy with sendfile()
+    COPY_READ_WRITE,  // user space read() / write() loop
+} CopyMethod;
+
+typedef struct CopyStats
+{
+    atomic_ullong files;   // copied files
+    atomic_ullong bytes;   // copied data bytes
+    atomic_ullong holes;   // bytes skipped as holes
+    atomic_ullong failed;  // copies and updates skipped because source vanished
+} CopyStats;
+
+extern _Thread_local CopyStats* copy_stats;
+
+CopyMethod copy_data(int src_fd, int dst_fd, off_t size, off_t* holes);
+
+const char* copy_method_name(CopyMethod method);
+
+#endif
@@ -0,0 +1,367 @@
+#include "delta.h"
+
+#include "worker.h"
+
+// init empty cache of block hashes
+DeltaCache* delta_cache_init()
+{
+    DeltaCache* c = malloc(sizeof(DeltaCache));
+    if (c == NULL)
+    {
+        ERR("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    c->head = NULL;
+    c->size = 0;
+
+    return c;
+}
+
+// free one cached file
+static void free_delta_file(DeltaFile* f)
+{
+    free(f->path);
+    free(f->hashes);
+    free(f);
+}
+
+// free cache
+void free_delta_cache(DeltaCache* c)
+{
+    if (c == NULL)
+        return;
+
+    DeltaFile* p = c->head;
+    while (p != NULL)
+    {
+        DeltaFile* next = p->next;
+        free_delta_file(p);
+        p = next;
+    }
+
+    free(c);
+}
+
+// removes cached hashes of path and of all files inside it
+static void delete_cached(DeltaCache* c, const char* path, int subtree)
+{
+    size_t len = strlen(path);
+
+    DeltaFile* p = c->head;
+    DeltaFile* prev = NULL;
+
+    while (p != NULL)
+    {
+        DeltaFile* next = p->next;
+        if (strncmp(p->path, path, len) == 0 && (p->path[len] == '\0' || (subtree && p->path[len] == '/')))
+        {
+            if (prev == NULL)
+                c->head = next;
+            else
+                prev->next = next;
+            free_delta_file(p);
+            c->size--;
+        }
+        else
+        {
+            prev = p;
+        }
+        p = next;
+    }
+}
+
+// forget hashes of target file or directory, used when it's deleted or moved
+void delta_forget(DeltaCache* c, const char* path) { delete_cached(c, path, 1); }
+
+// hash of whole content of target file from its cached block hashes, 0 if they aren't cached
+uint64_t delta_content_hash(DeltaCache* c, const char* path)
+{
+    for (DeltaFile* p = c->head; p != NULL; p = p->next)
+    {
+        if (strcmp(p->path, path) != 0)
+            continue;
+
+        uint64_t hash = 1469598103934665603ULL;
+        for (size_t i = 0; i < p->count; i++)
+        {
+            hash ^= p->hashes[i];
+            hash *= 1099511628211ULL;
+        }
+        return hash == 0 ? 1 : hash;
+    }
+
+    return 0;
+}
+
+// find cached hashes that are still valid for target file described by stat_info
+static DeltaFile* find_cached(DeltaCache* c, const char* path, struct stat* stat_info)
+{
+    DeltaFile* p = c->head;
+    DeltaFile* prev = NULL;
+
+    while (p != NULL)
+    {
+        if (strcmp(p->path, path) == 0)
+        {
+            // target changed outside of worker - hashes are useless
+            if (p->ino != stat_info->st_ino || p->size != stat_info->st_size
+                || p->mtime.tv_sec != stat_info->st_mtim.tv_sec || p->mtime.tv_nsec != stat_info->st_mtim.tv_nsec)
+            {
+                return NULL;
+            }
+
+            // move to the front of list
+            if (prev != NULL)
+            {
+                prev->next = p->next;
+                p->next = c->head;
+                c->head = p;
+            }
+            return p;
+        }
+        prev = p;
+        p = p->next;
+    }
+
+    return NULL;
+}
+
+// store hashes of target file, cache takes ownership of hashes
+static void store_cached(DeltaCache* c, const char* path, struct stat* stat_info, uint64_t* hashes, size_t count)
+{
+    delete_cached(c, path, 0);
+
+    // drop least recently used file
+    if (c->size >= DELTA_CACHE_MAX)
+    {
+        DeltaFile* p = c->head;
+        DeltaFile* prev = NULL;
+        while (p->next != NULL)
+        {
+            prev = p;
+            p = p->next;
+        }
+        if (prev == NULL)
+            c->head = NULL;
+        else
+            prev->next = NULL;
+        free_delta_file(p);
+        c->size--;
+    }
+
+    DeltaFile* f = malloc(sizeof(DeltaFile));
+    if (f == NULL)
+    {
+        ERR("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    f->path = strdup(path);
+    if (f->path == NULL)
+    {
+        ERR("strdup");
+        exit(EXIT_FAILURE);
+    }
+    f->ino = stat_info->st_ino;
+    f->size = stat_info->st_size;
+    f->mtime = stat_info->st_mtim;
+    f->hashes = hashes;
+    f->count = count;
+    f->next = c->head;
+    c->head = f;
+    c->size++;
+}
+
+// 64-bit hash of block, reads 8 bytes at a time
+static uint64_t block_hash(const char* buf, size_t len)
+{
+    const uint64_t p1 = 0x9e3779b185ebca87ULL;
+    const uint64_t p2 = 0xc2b2ae3d27d4eb4fULL;
+    uint64_t h = p2 ^ len;
+    size_t i = 0;
+
+    for (; i + 8 <= len; i += 8)
+    {
+        uint64_t k;
+        memcpy(&k, buf + i, 8);
+        k *= p1;
+        k = (k << 31) | (k >> 33);
+        h ^= k * p2;
+        h = ((h << 27) | (h >> 37)) * p1 + 0x85ebca77c2b2ae63ULL;
+    }
+    for (; i < len; i++)
+    {
+        h ^= (unsigned char)buf[i] * p2;
+        h = ((h << 11) | (h >> 53)) * p1;
+    }
+
+    // final mix
+    h ^= h >> 33;
+    h *= p2;
+    h ^= h >> 29;
+    h *= p1;
+    h ^= h >> 32;
+    return h;
+}
+
+// read whole block at off, returns number of bytes read
+static ssize_t read_block(int fd, char* buf, size_t len, off_t off)
+{
+    size_t done = 0;
+    while (done < len)
+    {
+        ssize_t n = pread(fd, buf + done, len - done, off + done);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n < 0)
+        {
+            ERR("pread");
+            exit(EXIT_FAILURE);
+        }
+        if (n == 0)
+        {
+            break;
+        }
+        done += n;
+    }
+
+    return done;
+}
+
+// write whole block at off
+static void write_block(int fd, char* buf, size_t len, off_t off)
+{
+    size_t done = 0;
+    while (done < len)
+    {
+        ssize_t n = pwrite(fd, buf + done, len - done, off + done);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n < 0)
+        {
+            ERR("pwrite");
+            exit(EXIT_FAILURE);
+        }
+        done += n;
+    }
+}
+
+// update existing file2 to match file1 by rewriting only blocks that differ
+// block whose cached hash differs is rewritten without reading the target, equal hash is confirmed by reading it
+// returns 0 on success and number of written bytes in *written, -1 if file must be copied whole
+// or if file1 was deleted or replaced by symlink after it was checked
+int delta_update(DeltaCache* c, char* file1, char* file2, off_t* written)
+{
+    *written = 0;
+
+    int src = open(file1, O_RDONLY | O_NOFOLLOW);
+    if (src < 0 && (errno == ENOENT || errno == ELOOP))
+        return -1;
+    if (src < 0)
+    {
+        ERR("open");
+        exit(EXIT_FAILURE);
+    }
+
+    struct stat src_stat, dst_stat;
+    if (fstat(src, &src_stat) != 0)
+    {
+        ERR("fstat");
+        exit(EXIT_FAILURE);
+    }
+
+    // small files are cheaper to copy whole
+    int dst = -1;
+    if (src_stat.st_size >= DELTA_MIN_SIZE)
+    {
+        dst = open(file2, O_RDWR | O_NOFOLLOW);
+    }
+    if (dst < 0 || fstat(dst, &dst_stat) != 0 || !S_ISREG(dst_stat.st_mode))
+    {
+        if (dst >= 0)
+            close(dst);
+        close(src);
+        return -1;
+    }
+
+    DeltaFile* cached = find_cached(c, file2, &dst_stat);
+    size_t count = (src_stat.st_size + DELTA_BLOCK_LEN - 1) / DELTA_BLOCK_LEN;
+    uint64_t* hashes = malloc(sizeof(uint64_t) * count);
+    char* src_buf = malloc(DELTA_BLOCK_LEN);
+    char* dst_buf = malloc(DELTA_BLOCK_LEN);
+    if (hashes == NULL || src_buf == NULL || dst_buf == NULL)
+    {
+        ERR("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    off_t size = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        off_t off = (off_t)i * DELTA_BLOCK_LEN;
+        ssize_t len = read_block(src, src_buf, DELTA_BLOCK_LEN, off);
+        if (len == 0)
+        {
+            // source was truncated while reading
+            count = i;
+            break;
+        }
+        hashes[i] = block_hash(src_buf, len);
+        size = off + len;
+
+        // length of the same block in target
+        ssize_t dst_len = 0;
+        if (off < dst_stat.st_size)
+        {
+            dst_len = dst_stat.st_size - off < DELTA_BLOCK_LEN ? dst_stat.st_size - off : DELTA_BLOCK_LEN;
+        }
+
+        // different hash means different block, equal hash could be a collision
+        int same = 0;
+        if (dst_len == len && (cached == NULL || cached->hashes[i] == hashes[i]))
+        {
+            same = read_block(dst, dst_buf, len, off) == len && memcmp(src_buf, dst_buf, len) == 0;
+        }
+
+        if (!same)
+        {
+            write_block(dst, src_buf, len, off);
+            *written += len;
+        }
+    }
+
+    if (size != dst_stat.st_size && ftruncate(dst, size) != 0)
+    {
+        ERR("ftruncate");
+        exit(EXIT_FAILURE);
+    }
+
+    // copy permissions and remember hashes of the updated target
+    copy_permissions(file1, file2);
+    if (fstat(dst, &dst_stat) != 0)
+    {
+        ERR("fstat");
+        exit(EXIT_FAILURE);
+    }
+    store_cached(c, file2, &dst_stat, hashes, count);
+
+    free(src_buf);
+    free(dst_buf);
+    if (close(src))
+    {
+        ERR("close");
+        exit(EXIT_FAILURE);
+    }
+    if (close(dst))
+    {
+        ERR("close");
+        exit(EXIT_FAILURE);
+    }
+
+    return 0;
+}
@@ -0,0 +1,39 @@
+#ifndef DELTA_H
+#define DELTA_H
+
+#include "utils.h"
+
+#include <stdint.h>
+
+#define DELTA_BLOCK_LEN (64 * 1024)     // size of compared block
+#define DELTA_MIN_SIZE (1024 * 1024)    // smaller files are always copied whole
+#define DELTA_CACHE_MAX 1024            // max number of files with cached hashes
+
+typedef struct DeltaFile
+{
+    char* path;              // target file path
+    ino_t ino;               // target inode when hashes were taken
+    off_t size;              // target size when hashes were taken
+    struct timespec mtime;   // target mtime when hashes were taken
+    uint64_t* hashes;        // hash of every target block
+    size_t count;            // number of blocks
+    struct DeltaFile* next;  // next file in list
+} DeltaFile;
+
+typedef struct DeltaCache
+{
+    DeltaFile* head;  // most recently used file first
+    int size;         // size of list
+} DeltaCache;
+
+DeltaCache* delta_cache_init();
+
+void free_delta_cache(DeltaCache* c);
+
+void delta_forget(DeltaCache* c, const char* path);
+
+int delta_update(DeltaCache* c, char* file1, char* file2, off_t* written);
+
+uint64_t delta_content_hash(DeltaCache* c, const char* path);
+
+#endif
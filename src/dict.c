@@ -1,5 +1,8 @@
 #include "dict.h"
 
+#include "restore.h"
+#include "stats.h"
+
 // create key from src and target paths
 char* get_key(Dict* dict, char const* src, char const* target)
 {
@@ -34,6 +37,14 @@ Dict* create_dict()
 
 // search for element with given key, return pid if found, else return 0
 pid_t search(Dict* dict, char* src, char* target)
+{
+    Node* node = search_node(dict, src, target);
+
+    return node == NULL ? 0 : node->pid;
+}
+
+// search for element with given key, NULL if it doesn't exist
+Node* search_node(Dict* dict, char* src, char* target)
 {
     Node* p = dict->head;
     char* key = get_key(dict, src, target);
@@ -43,17 +54,55 @@ pid_t search(Dict* dict, char* src, char* target)
         if (strcmp(p->key, key) == 0)
         {
             free(key);
-            return p->pid;
+            return p;
         }
         p = p->next;
     }
 
     free(key);
-    return 0;
+    return NULL;
+}
+
+// search for element handled by process pid, NULL if it doesn't exist
+Node* search_pid(Dict* dict, pid_t pid)
+{
+    for (Node* p = dict->head; p != NULL; p = p->next)
+    {
+        if (p->pid == pid)
+            return p;
+    }
+
+    return NULL;
+}
+
+// search for element with given index in process pid, NULL if it doesn't exist
+Node* search_index(Dict* dict, pid_t pid, int index)
+{
+    for (Node* p = dict->head; p != NULL; p = p->next)
+    {
+        if (p->pid == pid && p->index == index)
+            return p;
+    }
+
+    return NULL;
 }
 
-// inserts new element at the beginning
-void insert(Dict* dict, char* src, char* target, pid_t pid)
+// count elements handled by process pid
+int count_pid(Dict* dict, pid_t pid)
+{
+    int count = 0;
+
+    for (Node* p = dict->head; p != NULL; p = p->next)
+    {
+        if (p->pid == pid)
+            count++;
+    }
+
+    return count;
+}
+
+// inserts new element at the beginning and returns it
+Node* insert(Dict* dict, char* src, char* target, pid_t pid, int index)
 {
     char* key = get_key(dict, src, target);
 
@@ -63,10 +112,15 @@ void insert(Dict* dict, char* src, char* target, pid_t pid)
 
     new_node->key = key;
     new_node->pid = pid;
+    new_node->index = index;
+    new_node->progress = NULL;
+    new_node->stats = NULL;
     new_node->next = dict->head;
     // insert at beginning
     dict->head = new_node;
     dict->size++;
+
+    return new_node;
 }
 
 // deletes element and returns its pid, 0 if element doesn't exist
@@ -86,6 +140,7 @@ pid_t delete(Dict* dict, char* src, char* target)
         dict->head = p->next;
         pid = p->pid;
         free(p->key);
+        free_progress(p->progress);
         free(p);
         dict->size--;
         return pid;
@@ -102,6 +157,7 @@ pid_t delete(Dict* dict, char* src, char* target)
             prev->next = p->next;
             pid = p->pid;
             free(p->key);
+            free_progress(p->progress);
             free(p);
             dict->size--;
             return pid;
@@ -124,6 +180,7 @@ void free_dict(Dict* dict)
     {
         next = p->next;
         free(p->key);
+        free_progress(p->progress);
         free(p);
         p = next;
     }
@@ -131,6 +188,28 @@ void free_dict(Dict* dict)
     free(dict);
 }
 
+// copy of src of node key, target points into it, NULL when key is broken
+char* split_key(Dict* dict, Node* p, char** target)
+{
+    char* src = malloc(sizeof(char) * (strlen(p->key) + 1));
+    if (src == NULL)
+        ERR_KILL("malloc");
+
+    strcpy(src, p->key);
+
+    *target = strchr(src, dict->divider);
+    if (*target == NULL)
+    {
+        ERR("strchr");
+        free(src);
+        return NULL;
+    }
+    (*target)[0] = '\0';
+    (*target)++;
+
+    return src;
+}
+
 // prints dict
 void print_dict(Dict* dict)
 {
@@ -138,59 +217,77 @@ void print_dict(Dict* dict)
 
     while (p != NULL)
     {
-        char* src = malloc(sizeof(char) * (strlen(p->key) + 1));
+        char* target;
+        char* src = split_key(dict, p, &target);
         if (src == NULL)
-            ERR_KILL("malloc");
-
-        strcpy(src, p->key);
-
-        char* target = strchr(src, dict->divider);
-        if (target == NULL)
         {
-            ERR("strchr");
+            p = p->next;
             continue;
         }
-        target[0] = '\0';
-        target++;
 
-        fprintf(stdout, "  [%d] %s -> %s \n", p->pid, src, target);
+        RestoreProgress* progress = p->progress;
+        if (progress == NULL)
+            fprintf(stdout, "  [%d] %s -> %s \n", p->pid, src, target);
+        else if (atomic_load(&progress->state) == RESTORE_SCANNING)
+            fprintf(stdout, "  [%d] %s <- %s restoring, counting files of backup\n", p->pid, src, target);
+        else
+            fprintf(stdout, "  [%d] %s <- %s restoring, %llu/%llu files, %llu/%llu bytes\n", p->pid, src, target,
+                    atomic_load(&progress->files), atomic_load(&progress->total_files), atomic_load(&progress->bytes),
+                    atomic_load(&progress->total_bytes));
         p = p->next;
         free(src);
     }
 }
 
-// delete dict element based on pid
-void delete_pid(Dict* dict, pid_t pid)
+// prints live counters of workers with print, targets of fan-out worker are listed before its counters
+void print_dict_stats(Dict* dict, void (*print)(struct WorkerStats*, FILE*), FILE* out)
 {
-    if (dict->head == NULL)
-        return;
+    for (Node* p = dict->head; p != NULL; p = p->next)
+    {
+        if (p->progress != NULL)
+            continue;
 
-    Node* p = dict->head;
-    Node* prev = NULL;
+        char* target;
+        char* src = split_key(dict, p, &target);
+        if (src == NULL)
+            continue;
+        fprintf(out, "  [%d] %s -> %s\n", p->pid, src, target);
+        free(src);
 
-    if (p->pid == pid)
-    {
-        dict->head = p->next;
-        free(p->key);
-        free(p);
-        dict->size--;
-        return;
+        // nodes of fan-out worker are next to each other and share slot, engine pairs have their own
+        if (p->next != NULL && p->next->pid == p->pid && p->next->stats == p->stats)
+            continue;
+        if (p->stats != NULL && atomic_load(&p->stats->pid) == p->pid)
+            print(p->stats, out);
+        else
+            fprintf(out, "      no stats, worker is starting or every stats slot is taken\n");
     }
+}
 
-    prev = p;
-    p = p->next;
+// delete all dict elements based on pid
+void delete_pid(Dict* dict, pid_t pid)
+{
+    Node* p = dict->head;
+    Node* prev = NULL;
 
     while (p != NULL)
     {
+        Node* next = p->next;
         if (p->pid == pid)
         {
-            prev->next = p->next;
+            if (prev == NULL)
+                dict->head = next;
+            else
+                prev->next = next;
             free(p->key);
+            free_progress(p->progress);
             free(p);
             dict->size--;
-            return;
         }
-        prev = p;
-        p = p->next;
+        else
+        {
+            prev = p;
+        }
+        p = next;
     }
 }
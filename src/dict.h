@@ -5,9 +5,12 @@
 
 typedef struct Node
 {
-    char* key;          // src_path&target_path
-    pid_t pid;          // pid of the copier process
-    struct Node* next;  // ptr to next node in dict list
+    char* key;                         // src_path&target_path
+    pid_t pid;                         // pid of the copier process
+    int index;                         // index of target in fan-out worker, -1 for worker with one target
+    struct RestoreProgress* progress;  // progress of restorer, NULL for worker
+    struct WorkerStats* stats;         // live counters of worker, NULL for restorer or when table was full
+    struct Node* next;                 // ptr to next node in dict list
 } Node;
 
 typedef struct Dict
@@ -23,14 +26,26 @@ void free_dict(Dict* dict);
 
 char* get_key(Dict* dict, char const* src, char const* target);
 
-void insert(Dict* dict, char* src, char* target, pid_t pid);
+Node* insert(Dict* dict, char* src, char* target, pid_t pid, int index);
 
 pid_t search(Dict* dict, char* src, char* target);
 
+Node* search_node(Dict* dict, char* src, char* target);
+
+Node* search_pid(Dict* dict, pid_t pid);
+
+Node* search_index(Dict* dict, pid_t pid, int index);
+
+int count_pid(Dict* dict, pid_t pid);
+
 pid_t delete(Dict* dict, char* src, char* target);
 
 void delete_pid(Dict* dict, pid_t pid);
 
+char* split_key(Dict* dict, Node* p, char** target);
+
 void print_dict(Dict* dict);
 
+void print_dict_stats(Dict* dict, void (*print)(struct WorkerStats*, FILE*), FILE* out);
+
 #endif
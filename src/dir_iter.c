@@ -0,0 +1,98 @@
+#include "dir_iter.h"
+
+#include <sys/syscall.h>
+
+// start iteration of directory fd, iterator owns fd
+DirIter* dir_iter_open(int fd)
+{
+    DirIter* it = malloc(sizeof(DirIter));
+    if (it == NULL)
+    {
+        ERR("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    it->buf = malloc(DIR_ITER_BUF_LEN);
+    if (it->buf == NULL)
+    {
+        ERR("malloc");
+        exit(EXIT_FAILURE);
+    }
+    it->fd = fd;
+    it->len = 0;
+    it->pos = 0;
+
+    return it;
+}
+
+// get next entry without "." and "..", 1 if entry was read, 0 at the end of directory
+// entry type comes from d_type, only filesystems that don't fill it need a statx() call
+int dir_iter_next(DirIter* it, DirEntry* entry)
+{
+    while (1)
+    {
+        // read next batch of records
+        if (it->pos >= it->len)
+        {
+            it->len = syscall(SYS_getdents64, it->fd, it->buf, DIR_ITER_BUF_LEN);
+            it->pos = 0;
+            if (it->len < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (it->len < 0)
+            {
+                ERR("getdents64");
+                exit(EXIT_FAILURE);
+            }
+            if (it->len == 0)
+            {
+                return 0;
+            }
+        }
+
+        struct dirent64* d = (struct dirent64*)(it->buf + it->pos);
+        it->pos += d->d_reclen;
+
+        // ignore "." and ".."
+        if (strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0)
+        {
+            continue;
+        }
+
+        entry->name = d->d_name;
+        entry->type = d->d_type;
+
+        // type unknown - ask for it
+        if (entry->type == DT_UNKNOWN)
+        {
+            struct statx stx;
+            if (stat_at(it->fd, entry->name, STATX_TYPE, &stx) != 0)
+            {
+                continue; // entry disappeared
+            }
+            entry->type = IFTODT(stx.stx_mode);
+        }
+
+        return 1;
+    }
+}
+
+// end iteration and close directory fd
+void dir_iter_close(DirIter* it)
+{
+    if (close(it->fd) < 0)
+    {
+        ERR("close");
+        exit(EXIT_FAILURE);
+    }
+
+    free(it->buf);
+    free(it);
+}
+
+// statx() name in dirfd without following symlinks, asks only for fields in mask
+int stat_at(int dirfd, char* name, unsigned int mask, struct statx* stx)
+{
+    return statx(dirfd, name, AT_SYMLINK_NOFOLLOW | AT_STATX_SYNC_AS_STAT, mask, stx);
+}
@@ -0,0 +1,30 @@
+#ifndef DIR_ITER_H
+#define DIR_ITER_H
+
+#include "utils.h"
+
+#define DIR_ITER_BUF_LEN (32 * 1024)
+
+typedef struct DirEntry
+{
+    char* name;          // entry name, valid until next dir_iter_next()
+    unsigned char type;  // DT_REG, DT_DIR, DT_LNK, ...
+} DirEntry;
+
+typedef struct DirIter
+{
+    int fd;     // directory descriptor
+    char* buf;  // buffer for getdents64 records
+    long len;   // bytes in buffer
+    long pos;   // offset of the next record
+} DirIter;
+
+DirIter* dir_iter_open(int fd);
+
+int dir_iter_next(DirIter* it, DirEntry* entry);
+
+void dir_iter_close(DirIter* it);
+
+int stat_at(int dirfd, char* name, unsigned int mask, struct statx* stx);
+
+#endif
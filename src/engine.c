@@ -0,0 +1,842 @@
+#include "engine.h"
+
+#include "resync.h"
+
+#include <sys/epoll.h>
+
+// shorter of two timeouts, -1 means no timeout
+static int min_timeout(int a, int b) { return a < 0 || (b >= 0 && b < a) ? b : a; }
+
+// read whole buffer, 0 at the end of pipe or when engine got SIGTERM
+static int read_all(int fd, void* buf, size_t len)
+{
+    char* p = buf;
+    while (len > 0)
+    {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR && last_signal != SIGTERM)
+            continue;
+        if (n < 0 && errno != EINTR)
+        {
+            ERR("read");
+            exit(EXIT_FAILURE);
+        }
+        if (n <= 0)
+            return 0;
+
+        p += n;
+        len -= n;
+    }
+    return 1;
+}
+
+// room for one more pointer in array with count of cap pointers
+static void* reserve(void* array, int count, int* cap)
+{
+    if (count < *cap)
+        return array;
+
+    *cap = *cap == 0 ? 16 : *cap * 2;
+    array = realloc(array, sizeof(void*) * *cap);
+    if (array == NULL)
+    {
+        ERR("realloc");
+        exit(EXIT_FAILURE);
+    }
+    return array;
+}
+
+// root of watched tree of group
+static char* group_root(WatchGroup* g) { return g->shared ? g->keeper.src : g->pairs[0]->worker.src; }
+
+// group whose watched tree and src overlap, NULL if pair can't share watches or there is none
+static WatchGroup* find_group(EngineThread* t, char* src, int shareable)
+{
+    for (int i = 0; shareable && i < t->count; i++)
+    {
+        WatchGroup* g = t->groups[i];
+        if (g->shareable && (path_cmp(group_root(g), src) == 0 || path_cmp(src, group_root(g)) == 0))
+            return g;
+    }
+    return NULL;
+}
+
+// tell main that pair failed, main removes it and ends it like the user would
+static void report_failed(EngineThread* t, EnginePair* p)
+{
+    LOG(t->logs, LOG_LEVEL_WARN, "Backup of '%s' failed, engine serves other pairs", p->worker.src);
+    if (write_all(t->reports, &p->id, sizeof(p->id)) < 0 || kill(getppid(), PAIR_FAILED_SIGNAL) < 0)
+        ERR("report of failed pair");
+}
+
+// apply changes that wait in pair and free it
+static void finish_pair(EnginePair* p)
+{
+    copy_stats = p->copy;
+    char** targets = p->worker.targets;
+    worker_finish(&p->worker);
+    free(targets);
+    free(p);
+}
+
+// give request to thread, thread frees it
+static void send_request(EngineThread* t, EngineRequest* req)
+{
+    if (write_all(t->inbox[1], &req, sizeof(req)) < 0)
+    {
+        ERR("write");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// initial copy or resume of pair runs beside the event loop of its thread, request goes back to it when it's done
+static void* setup_pair(void* arg)
+{
+    EnginePair* p = arg;
+    EngineRequest* req = p->req;
+    char* paths = (char*)(req + 1);
+    char** targets = malloc(sizeof(char*));
+    char* src = strndup(paths, req->src_len);
+    char* target = strndup(paths + req->src_len, req->target_len);
+    if (targets == NULL || src == NULL || target == NULL)
+    {
+        ERR("malloc");
+        exit(EXIT_FAILURE);
+    }
+    char* trace = req->trace_len > 0 ? paths + req->src_len + req->target_len : NULL;
+    Watchers* shared = p->group != NULL ? p->group->keeper.watchers : NULL;
+    WorkerOptions opts = {req->threads, 0, req->debounce, req->backend, req->resume, trace, shared};
+    targets[0] = target;
+
+    // pair without stats slot counts copies by itself
+    copy_stats = &p->own_copy;
+    p->failed = worker_setup(&p->worker, src, targets, 1, &opts, req->stats, p->thread->logs) != 0;
+    p->copy = copy_stats;
+
+    req->type = ENGINE_READY;
+    send_request(p->thread, req);
+    return NULL;
+}
+
+// start setup of pair of request, pair of overlapping source will share watches of its group
+// group is kept until the pair is ready, its keeper watches the new source from now on
+static void add_pair(EngineThread* t, EngineRequest* req)
+{
+    EnginePair* p = calloc(1, sizeof(EnginePair));
+    char* src = strndup((char*)(req + 1), req->src_len);
+    if (p == NULL || src == NULL)
+    {
+        ERR("malloc");
+        exit(EXIT_FAILURE);
+    }
+    p->id = req->id;
+    p->req = req;
+    p->thread = t;
+
+    int shareable = req->backend == WATCH_INOTIFY && req->trace_len == 0;
+    WatchGroup* g = find_group(t, src, shareable);
+    if (g != NULL)
+    {
+        // first pair gives its watches to keeper, tree grows when the new source contains it
+        if (!g->shared)
+        {
+            keeper_setup(&g->keeper, &g->pairs[0]->worker);
+            g->shared = 1;
+        }
+        // source that can't be watched whole watches on its own
+        if (keeper_add_source(&g->keeper, src) == 0)
+        {
+            p->group = g;
+            g->starting++;
+        }
+    }
+    free(src);
+
+    t->setups = reserve(t->setups, t->setup_count, &t->setup_cap);
+    t->setups[t->setup_count++] = p;
+    if (pthread_create(&p->setup, NULL, setup_pair, p) != 0)
+    {
+        ERR("pthread_create");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// free group i after its last pair and the last pair that joins it, fd of group already left epoll set
+static void free_group(EngineThread* t, int i)
+{
+    WatchGroup* g = t->groups[i];
+    if (g->shared)
+        keeper_finish(&g->keeper);
+    free(g->pairs);
+    free(g);
+    t->groups[i] = t->groups[--t->count];
+}
+
+// index of group in thread
+static int group_index(EngineThread* t, WatchGroup* g)
+{
+    int i = 0;
+    while (t->groups[i] != g)
+        i++;
+    return i;
+}
+
+// pair whose setup ended gets events from now on, pair that failed or was ended meanwhile is freed
+static void ready_pair(EngineThread* t, int id)
+{
+    int k = 0;
+    while (k < t->setup_count && t->setups[k]->id != id)
+        k++;
+    if (k == t->setup_count)
+        return;
+    EnginePair* p = t->setups[k];
+    t->setups[k] = t->setups[--t->setup_count];
+    if (pthread_join(p->setup, NULL) != 0)
+    {
+        ERR("pthread_join");
+        exit(EXIT_FAILURE);
+    }
+
+    // shared watches could fail during setup
+    WatchGroup* g = p->group;
+    if (g != NULL)
+    {
+        g->starting--;
+        p->failed |= g->keeper.watchers->failed;
+    }
+    if (p->failed || p->ended)
+    {
+        // user removed ended pair already
+        if (!p->ended)
+            report_failed(t, p);
+        finish_pair(p);
+        if (g == NULL || g->count > 0 || g->starting > 0)
+            return;
+        if (epoll_ctl(t->epoll, EPOLL_CTL_DEL, g->keeper.watchers->fd, NULL) < 0)
+        {
+            ERR("epoll_ctl");
+            exit(EXIT_FAILURE);
+        }
+        free_group(t, group_index(t, g));
+        return;
+    }
+    copy_stats = p->copy;
+    if (g != NULL)
+    {
+        // keeper read events of the source during setup without this pair
+        print_watchers(p->worker.watchers, t->logs, p->worker.src, p->worker.target);
+        catch_up_source(&p->worker);
+    }
+    else
+    {
+        g = calloc(1, sizeof(WatchGroup));
+        if (g == NULL)
+        {
+            ERR("calloc");
+            exit(EXIT_FAILURE);
+        }
+        g->shareable = p->req->backend == WATCH_INOTIFY && p->req->trace_len == 0;
+        t->groups = reserve(t->groups, t->count, &t->cap);
+        t->groups[t->count++] = g;
+
+        struct epoll_event ev = {EPOLLIN, {.ptr = g}};
+        if (epoll_ctl(t->epoll, EPOLL_CTL_ADD, p->worker.watchers->fd, &ev) < 0)
+        {
+            ERR("epoll_ctl");
+            exit(EXIT_FAILURE);
+        }
+    }
+    g->pairs = reserve(g->pairs, g->count, &g->cap);
+    g->pairs[g->count++] = p;
+}
+
+// apply changes that wait in pair j of group i and free it, group is freed with its last pair
+static void end_pair(EngineThread* t, int i, int j)
+{
+    WatchGroup* g = t->groups[i];
+    EnginePair* p = g->pairs[j];
+    g->pairs[j] = g->pairs[--g->count];
+    int last = g->count == 0 && g->starting == 0;
+    if (last && epoll_ctl(t->epoll, EPOLL_CTL_DEL, p->worker.watchers->fd, NULL) < 0)
+    {
+        ERR("epoll_ctl");
+        exit(EXIT_FAILURE);
+    }
+
+    finish_pair(p);
+    if (last)
+        free_group(t, i);
+}
+
+// pairs of group i end when its source can't be watched anymore, e.g. limit of watches was hit
+static void end_failed(EngineThread* t, int i)
+{
+    WatchGroup* g = t->groups[i];
+    Watchers* watchers = g->shared ? g->keeper.watchers : g->pairs[0]->worker.watchers;
+    if (!watchers->failed)
+        return;
+
+    // group is freed with its last pair
+    for (int j = g->count - 1; j >= 0; j--)
+    {
+        report_failed(t, g->pairs[j]);
+        end_pair(t, i, j);
+    }
+}
+
+// index of pair with given id in group, -1 if it isn't there
+static int find_pair(WatchGroup* g, int id)
+{
+    for (int j = 0; j < g->count; j++)
+    {
+        if (g->pairs[j]->id == id)
+            return j;
+    }
+    return -1;
+}
+
+// handle one request given by dispatcher or setup thread, 0 when thread has to stop
+static int handle_request(EngineThread* t)
+{
+    EngineRequest* req;
+    if (read_all(t->inbox[0], &req, sizeof(req)) == 0)
+        return 0;
+
+    // request of new pair is freed when it's ready
+    if (req->type == ENGINE_ADD)
+    {
+        add_pair(t, req);
+        return 1;
+    }
+    int running = req->type != ENGINE_STOP;
+    if (req->type == ENGINE_READY)
+        ready_pair(t, req->id);
+
+    for (int i = 0; req->type == ENGINE_END && i < t->count; i++)
+    {
+        int j = find_pair(t->groups[i], req->id);
+        if (j >= 0)
+        {
+            end_pair(t, i, j);
+            break;
+        }
+    }
+    // pair ended during its setup is freed when setup ends
+    for (int k = 0; req->type == ENGINE_END && k < t->setup_count; k++)
+    {
+        if (t->setups[k]->id == req->id)
+            t->setups[k]->ended = 1;
+    }
+
+    free(req);
+    return running;
+}
+
+// read events of group, every pair handles an event before keeper changes shared watches for it
+static void read_group(WatchGroup* g)
+{
+    if (!g->shared)
+    {
+        copy_stats = g->pairs[0]->copy;
+        read_watch(&g->pairs[0]->worker);
+        return;
+    }
+
+    char buffer[EVENT_BUF_LEN];
+    long long before = realtime_ns();
+    ssize_t len = read_events(g->keeper.watchers, buffer, EVENT_BUF_LEN);
+    if (len < 0 && errno == EINTR)
+        return;
+    if (len < 0)
+    {
+        ERR("read");
+        exit(EXIT_FAILURE);
+    }
+
+    // events of buffer were dequeued now, latency of their ops starts here
+    long long now = monotonic_us();
+    for (int j = 0; j < g->count; j++)
+    {
+        g->pairs[j]->worker.event_us = now;
+    }
+
+    ssize_t i = 0;
+    while (i < len)
+    {
+        struct inotify_event* event = (struct inotify_event*)&buffer[i];
+        for (int j = 0; j < g->count; j++)
+        {
+            copy_stats = g->pairs[j]->copy;
+            handle_event(&g->pairs[j]->worker, event);
+        }
+        handle_event(&g->keeper, event);
+
+        i += sizeof(struct inotify_event) + event->len;
+    }
+
+    // ops made later, like rescans, don't belong to any event
+    for (int j = 0; j < g->count; j++)
+    {
+        g->pairs[j]->worker.event_us = 0;
+        advance_checkpoint(&g->pairs[j]->worker, before, len);
+    }
+    advance_checkpoint(&g->keeper, before, len);
+}
+
+// ms that pairs of group and its keeper can wait, -1 if nothing waits for time
+static int group_timeout(WatchGroup* g, long long now)
+{
+    int timeout = g->shared ? worker_timeout(&g->keeper, now) : -1;
+    for (int j = 0; j < g->count; j++)
+    {
+        timeout = min_timeout(timeout, worker_timeout(&g->pairs[j]->worker, now));
+    }
+    return timeout;
+}
+
+// work of group that is due, keeper brings back lost watches before pairs rescan their sources
+static void tick_group(WatchGroup* g)
+{
+    if (g->shared)
+        worker_tick(&g->keeper);
+
+    // pair whose source is gone keeps idle until it's ended
+    for (int j = 0; j < g->count; j++)
+    {
+        copy_stats = g->pairs[j]->copy;
+        worker_tick(&g->pairs[j]->worker);
+    }
+}
+
+// event loop of thread, one epoll set waits for requests and events of all its groups
+static void* engine_thread(void* arg)
+{
+    EngineThread* t = arg;
+
+    int running = 1;
+    while (running)
+    {
+        // wait for events, requests, ends of debounce windows, pairs of waiting moves and log flush
+        long long now = monotonic_ms();
+        int timeout = log_timeout(t->logs, now);
+        for (int i = 0; i < t->count; i++)
+        {
+            timeout = min_timeout(timeout, group_timeout(t->groups[i], now));
+        }
+
+        struct epoll_event events[ENGINE_EVENTS];
+        int ready = epoll_wait(t->epoll, events, ENGINE_EVENTS, timeout);
+        if (ready < 0 && errno != EINTR)
+        {
+            ERR("epoll_wait");
+            exit(EXIT_FAILURE);
+        }
+
+        // events of groups are read before requests, end of pair can free its group
+        int requests = 0;
+        for (int i = 0; i < ready; i++)
+        {
+            if (events[i].data.ptr == NULL)
+                requests = 1;
+            else
+                read_group(events[i].data.ptr);
+        }
+        if (requests)
+            running = handle_request(t);
+
+        for (int i = 0; i < t->count; i++)
+        {
+            tick_group(t->groups[i]);
+        }
+        // other pairs keep running when one fails, groups are freed from the end
+        for (int i = t->count - 1; i >= 0; i--)
+        {
+            end_failed(t, i);
+        }
+        // records of quiet pairs don't wait in the ring
+        log_tick(t->logs, monotonic_ms());
+    }
+
+    // setups still running end first, their pairs aren't watched anymore
+    for (int k = 0; k < t->setup_count; k++)
+    {
+        t->setups[k]->ended = 1;
+    }
+    while (t->setup_count > 0)
+    {
+        handle_request(t);
+    }
+
+    // changes waiting for their window still go to targets
+    while (t->count > 0)
+    {
+        end_pair(t, t->count - 1, t->groups[t->count - 1]->count - 1);
+    }
+    return NULL;
+}
+
+// create threads of engine, signals are handled only by dispatcher
+static EngineThread* start_threads(int count, int reports, Log* logs)
+{
+    EngineThread* threads = calloc(count, sizeof(EngineThread));
+    if (threads == NULL)
+    {
+        ERR("calloc");
+        exit(EXIT_FAILURE);
+    }
+
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    for (int i = 0; i < count; i++)
+    {
+        EngineThread* t = &threads[i];
+        t->logs = logs;
+        t->reports = reports;
+        t->epoll = epoll_create1(EPOLL_CLOEXEC);
+        if (t->epoll < 0 || pipe2(t->inbox, O_CLOEXEC) < 0)
+        {
+            ERR("epoll_create1");
+            exit(EXIT_FAILURE);
+        }
+
+        // inbox is the only fd without pair
+        struct epoll_event ev = {EPOLLIN, {.ptr = NULL}};
+        if (epoll_ctl(t->epoll, EPOLL_CTL_ADD, t->inbox[0], &ev) < 0)
+        {
+            ERR("epoll_ctl");
+            exit(EXIT_FAILURE);
+        }
+        if (pthread_create(&t->thread, NULL, engine_thread, t) != 0)
+        {
+            ERR("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    return threads;
+}
+
+// stop threads after they end their pairs
+static void stop_threads(EngineThread* threads, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        EngineRequest* req = calloc(1, sizeof(EngineRequest));
+        if (req == NULL)
+        {
+            ERR("calloc");
+            exit(EXIT_FAILURE);
+        }
+        req->type = ENGINE_STOP;
+        send_request(&threads[i], req);
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        EngineThread* t = &threads[i];
+        if (pthread_join(t->thread, NULL) != 0)
+        {
+            ERR("pthread_join");
+            exit(EXIT_FAILURE);
+        }
+        close(t->epoll);
+        close(t->inbox[0]);
+        close(t->inbox[1]);
+        free(t->groups);
+        free(t->setups);
+    }
+    free(threads);
+}
+
+// thread of new pair, pair of overlapping source shares watches in the thread of the other one
+// other pairs go to the thread with the fewest pairs
+static int pick_thread(PairRoute* routes, int routes_cap, int* loads, int count, char* src)
+{
+    for (int i = 0; src != NULL && i < routes_cap; i++)
+    {
+        if (routes[i].src != NULL && (path_cmp(routes[i].src, src) == 0 || path_cmp(src, routes[i].src) == 0))
+            return routes[i].thread;
+    }
+
+    int least = 0;
+    for (int i = 1; i < count; i++)
+    {
+        if (loads[i] < loads[least])
+            least = i;
+    }
+    return least;
+}
+
+// engine process, dispatcher reads requests of main and gives every pair to one of the threads
+// ids of pairs that failed go back to main through reports
+static void run_engine(int fd, int reports, int count, Log* logs)
+{
+    set_handler(SIG_IGN, SIGINT); // only parent handles SIGINT
+    LOG(logs, LOG_LEVEL_INFO, "New engine with %d threads", count);
+    EngineThread* threads = start_threads(count, reports, logs);
+
+    // pairs of every thread and route of every pair id, only dispatcher uses them
+    int* loads = calloc(count, sizeof(int));
+    PairRoute* routes = NULL;
+    int routes_cap = 0;
+    if (loads == NULL)
+    {
+        ERR("calloc");
+        exit(EXIT_FAILURE);
+    }
+
+    EngineRequest header;
+    while (read_all(fd, &header, sizeof(header)) && header.type != ENGINE_STOP)
+    {
+        size_t len = header.src_len + header.target_len + header.trace_len;
+        EngineRequest* req = malloc(sizeof(EngineRequest) + len + 1);
+        if (req == NULL)
+        {
+            ERR("malloc");
+            exit(EXIT_FAILURE);
+        }
+        *req = header;
+        if (read_all(fd, req + 1, len) == 0)
+        {
+            free(req);
+            break;
+        }
+        ((char*)(req + 1))[len] = '\0';
+
+        if (req->type == ENGINE_ADD)
+        {
+            if (req->id >= routes_cap)
+            {
+                int cap = routes_cap == 0 ? 64 : routes_cap;
+                while (cap <= req->id)
+                    cap *= 2;
+                routes = realloc(routes, sizeof(PairRoute) * cap);
+                if (routes == NULL)
+                {
+                    ERR("realloc");
+                    exit(EXIT_FAILURE);
+                }
+                for (int i = routes_cap; i < cap; i++)
+                    routes[i] = (PairRoute){-1, NULL};
+                routes_cap = cap;
+            }
+
+            // only inotify pairs without trace share watches
+            char* src = NULL;
+            if (req->backend == WATCH_INOTIFY && req->trace_len == 0)
+            {
+                src = strndup((char*)(req + 1), req->src_len);
+                if (src == NULL)
+                {
+                    ERR("strndup");
+                    exit(EXIT_FAILURE);
+                }
+            }
+
+            int thread = pick_thread(routes, routes_cap, loads, count, src);
+            routes[req->id] = (PairRoute){thread, src};
+            loads[thread]++;
+            send_request(&threads[thread], req);
+        }
+        else if (req->id >= 0 && req->id < routes_cap && routes[req->id].thread >= 0)
+        {
+            PairRoute* route = &routes[req->id];
+            loads[route->thread]--;
+            send_request(&threads[route->thread], req);
+            free(route->src);
+            *route = (PairRoute){-1, NULL};
+        }
+        else
+        {
+            free(req);
+        }
+    }
+
+    stop_threads(threads, count);
+    LOG(logs, LOG_LEVEL_INFO, "Engine exiting...");
+    for (int i = 0; i < routes_cap; i++)
+    {
+        free(routes[i].src);
+    }
+    free(routes);
+    free(loads);
+    close(fd);
+    close(reports);
+    exit(EXIT_SUCCESS);
+}
+
+// engine with given number of threads, its process starts with the first pair, NULL for 0 threads
+Engine* engine_init(int threads)
+{
+    if (threads < 1)
+        return NULL;
+
+    Engine* e = malloc(sizeof(Engine));
+    if (e == NULL)
+    {
+        ERR("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    e->pid = 0;
+    e->fd = -1;
+    e->reports = -1;
+    e->threads = threads;
+    e->next_id = 0;
+    return e;
+}
+
+// fork engine process with its request pipe and pipe of failed pairs, -1 on error
+static int start_engine(Engine* e, Log* logs)
+{
+    int fds[2], reports[2];
+    if (pipe2(fds, O_CLOEXEC) < 0)
+    {
+        ERR("pipe2, engine didn't start");
+        return -1;
+    }
+    // main reads reports between commands, it mustn't wait for them
+    if (pipe2(reports, O_CLOEXEC) < 0 || fcntl(reports[0], F_SETFL, O_NONBLOCK) < 0)
+    {
+        ERR("pipe2, engine didn't start");
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+
+    // engine mustn't print buffered output or log records again
+    fflush(stdout);
+    log_flush(logs);
+    pid_t pid = fork();
+
+    switch (pid)
+    {
+        case 0:
+            close(fds[1]);
+            close(reports[0]);
+            run_engine(fds[0], reports[1], e->threads, logs);
+            exit(EXIT_FAILURE);
+        case -1:
+            ERR("fork, engine didn't start");
+            close(fds[0]);
+            close(fds[1]);
+            close(reports[0]);
+            close(reports[1]);
+            return -1;
+        default:
+            break;
+    }
+
+    close(fds[0]);
+    close(reports[1]);
+    e->pid = pid;
+    e->fd = fds[1];
+    e->reports = reports[0];
+    return 0;
+}
+
+// start backup of src to target in engine, returns id of pair or -1
+// paths are checked here, engine can't exit because of one pair
+int engine_add(Engine* e, char* src, char* target, WorkerOptions* opts, WorkerStats* stats, Log* logs)
+{
+    // check if target directory exists/is empty
+    if (check_dir(target, opts->resume) != 0)
+    {
+        stats_release(stats, STATS_STARTING);
+        return -1;
+    }
+
+    // real paths of source and target directory
+    char* src_path = realpath(src, NULL);
+    char* target_path = realpath(target, NULL);
+    int id = -1;
+    if (src_path == NULL || target_path == NULL)
+    {
+        ERR("realpath, backup didn't start");
+    }
+    else if (path_cmp(src_path, target_path) == 0)
+    {
+        fprintf(stdout, "Invalid target, can't be inside source\n");
+    }
+    else if (e->pid != 0 || start_engine(e, logs) == 0)
+    {
+        size_t trace_len = opts->trace != NULL ? strlen(opts->trace) : 0;
+        EngineRequest req = {ENGINE_ADD, e->next_id, opts->threads, opts->debounce, opts->backend, opts->resume,
+                             stats, strlen(src_path), strlen(target_path), trace_len};
+        struct iovec iov[4] = {
+            {&req, sizeof(req)}, {src_path, req.src_len}, {target_path, req.target_len}, {opts->trace, trace_len}};
+        if (writev_all(e->fd, iov, 4) < 0)
+            ERR("writev, backup didn't start");
+        else
+            id = e->next_id++;
+    }
+    free(src_path);
+    free(target_path);
+
+    if (id < 0)
+        stats_release(stats, STATS_STARTING);
+    else
+        stats_own(stats, e->pid);
+    return id;
+}
+
+// end pair, engine applies its waiting changes
+void engine_end(Engine* e, int id)
+{
+    EngineRequest req = {ENGINE_END, id, 0, 0, 0, 0, NULL, 0, 0, 0};
+    if (e->fd >= 0 && write_all(e->fd, &req, sizeof(req)) < 0)
+        ERR("write");
+}
+
+// id of pair that failed in engine, -1 when no failure waits
+int engine_failed(Engine* e)
+{
+    int id;
+    if (e == NULL || e->reports < 0 || read(e->reports, &id, sizeof(id)) != sizeof(id))
+        return -1;
+    return id;
+}
+
+// end all pairs and wait for engine to exit
+void engine_stop(Engine* e)
+{
+    if (e == NULL || e->pid == 0)
+        return;
+
+    EngineRequest req = {ENGINE_STOP, -1, 0, 0, 0, 0, NULL, 0, 0, 0};
+    if (write_all(e->fd, &req, sizeof(req)) < 0)
+        ERR("write");
+
+    pid_t pid = waitpid(e->pid, NULL, 0);
+    while (pid < 0 && errno == EINTR)
+    {
+        pid = waitpid(e->pid, NULL, 0);
+    }
+    if (pid < 0 && errno != ECHILD)
+        ERR_KILL("waitpid");
+
+    engine_lost(e);
+}
+
+// engine process is gone, the next pair starts a new one
+void engine_lost(Engine* e)
+{
+    if (e->fd >= 0)
+        close(e->fd);
+    if (e->reports >= 0)
+        close(e->reports);
+    e->pid = 0;
+    e->fd = -1;
+    e->reports = -1;
+}
+
+void free_engine(Engine* e)
+{
+    if (e == NULL)
+        return;
+
+    engine_stop(e);
+    free(e);
+}
@@ -0,0 +1,111 @@
+#ifndef ENGINE_H
+#define ENGINE_H
+
+#include "log.h"
+#include "stats.h"
+#include "utils.h"
+#include "worker.h"
+
+#include <pthread.h>
+
+#define ENGINE_MAX_THREADS 64
+#define ENGINE_EVENTS 64  // epoll events taken by one wait
+
+typedef enum EngineRequestType
+{
+    ENGINE_ADD = 1,    // start backup pair, paths follow request
+    ENGINE_END = 2,    // end backup pair
+    ENGINE_STOP = 3,   // end every pair and exit
+    ENGINE_READY = 4,  // setup of pair finished, sent by its setup thread to the thread of pair
+} EngineRequestType;
+
+// request written by main to engine pipe, src, target and trace path without '\0' follow it
+typedef struct EngineRequest
+{
+    int type;            // EngineRequestType
+    int id;              // pair id, index of its dict node
+    int threads;         // threads used for initial copy
+    int debounce;        // debounce window of pair in ms
+    int backend;         // WatchBackend of pair
+    int resume;          // target already has a backup
+    WorkerStats* stats;  // stats slot of pair, shared mapping has the same address in engine
+    size_t src_len;      // bytes of source path
+    size_t target_len;   // bytes of target path
+    size_t trace_len;    // bytes of trace path, 0 without trace
+} EngineRequest;
+
+// backup pair served by engine thread
+typedef struct EnginePair
+{
+    int id;                       // pair id
+    Worker worker;                // state of pair, same as state of forked worker
+    CopyStats* copy;              // copy counters of pair, set before any of its work runs
+    CopyStats own_copy;           // copy counters of pair without stats slot
+    EngineRequest* req;           // add request, read by setup thread and freed when pair is ready
+    struct EngineThread* thread;  // thread that serves pair
+    struct WatchGroup* group;     // group whose shared watches pair joins when it's ready, NULL for own watches
+    pthread_t setup;              // thread of initial copy or resume, event loop doesn't wait for it
+    int failed;                   // setup failed, pair is freed when it's ready
+    int ended;                    // pair was ended during its setup
+} EnginePair;
+
+// pairs whose sources are in one watched tree, they share its inotify fd and watches
+typedef struct WatchGroup
+{
+    Worker keeper;       // keeps shared watches up to date and reads their events, set up by the second pair
+    int shared;          // keeper reads events for all pairs, else the only pair has its own watches
+    int shareable;       // pairs watch with inotify and don't record traces
+    int starting;        // pairs that join group when their setup ends, group is kept for them
+    EnginePair** pairs;  // pairs of group
+    int count;           // number of pairs
+    int cap;             // capacity of pairs
+} WatchGroup;
+
+// engine thread, every pair is served by one thread so pairs need no locks
+typedef struct EngineThread
+{
+    pthread_t thread;     // thread id
+    int epoll;            // inbox and inotify fds of groups
+    int inbox[2];         // pipe of requests given to thread by dispatcher
+    WatchGroup** groups;  // groups of pairs served by thread
+    int count;            // number of groups
+    int cap;              // capacity of groups
+    EnginePair** setups;  // pairs whose setup thread runs
+    int setup_count;      // number of setups
+    int setup_cap;        // capacity of setups
+    Log* logs;            // logs file
+    int reports;          // write end of pipe of failed pair ids to main
+} EngineThread;
+
+// thread of pair id seen by dispatcher
+typedef struct PairRoute
+{
+    int thread;  // thread serving pair, -1 when there is no such pair
+    char* src;   // source of pair that can share watches, NULL if it can't
+} PairRoute;
+
+// engine seen from main, its process is forked with the first pair
+typedef struct Engine
+{
+    pid_t pid;    // engine process, 0 while it isn't running
+    int fd;       // write end of request pipe, -1 while engine isn't running
+    int reports;  // read end of pipe of failed pair ids, -1 while engine isn't running
+    int threads;  // event loop threads of engine
+    int next_id;  // id of the next pair
+} Engine;
+
+Engine* engine_init(int threads);
+
+int engine_add(Engine* e, char* src, char* target, WorkerOptions* opts, WorkerStats* stats, Log* logs);
+
+void engine_end(Engine* e, int id);
+
+int engine_failed(Engine* e);
+
+void engine_stop(Engine* e);
+
+void engine_lost(Engine* e);
+
+void free_engine(Engine* e);
+
+#endif
@@ -0,0 +1,567 @@
+#include "fan_watchers.h"
+
+// check if path is root or inside it
+static int inside(const char* root, const char* path)
+{
+    size_t len = strlen(root);
+    return strncmp(root, path, len) == 0 && (path[len] == '/' || path[len] == '\0');
+}
+
+// FNV-1a hash of handle type and bytes
+static size_t handle_hash(struct file_handle* handle)
+{
+    uint64_t hash = 1469598103934665603ULL ^ (uint32_t)handle->handle_type;
+    for (unsigned int i = 0; i < handle->handle_bytes; i++)
+    {
+        hash ^= handle->f_handle[i];
+        hash *= 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+// key of watch in table of handles
+static size_t watch_handle_hash(Watch* watch) { return handle_hash(watch->handle); }
+
+// compare handles, 1 if they are the same
+static int same_handle(struct file_handle* a, struct file_handle* b)
+{
+    return a->handle_type == b->handle_type && a->handle_bytes == b->handle_bytes
+           && memcmp(a->f_handle, b->f_handle, a->handle_bytes) == 0;
+}
+
+// copy handle from event buffer
+static struct file_handle* copy_handle(struct file_handle* handle)
+{
+    size_t size = sizeof(struct file_handle) + handle->handle_bytes;
+    struct file_handle* copy = malloc(size);
+    if (copy == NULL)
+    {
+        ERR("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    memcpy(copy, handle, size);
+    return copy;
+}
+
+// handle of directory at path, NULL if it's gone
+static struct file_handle* path_handle(char* path)
+{
+    char buf[sizeof(struct file_handle) + MAX_HANDLE_SZ];
+    struct file_handle* handle = (struct file_handle*)buf;
+    handle->handle_bytes = MAX_HANDLE_SZ;
+
+    int mount_id;
+    if (name_to_handle_at(AT_FDCWD, path, handle, &mount_id, 0) != 0)
+    {
+        if (errno == ENOENT || errno == ENOTDIR)
+            return NULL;
+        ERR("name_to_handle_at");
+        exit(EXIT_FAILURE);
+    }
+
+    return copy_handle(handle);
+}
+
+// searches for dir with given handle
+static Watch* search_handle(FanWatchers* f, struct file_handle* handle)
+{
+    size_t mask = f->cap - 1;
+    for (size_t i = handle_hash(handle) & mask; f->by_handle[i] != NULL; i = (i + 1) & mask)
+    {
+        if (same_handle(f->by_handle[i]->handle, handle))
+            return f->by_handle[i];
+    }
+
+    return NULL;
+}
+
+// add dir to table of handles, table doubles when it's half full
+static void insert_handle(FanWatchers* f, Watch* watch)
+{
+    if ((f->size + 1) * 2 > f->cap)
+    {
+        int cap = f->cap * 2;
+        Watch** table = watch_table_new(cap);
+        for (int i = 0; i < f->cap; i++)
+        {
+            if (f->by_handle[i] != NULL)
+                watch_table_insert(table, cap, f->by_handle[i], watch_handle_hash);
+        }
+        free(f->by_handle);
+        f->by_handle = table;
+        f->cap = cap;
+    }
+
+    watch_table_insert(f->by_handle, f->cap, watch, watch_handle_hash);
+    f->size++;
+}
+
+// remember dir outside of watched tree, its events are skipped
+static void add_outside(FanWatchers* f, struct file_handle* handle)
+{
+    Watch* watch = calloc(1, sizeof(Watch));
+    if (watch == NULL)
+    {
+        ERR("calloc");
+        exit(EXIT_FAILURE);
+    }
+
+    watch->wd = -1;
+    watch->handle = handle;
+    insert_handle(f, watch);
+}
+
+static Watch* add_dir(Watchers* w, char* path, struct file_handle* handle);
+
+// make sure dir at path inside tree has a watch, path is copied
+static void add_parent_dir(Watchers* w, char* path)
+{
+    if (search_watch_path(w, path) != NULL)
+        return;
+
+    char* copy = strdup(path);
+    if (copy == NULL)
+    {
+        ERR("strdup");
+        exit(EXIT_FAILURE);
+    }
+    fan_add_dir(w, copy);
+}
+
+// add dir inside tree, its parents are added first so a moved dir renames its whole subtree
+// path and handle are owned by watchers
+static Watch* add_dir(Watchers* w, char* path, struct file_handle* handle)
+{
+    FanWatchers* f = w->fan;
+
+    char* slash = strrchr(path, '/');
+    if (f->root != NULL && strcmp(path, f->root) != 0 && slash != NULL)
+    {
+        *slash = '\0';
+        add_parent_dir(w, path);
+        *slash = '/';
+    }
+
+    Watch* watch = new_watch_entry(w, f->next_wd++, path);
+    watch->handle = handle;
+    insert_handle(f, watch);
+
+    return watch;
+}
+
+// find watch of dir with handle from event, NULL if dir is outside of tree or gone
+static Watch* resolve_dir(Watchers* w, struct file_handle* handle)
+{
+    FanWatchers* f = w->fan;
+
+    Watch* watch = search_handle(f, handle);
+    if (watch != NULL)
+        return watch->wd < 0 ? NULL : watch;
+
+    // path of dir comes from its fd
+    int fd = open_by_handle_at(f->mount_fd, handle, O_PATH | O_CLOEXEC);
+    if (fd < 0 && (errno == ESTALE || errno == ENOENT))
+        return NULL;
+    if (fd < 0)
+    {
+        ERR("open_by_handle_at");
+        exit(EXIT_FAILURE);
+    }
+
+    char link[32];
+    char path[PATH_MAX];
+    snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+    ssize_t n = readlink(link, path, sizeof(path) - 1);
+    if (n < 0)
+    {
+        ERR("readlink");
+        exit(EXIT_FAILURE);
+    }
+    path[n] = '\0';
+    if (close(fd) < 0)
+    {
+        ERR("close");
+        exit(EXIT_FAILURE);
+    }
+
+    // deleted dir, its events don't matter
+    const char* deleted = " (deleted)";
+    if (n > (ssize_t)strlen(deleted) && strcmp(path + n - strlen(deleted), deleted) == 0)
+        return NULL;
+
+    if (!inside(f->root, path))
+    {
+        add_outside(f, copy_handle(handle));
+        return NULL;
+    }
+
+    char* copy = strdup(path);
+    if (copy == NULL)
+    {
+        ERR("strdup");
+        exit(EXIT_FAILURE);
+    }
+    return add_dir(w, copy, copy_handle(handle));
+}
+
+// write inotify event with name to buffer, returns its size
+static size_t put_event(char* buffer, int wd, uint32_t mask, uint32_t cookie, char* name)
+{
+    struct inotify_event* event = (struct inotify_event*)buffer;
+    size_t len = name == NULL ? 0 : strlen(name) + 1;
+    len = (len + sizeof(uint32_t) - 1) & ~(sizeof(uint32_t) - 1);
+
+    event->wd = wd;
+    event->mask = mask;
+    event->cookie = cookie;
+    event->len = len;
+    if (len > 0)
+    {
+        memset(event->name, 0, len);
+        strcpy(event->name, name);
+    }
+
+    return sizeof(struct inotify_event) + len;
+}
+
+// inotify mask of fanotify event
+static uint32_t inotify_mask(uint64_t mask)
+{
+    uint32_t in_mask = 0;
+
+    if (mask & FAN_CREATE)
+        in_mask |= IN_CREATE;
+    if (mask & FAN_DELETE)
+        in_mask |= IN_DELETE;
+    if (mask & FAN_ATTRIB)
+        in_mask |= IN_ATTRIB;
+    if (mask & FAN_CLOSE_WRITE)
+        in_mask |= IN_CLOSE_WRITE;
+    if (mask & FAN_MOVED_FROM)
+        in_mask |= IN_MOVED_FROM;
+    if (mask & FAN_MOVED_TO)
+        in_mask |= IN_MOVED_TO;
+    if (mask & FAN_ONDIR)
+        in_mask |= IN_ISDIR;
+
+    return in_mask;
+}
+
+// cookie of the next move, never 0
+static uint32_t next_cookie(FanWatchers* f)
+{
+    if (++f->next_cookie == 0)
+        f->next_cookie = 1;
+    return f->next_cookie;
+}
+
+// turn one fanotify event with raw record into inotify events, returns their size
+static size_t translate_event(Watchers* w, struct fanotify_event_metadata* meta, char* record, char* buffer)
+{
+    FanWatchers* f = w->fan;
+
+    if (meta->mask & FAN_Q_OVERFLOW)
+        return put_event(buffer, -1, IN_Q_OVERFLOW, 0, NULL);
+
+    // dir and name of every info record
+    struct file_handle* handles[3] = {NULL, NULL, NULL};
+    char* names[3] = {NULL, NULL, NULL};
+    enum { INFO_DIR, INFO_OLD, INFO_NEW };
+
+    char* end = record + meta->event_len;
+    char* p = record + meta->metadata_len;
+    while (p < end)
+    {
+        struct fanotify_event_info_fid* fid = (struct fanotify_event_info_fid*)p;
+        struct file_handle* handle = (struct file_handle*)fid->handle;
+        char* name = (char*)handle->f_handle + handle->handle_bytes;
+
+        switch (fid->hdr.info_type)
+        {
+            case FAN_EVENT_INFO_TYPE_DFID_NAME:
+                handles[INFO_DIR] = handle;
+                names[INFO_DIR] = name;
+                break;
+            case FAN_EVENT_INFO_TYPE_DFID:
+                handles[INFO_DIR] = handle;
+                break;
+            case FAN_EVENT_INFO_TYPE_OLD_DFID_NAME:
+                handles[INFO_OLD] = handle;
+                names[INFO_OLD] = name;
+                break;
+            case FAN_EVENT_INFO_TYPE_NEW_DFID_NAME:
+                handles[INFO_NEW] = handle;
+                names[INFO_NEW] = name;
+                break;
+        }
+        p += fid->hdr.len;
+    }
+
+    uint32_t dir = meta->mask & FAN_ONDIR ? IN_ISDIR : 0;
+
+    // rename has both sides, halves inside the tree become a moved from & moved to pair
+    if (meta->mask & FAN_RENAME)
+    {
+        Watch* from = handles[INFO_OLD] == NULL ? NULL : resolve_dir(w, handles[INFO_OLD]);
+        Watch* to = handles[INFO_NEW] == NULL ? NULL : resolve_dir(w, handles[INFO_NEW]);
+        uint32_t cookie = next_cookie(f);
+        size_t size = 0;
+
+        if (from != NULL)
+            size += put_event(buffer, from->wd, IN_MOVED_FROM | dir, cookie, names[INFO_OLD]);
+        if (to != NULL)
+            size += put_event(buffer + size, to->wd, IN_MOVED_TO | dir, from != NULL ? cookie : 0, names[INFO_NEW]);
+        // dirs of moved subtree could be remembered as outside
+        if (to != NULL && from == NULL && dir)
+            fan_forget_outside(w);
+
+        return size;
+    }
+
+    Watch* watch = handles[INFO_DIR] == NULL ? NULL : resolve_dir(w, handles[INFO_DIR]);
+    if (watch == NULL)
+        return 0;
+
+    // "." is event of dir itself
+    char* name = names[INFO_DIR];
+    if (name != NULL && strcmp(name, ".") == 0)
+        name = NULL;
+
+    uint32_t mask = inotify_mask(meta->mask);
+    if (name != NULL)
+    {
+        char* path = join_paths(watch->path, name);
+
+        // merged create and delete - current state of the source decides
+        struct stat stat_info;
+        if (mask & IN_CREATE && mask & IN_DELETE)
+        {
+            if (lstat(path, &stat_info) == 0)
+                mask &= ~IN_DELETE;
+            else
+                mask &= ~(IN_CREATE | IN_CLOSE_WRITE | IN_ATTRIB);
+        }
+        // deleted dir and its subdirs aren't watched anymore
+        if (mask & IN_DELETE && dir)
+            remove_watch_tree(w, path);
+
+        free(path);
+    }
+    // halves of moves without FAN_RENAME can't be matched
+    if (mask & IN_MOVED_TO && dir)
+        fan_forget_outside(w);
+
+    return put_event(buffer, watch->wd, mask, mask & IN_MOVED_FROM ? next_cookie(f) : 0, name);
+}
+
+// init fanotify, -1 if it isn't available
+int fan_init(Watchers* w)
+{
+    int fd = fanotify_init(FAN_CLASS_NOTIF | FAN_CLOEXEC | FAN_REPORT_DFID_NAME, O_RDONLY | O_LARGEFILE | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+
+    FanWatchers* f = malloc(sizeof(FanWatchers));
+    if (f == NULL)
+    {
+        ERR("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    f->root = NULL;
+    f->mount_fd = -1;
+    f->cap = WATCHERS_MIN_CAP;
+    f->by_handle = watch_table_new(f->cap);
+    f->size = 0;
+    f->next_wd = 1;
+    f->next_cookie = 0;
+    f->rename = 0;
+    f->buf = malloc(EVENT_BUF_LEN);
+    if (f->buf == NULL)
+    {
+        ERR("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    w->fd = fd;
+    w->fan = f;
+    return 0;
+}
+
+// free fanotify state and dirs outside of tree, fanotify fd isn't closed
+void free_fan(Watchers* w)
+{
+    FanWatchers* f = w->fan;
+    if (f == NULL)
+        return;
+
+    for (int i = 0; i < f->cap; i++)
+    {
+        if (f->by_handle[i] != NULL && f->by_handle[i]->wd < 0)
+        {
+            free(f->by_handle[i]->handle);
+            free(f->by_handle[i]);
+        }
+    }
+
+    if (f->mount_fd >= 0 && close(f->mount_fd) < 0)
+    {
+        ERR("close");
+        exit(EXIT_FAILURE);
+    }
+
+    free(f->by_handle);
+    free(f->buf);
+    free(f->root);
+    free(f);
+    w->fan = NULL;
+}
+
+// mark filesystem of tree at path, path is owned by watchers
+// returns -1 when filesystem can't be marked
+int fan_mark(Watchers* w, char* path)
+{
+    FanWatchers* f = w->fan;
+    uint64_t mask = FAN_CREATE | FAN_DELETE | FAN_ATTRIB | FAN_CLOSE_WRITE | FAN_ONDIR;
+
+    f->rename = 1;
+    if (fanotify_mark(w->fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM, mask | FAN_RENAME, AT_FDCWD, path) != 0)
+    {
+        // kernel without FAN_RENAME reports halves of moves, they can't be matched
+        f->rename = 0;
+        if (fanotify_mark(w->fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM, mask | FAN_MOVED_FROM | FAN_MOVED_TO,
+                          AT_FDCWD, path)
+            != 0)
+            return -1;
+    }
+
+    f->mount_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (f->mount_fd < 0)
+    {
+        ERR("open");
+        exit(EXIT_FAILURE);
+    }
+    f->root = strdup(path);
+    if (f->root == NULL)
+    {
+        ERR("strdup");
+        exit(EXIT_FAILURE);
+    }
+
+    return 0;
+}
+
+// remember dir at path by its handle, returns wd or -1 if dir is gone, path is owned by watchers
+int fan_add_dir(Watchers* w, char* path)
+{
+    struct file_handle* handle = path_handle(path);
+    if (handle == NULL)
+    {
+        free(path);
+        return -1;
+    }
+
+    // other dir was at this path before, its events were lost
+    Watch* stale = search_watch_path(w, path);
+    if (stale != NULL && !same_handle(stale->handle, handle))
+        remove_watch_tree(w, path);
+
+    // dir was known under old path or as outside dir
+    Watch* old = search_handle(w->fan, handle);
+    if (old != NULL && old->wd >= 0)
+    {
+        if (strcmp(old->path, path) != 0)
+            update_watch_paths(w, old->path, path);
+        free(handle);
+        free(path);
+        return old->wd;
+    }
+    if (old != NULL)
+    {
+        fan_forget(w, old);
+        free(old->handle);
+        free(old);
+    }
+
+    return add_dir(w, path, handle)->wd;
+}
+
+// read fanotify events as inotify events of dirs inside tree
+// inotify event is never longer than fanotify event it comes from, so len bytes of them fit into buffer
+ssize_t fan_read(Watchers* w, char* buffer, size_t len)
+{
+    FanWatchers* f = w->fan;
+    if (len > EVENT_BUF_LEN)
+        len = EVENT_BUF_LEN;
+
+    ssize_t n = read(w->fd, f->buf, len);
+    if (n <= 0)
+        return n;
+
+    size_t size = 0;
+    char* p = f->buf;
+    while (p + sizeof(struct fanotify_event_metadata) <= f->buf + n)
+    {
+        // records are aligned only to 4 bytes
+        struct fanotify_event_metadata meta;
+        memcpy(&meta, p, sizeof(meta));
+        if (meta.event_len < sizeof(meta) || p + meta.event_len > f->buf + n)
+            break;
+
+        if (meta.vers != FANOTIFY_METADATA_VERSION)
+        {
+            fprintf(stderr, "Unsupported fanotify metadata version\n");
+            exit(EXIT_FAILURE);
+        }
+        if (meta.fd >= 0 && close(meta.fd) < 0)
+        {
+            ERR("close");
+            exit(EXIT_FAILURE);
+        }
+
+        size += translate_event(w, &meta, p, buffer + size);
+        p += meta.event_len;
+    }
+
+    return size;
+}
+
+// remove dir from table of handles, handle isn't freed
+void fan_forget(Watchers* w, Watch* watch)
+{
+    FanWatchers* f = w->fan;
+    if (f == NULL)
+        return;
+
+    watch_table_remove(f->by_handle, f->cap, watch, watch_handle_hash);
+    f->size--;
+}
+
+// forget dirs outside of tree, some of them could be moved inside
+void fan_forget_outside(Watchers* w)
+{
+    FanWatchers* f = w->fan;
+    Watch** table = watch_table_new(f->cap);
+
+    f->size = 0;
+    for (int i = 0; i < f->cap; i++)
+    {
+        Watch* watch = f->by_handle[i];
+        if (watch == NULL)
+            continue;
+
+        if (watch->wd < 0)
+        {
+            free(watch->handle);
+            free(watch);
+            continue;
+        }
+        watch_table_insert(table, f->cap, watch, watch_handle_hash);
+        f->size++;
+    }
+
+    free(f->by_handle);
+    f->by_handle = table;
+}
@@ -0,0 +1,44 @@
+#ifndef FAN_WATCHERS_H
+#define FAN_WATCHERS_H
+
+#include "utils.h"
+#include "watchers.h"
+
+#include <stdint.h>
+#include <sys/fanotify.h>
+
+// older headers don't know rename events
+#ifndef FAN_RENAME
+#define FAN_RENAME 0x10000000
+#define FAN_EVENT_INFO_TYPE_OLD_DFID_NAME 10
+#define FAN_EVENT_INFO_TYPE_NEW_DFID_NAME 12
+#endif
+
+typedef struct FanWatchers
+{
+    char* root;            // path of watched tree
+    int mount_fd;          // directory on watched filesystem, handles are opened relative to it
+    Watch** by_handle;     // open addressing table of dirs keyed by handle, dirs outside of tree have wd -1
+    int cap;               // capacity of table, power of 2
+    int size;              // number of dirs in table
+    int next_wd;           // wd given to the next dir found in events
+    uint32_t next_cookie;  // cookie of the next move
+    int rename;            // FAN_RENAME is reported, moves inside tree are matched
+    char* buf;             // raw fanotify events
+} FanWatchers;
+
+int fan_init(Watchers* w);
+
+void free_fan(Watchers* w);
+
+int fan_mark(Watchers* w, char* path);
+
+int fan_add_dir(Watchers* w, char* path);
+
+ssize_t fan_read(Watchers* w, char* buffer, size_t len);
+
+void fan_forget(Watchers* w, Watch* watch);
+
+void fan_forget_outside(Watchers* w);
+
+#endif
@@ -0,0 +1,546 @@
+#include "fanout.h"
+
+#include <signal.h>
+
+#include "worker.h"
+
+// create fan-out for given targets, replica threads aren't started yet
+FanOut* fanout_init(char* src, char** targets, int count, WorkerStats* stats, Log* logs)
+{
+    FanOut* f = malloc(sizeof(FanOut));
+    if (f == NULL)
+    {
+        ERR("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    f->src = src;
+    f->logs = logs;
+    f->stats = stats;
+    f->count = count;
+    f->active = 0;
+    f->copy = copy_stats;
+    f->replicas = malloc(sizeof(Replica) * count);
+    if (f->replicas == NULL)
+    {
+        ERR("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        Replica* r = &f->replicas[i];
+        r->fanout = f;
+        r->target = targets[i];
+        r->index = i;
+        r->active = 0;
+        r->cache = delta_cache_init();
+        r->manifest = NULL;
+        r->head = NULL;
+        r->tail = NULL;
+        r->queued = 0;
+        r->stop = 0;
+        r->fd = -1;
+        if (pthread_mutex_init(&r->lock, NULL) != 0 || pthread_cond_init(&r->cond, NULL) != 0)
+        {
+            ERR("pthread init");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    return f;
+}
+
+// stop all replicas and free fan-out, targets aren't freed
+void free_fanout(FanOut* f)
+{
+    if (f == NULL)
+        return;
+
+    for (int i = 0; i < f->count; i++)
+    {
+        fanout_end(f, i);
+        pthread_mutex_destroy(&f->replicas[i].lock);
+        pthread_cond_destroy(&f->replicas[i].cond);
+        free_delta_cache(f->replicas[i].cache);
+        manifest_close(f->replicas[i].manifest);
+    }
+
+    free(f->replicas);
+    free(f);
+}
+
+// initial copy of one replica
+static void* initial_copy_thread(void* arg)
+{
+    Replica* r = arg;
+    FanOut* f = r->fanout;
+    copy_stats = f->copy;
+
+    copy_dir(f->src, r->target, f->src, r->target, f->logs);
+    r->manifest = manifest_start(r->target);
+    return NULL;
+}
+
+// copy source into all targets at the same time
+void fanout_initial_copy(FanOut* f, int threads)
+{
+    // one target - copy can use the whole thread pool
+    if (f->count == 1)
+    {
+        copy_dir_parallel(f->src, f->replicas[0].target, f->src, f->replicas[0].target, threads, f->logs);
+        f->replicas[0].manifest = manifest_start(f->replicas[0].target);
+        return;
+    }
+
+    for (int i = 0; i < f->count; i++)
+    {
+        if (pthread_create(&f->replicas[i].thread, NULL, initial_copy_thread, &f->replicas[i]) != 0)
+        {
+            ERR("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (int i = 0; i < f->count; i++)
+    {
+        if (pthread_join(f->replicas[i].thread, NULL) != 0)
+        {
+            ERR("pthread_join");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+// targets already have a backup, they're compared with the source by replica threads
+void fanout_resume(FanOut* f)
+{
+    for (int i = 0; i < f->count; i++)
+    {
+        f->replicas[i].manifest = manifest_start(f->replicas[i].target);
+    }
+}
+
+// drop reference to chunk
+static void release_chunk(Chunk* chunk)
+{
+    if (atomic_fetch_sub(&chunk->refs, 1) == 1)
+    {
+        free(chunk);
+    }
+}
+
+// free queue item
+static void free_item(Item* item)
+{
+    if (item->chunk != NULL)
+        release_chunk(item->chunk);
+    free(item->op.path);
+    free(item->op.from);
+    free(item);
+}
+
+// create queue item of op, path is copied
+static Item* new_item(ItemType type, Op* op, char* path)
+{
+    Item* item = calloc(1, sizeof(Item));
+    if (item == NULL)
+    {
+        ERR("calloc");
+        exit(EXIT_FAILURE);
+    }
+
+    item->type = type;
+    item->op.type = op->type;
+    item->op.queued = op->queued;
+    if (path != NULL)
+    {
+        item->op.path = strdup(path);
+        if (item->op.path == NULL)
+        {
+            ERR("strdup");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    return item;
+}
+
+// add item at the end of replica queue
+static void enqueue(Replica* r, Item* item)
+{
+    pthread_mutex_lock(&r->lock);
+    if (r->tail == NULL)
+        r->head = item;
+    else
+        r->tail->next = item;
+    r->tail = item;
+    if (item->chunk != NULL)
+        r->queued += item->chunk->len;
+    pthread_cond_signal(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+}
+
+// write whole chunk at offset
+static void write_chunk(int fd, Chunk* chunk, off_t off)
+{
+    size_t done = 0;
+    while (done < chunk->len)
+    {
+        ssize_t n = pwrite(fd, chunk->data + done, chunk->len - done, off + done);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n < 0)
+        {
+            ERR("pwrite");
+            exit(EXIT_FAILURE);
+        }
+        done += n;
+    }
+}
+
+// apply one queue item to replica target
+static void run_item(Replica* r, Item* item)
+{
+    FanOut* f = r->fanout;
+
+    if (item->type == ITEM_OP)
+    {
+        execute_op(&item->op, f->src, r->target, r->cache, r->manifest, f->logs);
+        stats_record(f->stats, &item->op);
+        return;
+    }
+
+    if (item->type == ITEM_FILE_BEGIN)
+    {
+        char* file_path = src2target_path(item->op.path, f->src, r->target);
+        delta_forget(r->cache, file_path);
+        r->fd = open(file_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+        if (r->fd < 0)
+        {
+            ERR("open");
+            exit(EXIT_FAILURE);
+        }
+        free(file_path);
+        return;
+    }
+
+    if (item->type == ITEM_FILE_DATA)
+    {
+        write_chunk(r->fd, item->chunk, item->offset);
+        copy_stats->bytes += item->chunk->len;
+        return;
+    }
+
+    if (item->type == ITEM_FILE_ABORT)
+    {
+        if (close(r->fd) < 0)
+        {
+            ERR("close");
+            exit(EXIT_FAILURE);
+        }
+        r->fd = -1;
+        return;
+    }
+
+    // ITEM_FILE_END - holes at the end, permissions and times
+    if (ftruncate(r->fd, item->stat_info.st_size) != 0)
+    {
+        ERR("ftruncate");
+        exit(EXIT_FAILURE);
+    }
+    if (fchmod(r->fd, item->stat_info.st_mode) != 0)
+    {
+        ERR("fchmod");
+        exit(EXIT_FAILURE);
+    }
+    struct timespec times[2] = {item->stat_info.st_atim, item->stat_info.st_mtim};
+    if (futimens(r->fd, times) != 0)
+    {
+        ERR("futimens");
+        exit(EXIT_FAILURE);
+    }
+    if (close(r->fd) < 0)
+    {
+        ERR("close");
+        exit(EXIT_FAILURE);
+    }
+    r->fd = -1;
+    copy_stats->files++;
+    if (r->manifest != NULL)
+    {
+        char* file_path = src2target_path(item->op.path, f->src, r->target);
+        manifest_refresh(r->manifest, manifest_rel(r->manifest, file_path), 0);
+        free(file_path);
+    }
+    write_log(f->logs, f->src, r->target, "Fan-out wrote file: ", item->op.path);
+    stats_record(f->stats, &item->op);
+}
+
+// replica thread, applies queued items until it's stopped
+static void* replica_thread(void* arg)
+{
+    Replica* r = arg;
+    copy_stats = r->fanout->copy;
+
+    while (1)
+    {
+        pthread_mutex_lock(&r->lock);
+        while (r->head == NULL && !r->stop)
+        {
+            pthread_cond_wait(&r->cond, &r->lock);
+        }
+        if (r->head == NULL)
+        {
+            pthread_mutex_unlock(&r->lock);
+            break;
+        }
+        Item* item = r->head;
+        r->head = item->next;
+        if (r->head == NULL)
+            r->tail = NULL;
+        if (item->chunk != NULL)
+            r->queued -= item->chunk->len;
+        pthread_mutex_unlock(&r->lock);
+
+        run_item(r, item);
+        free_item(item);
+    }
+
+    return NULL;
+}
+
+// start replica threads, they don't receive signals meant for worker
+void fanout_start(FanOut* f)
+{
+    sigset_t mask, old_mask;
+    sigfillset(&mask);
+    pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
+
+    for (int i = 0; i < f->count; i++)
+    {
+        if (pthread_create(&f->replicas[i].thread, NULL, replica_thread, &f->replicas[i]) != 0)
+        {
+            ERR("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+        f->replicas[i].active = 1;
+        f->active++;
+    }
+
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+}
+
+// check if replica has too much data waiting in its queue
+static int replica_slow(Replica* r)
+{
+    pthread_mutex_lock(&r->lock);
+    int slow = r->queued >= FANOUT_MAX_QUEUED;
+    pthread_mutex_unlock(&r->lock);
+    return slow;
+}
+
+// replicas that fell behind while file is read stop getting its data and copy it by themselves
+// returns number of replicas that still get data
+static int drop_slow(FanOut* f, Replica** direct, int count, Op* op)
+{
+    for (int i = 0; i < count;)
+    {
+        if (!replica_slow(direct[i]))
+        {
+            i++;
+            continue;
+        }
+
+        write_log(f->logs, f->src, direct[i]->target, "Fan-out target fell behind, copies by itself: ", op->path);
+        enqueue(direct[i], new_item(ITEM_FILE_ABORT, op, op->path));
+        enqueue(direct[i], new_item(ITEM_OP, op, op->path));
+        direct[i] = direct[--count];
+    }
+    return count;
+}
+
+// read source file once and queue its data for every replica
+// replicas with too much queued data copy the file by themselves, so they don't stall the others
+static void push_file(FanOut* f, Op* op)
+{
+    int src = open(op->path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (src < 0 && errno == ENOENT)
+    {
+        write_log(f->logs, f->src, NULL, "Source vanished, skipping: ", op->path);
+        copy_stats->failed++;
+        return;
+    }
+    if (src < 0 && errno == ELOOP)
+    {
+        // file was replaced by symlink, every replica copies it
+        for (int i = 0; i < f->count; i++)
+        {
+            if (f->replicas[i].active)
+                enqueue(&f->replicas[i], new_item(ITEM_OP, op, op->path));
+        }
+        return;
+    }
+    if (src < 0)
+    {
+        ERR("open");
+        exit(EXIT_FAILURE);
+    }
+
+    struct stat stat_info;
+    if (fstat(src, &stat_info) != 0)
+    {
+        ERR("fstat");
+        exit(EXIT_FAILURE);
+    }
+
+    // choose replicas that get data from this reader
+    Replica* direct[FANOUT_MAX_TARGETS];
+    int count = 0;
+    for (int i = 0; i < f->count; i++)
+    {
+        Replica* r = &f->replicas[i];
+        if (!r->active)
+            continue;
+
+        if (replica_slow(r))
+            enqueue(r, new_item(ITEM_OP, op, op->path));
+        else
+            direct[count++] = r;
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        enqueue(direct[i], new_item(ITEM_FILE_BEGIN, op, op->path));
+    }
+
+    // walk data extents, holes are recreated by ftruncate() at the end
+    off_t off = 0;
+    while (count > 0 && off < stat_info.st_size)
+    {
+        off_t data = lseek(src, off, SEEK_DATA);
+        if (data < 0 && errno == ENXIO)
+            break;
+        if (data < 0)
+            data = off;
+        off_t end = lseek(src, data, SEEK_HOLE);
+        if (end < 0 || end > stat_info.st_size)
+            end = stat_info.st_size;
+
+        while (count > 0 && data < end)
+        {
+            // queue of every replica is checked again before each chunk, stalled one can't buffer the whole file
+            count = drop_slow(f, direct, count, op);
+            if (count == 0)
+                break;
+
+            size_t len = end - data < FANOUT_CHUNK_LEN ? end - data : FANOUT_CHUNK_LEN;
+            Chunk* chunk = malloc(sizeof(Chunk) + len);
+            if (chunk == NULL)
+            {
+                ERR("malloc");
+                exit(EXIT_FAILURE);
+            }
+
+            ssize_t n = pread(src, chunk->data, len, data);
+            if (n < 0 && errno == EINTR)
+            {
+                free(chunk);
+                continue;
+            }
+            if (n < 0)
+            {
+                ERR("pread");
+                exit(EXIT_FAILURE);
+            }
+            if (n == 0)
+            {
+                // file was truncated while reading
+                free(chunk);
+                stat_info.st_size = data;
+                break;
+            }
+
+            chunk->len = n;
+            atomic_init(&chunk->refs, count);
+            for (int i = 0; i < count; i++)
+            {
+                Item* item = new_item(ITEM_FILE_DATA, op, NULL);
+                item->chunk = chunk;
+                item->offset = data;
+                enqueue(direct[i], item);
+            }
+            data += n;
+        }
+        off = end;
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        Item* item = new_item(ITEM_FILE_END, op, op->path);
+        item->stat_info = stat_info;
+        enqueue(direct[i], item);
+    }
+
+    if (close(src) < 0)
+    {
+        ERR("close");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// queue op for all running replicas
+void fanout_push(FanOut* f, Op* op)
+{
+    // file data is read once for all targets
+    if (op->type == OP_COPY_FILE || op->type == OP_UPDATE_FILE)
+    {
+        push_file(f, op);
+        return;
+    }
+
+    for (int i = 0; i < f->count; i++)
+    {
+        if (!f->replicas[i].active)
+            continue;
+
+        Item* item = new_item(ITEM_OP, op, op->path);
+        if (op->from != NULL)
+        {
+            item->op.from = strdup(op->from);
+            if (item->op.from == NULL)
+            {
+                ERR("strdup");
+                exit(EXIT_FAILURE);
+            }
+        }
+        enqueue(&f->replicas[i], item);
+    }
+}
+
+// stop replica with given index after it applies queued items
+void fanout_end(FanOut* f, int index)
+{
+    if (index < 0 || index >= f->count || !f->replicas[index].active)
+        return;
+
+    Replica* r = &f->replicas[index];
+    pthread_mutex_lock(&r->lock);
+    r->stop = 1;
+    pthread_cond_signal(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+
+    if (pthread_join(r->thread, NULL) != 0)
+    {
+        ERR("pthread_join");
+        exit(EXIT_FAILURE);
+    }
+
+    r->active = 0;
+    f->active--;
+    // ended target keeps manifest that matches it
+    manifest_close(r->manifest);
+    r->manifest = NULL;
+    write_log(f->logs, f->src, r->target, "Fan-out target ended: ", r->target);
+}
@@ -0,0 +1,84 @@
+#ifndef FANOUT_H
+#define FANOUT_H
+
+#include "op.h"
+#include "stats.h"
+#include "utils.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+#define FANOUT_MAX_TARGETS 16
+#define FANOUT_CHUNK_LEN (1024 * 1024)          // size of data chunk read from source
+#define FANOUT_MAX_QUEUED (64 * 1024 * 1024)    // queued data of replica before it reads files by itself
+
+typedef struct Chunk
+{
+    atomic_int refs;  // replicas that didn't write chunk yet
+    size_t len;       // data length
+    char data[];      // file data
+} Chunk;
+
+typedef enum ItemType
+{
+    ITEM_OP,          // op executed by replica on its own
+    ITEM_FILE_BEGIN,  // open target file
+    ITEM_FILE_DATA,   // write chunk of data to opened file
+    ITEM_FILE_END,    // set size, permissions and times, close file
+    ITEM_FILE_ABORT,  // close file that won't get the rest of its data, op after it copies the file
+} ItemType;
+
+typedef struct Item
+{
+    ItemType type;           // type of item
+    Op op;                   // op and source path, path is owned by item
+    Chunk* chunk;            // ITEM_FILE_DATA chunk
+    off_t offset;            // ITEM_FILE_DATA offset of chunk in file
+    struct stat stat_info;   // ITEM_FILE_END source file info
+    struct Item* next;       // next item in queue
+} Item;
+
+typedef struct Replica
+{
+    struct FanOut* fanout;  // owner
+    char* target;           // target root
+    int index;              // index of target in worker
+    int active;             // replica thread is running
+    DeltaCache* cache;      // block hashes of updated target files
+    Manifest* manifest;     // entries of target files, NULL when it can't be made
+    Item* head;             // queue of items
+    Item* tail;             // last item in queue
+    size_t queued;          // bytes of data waiting in queue
+    int stop;               // exit when queue is empty
+    int fd;                 // target file written by ITEM_FILE_* items
+    pthread_mutex_t lock;   // queue lock
+    pthread_cond_t cond;    // signals new items
+    pthread_t thread;       // replica thread
+} Replica;
+
+typedef struct FanOut
+{
+    char* src;           // source root
+    Log* logs;           // logs file
+    Replica* replicas;   // one replica per target
+    int count;           // number of replicas
+    int active;          // number of running replicas
+    WorkerStats* stats;  // latencies of ops applied by replicas, NULL without stats slot
+    CopyStats* copy;     // copy counters of worker, replicas count into them
+} FanOut;
+
+FanOut* fanout_init(char* src, char** targets, int count, WorkerStats* stats, Log* logs);
+
+void free_fanout(FanOut* f);
+
+void fanout_initial_copy(FanOut* f, int threads);
+
+void fanout_resume(FanOut* f);
+
+void fanout_start(FanOut* f);
+
+void fanout_push(FanOut* f, Op* op);
+
+void fanout_end(FanOut* f, int index);
+
+#endif
@@ -0,0 +1,112 @@
+#include "latency.h"
+
+// bucket of value, values below LATENCY_SUB have own buckets
+static int bucket_index(unsigned long long us)
+{
+    if (us < LATENCY_SUB)
+        return us;
+
+    int exp = 63 - __builtin_clzll(us);
+    if (exp >= LATENCY_MAX_EXP)
+        return LATENCY_BUCKETS - 1;
+
+    int sub = (us >> (exp - LATENCY_SUB_BITS)) & (LATENCY_SUB - 1);
+    return (exp - LATENCY_SUB_BITS + 1) * LATENCY_SUB + sub;
+}
+
+// smallest value of bucket
+unsigned long long latency_bucket_low(int index)
+{
+    if (index < LATENCY_SUB)
+        return index;
+
+    int exp = index / LATENCY_SUB + LATENCY_SUB_BITS - 1;
+    unsigned long long sub = index % LATENCY_SUB;
+    return (LATENCY_SUB + sub) << (exp - LATENCY_SUB_BITS);
+}
+
+// largest value of bucket
+unsigned long long latency_bucket_high(int index)
+{
+    if (index < LATENCY_SUB)
+        return index;
+
+    int exp = index / LATENCY_SUB + LATENCY_SUB_BITS - 1;
+    return latency_bucket_low(index) + (1ULL << (exp - LATENCY_SUB_BITS)) - 1;
+}
+
+// add value to histogram, safe to call from many threads
+void latency_record(LatencyHist* h, unsigned long long us)
+{
+    atomic_fetch_add_explicit(&h->counts[bucket_index(us)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->sum, us, memory_order_relaxed);
+
+    unsigned long long max = atomic_load_explicit(&h->max, memory_order_relaxed);
+    while (us > max && !atomic_compare_exchange_weak_explicit(&h->max, &max, us, memory_order_relaxed,
+                                                              memory_order_relaxed))
+    {
+    }
+}
+
+// value that q of recorded values don't exceed, largest value of its bucket but not more than max
+unsigned long long latency_percentile(LatencyHist* h, double q)
+{
+    unsigned long long counts[LATENCY_BUCKETS];
+    unsigned long long total = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++)
+    {
+        counts[i] = atomic_load_explicit(&h->counts[i], memory_order_relaxed);
+        total += counts[i];
+    }
+    if (total == 0)
+        return 0;
+
+    // rank of value, from 1
+    unsigned long long rank = (unsigned long long)(q * total);
+    if (rank < q * total || rank == 0)
+        rank++;
+
+    unsigned long long max = atomic_load_explicit(&h->max, memory_order_relaxed);
+    unsigned long long seen = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++)
+    {
+        seen += counts[i];
+        if (seen >= rank)
+            return latency_bucket_high(i) < max ? latency_bucket_high(i) : max;
+    }
+
+    return max;
+}
+
+// print percentiles in ms on one line
+void print_latency(LatencyHist* h, const char* name, FILE* out)
+{
+    unsigned long long count = atomic_load_explicit(&h->count, memory_order_relaxed);
+    if (count == 0)
+    {
+        fprintf(out, "      %-7s no ops\n", name);
+        return;
+    }
+
+    fprintf(out, "      %-7s %8llu ops  mean %.3f  p50 %.3f  p99 %.3f  p999 %.3f  max %.3f ms\n", name, count,
+            atomic_load_explicit(&h->sum, memory_order_relaxed) / 1000.0 / count,
+            latency_percentile(h, 0.5) / 1000.0, latency_percentile(h, 0.99) / 1000.0,
+            latency_percentile(h, 0.999) / 1000.0, atomic_load_explicit(&h->max, memory_order_relaxed) / 1000.0);
+}
+
+// write percentiles and every bucket that isn't empty, values in us
+void dump_latency(LatencyHist* h, const char* name, FILE* out)
+{
+    fprintf(out, "%s count=%llu sum_us=%llu p50_us=%llu p99_us=%llu p999_us=%llu max_us=%llu\n", name,
+            atomic_load_explicit(&h->count, memory_order_relaxed), atomic_load_explicit(&h->sum, memory_order_relaxed),
+            latency_percentile(h, 0.5), latency_percentile(h, 0.99), latency_percentile(h, 0.999),
+            atomic_load_explicit(&h->max, memory_order_relaxed));
+
+    for (int i = 0; i < LATENCY_BUCKETS; i++)
+    {
+        unsigned long long count = atomic_load_explicit(&h->counts[i], memory_order_relaxed);
+        if (count > 0)
+            fprintf(out, "%s bucket %llu %llu %llu\n", name, latency_bucket_low(i), latency_bucket_high(i), count);
+    }
+}
@@ -0,0 +1,34 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include "utils.h"
+
+#include <stdatomic.h>
+
+#define LATENCY_SUB_BITS 4                   // 16 linear buckets in every power of two, values within 6.25%
+#define LATENCY_SUB (1 << LATENCY_SUB_BITS)  // buckets in every power of two
+#define LATENCY_MAX_EXP 36                   // latencies longer than 2^36 us (19 hours) go to the last bucket
+#define LATENCY_BUCKETS ((LATENCY_MAX_EXP - LATENCY_SUB_BITS + 1) * LATENCY_SUB)
+
+// log-linear histogram of latencies in us, threads record into it without locks
+typedef struct LatencyHist
+{
+    atomic_ullong counts[LATENCY_BUCKETS];  // recorded values in every bucket
+    atomic_ullong count;                    // recorded values
+    atomic_ullong sum;                      // sum of recorded values
+    atomic_ullong max;                      // longest recorded value
+} LatencyHist;
+
+void latency_record(LatencyHist* h, unsigned long long us);
+
+unsigned long long latency_percentile(LatencyHist* h, double q);
+
+unsigned long long latency_bucket_low(int index);
+
+unsigned long long latency_bucket_high(int index);
+
+void print_latency(LatencyHist* h, const char* name, FILE* out);
+
+void dump_latency(LatencyHist* h, const char* name, FILE* out);
+
+#endif
@@ -0,0 +1,232 @@
+#include "log.h"
+
+#include <stdarg.h>
+
+static const char* level_names[] = {"debug", "info", "warn"};
+
+// log of the process, buffered records are written when it exits
+static Log* exit_log = NULL;
+
+static void flush_at_exit() { log_flush(exit_log); }
+
+// open log file, it starts empty
+Log* log_open(const char* path, LogLevel level)
+{
+    Log* log = malloc(sizeof(Log));
+    if (log == NULL)
+    {
+        ERR("malloc");
+        exit(EXIT_FAILURE);
+    }
+    log->ring = malloc(LOG_RING_LEN);
+    if (log->ring == NULL)
+    {
+        ERR("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    // O_APPEND keeps every batch of every process whole
+    log->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (log->fd < 0)
+    {
+        ERR("open");
+        exit(EXIT_FAILURE);
+    }
+    log->level = level;
+    log->head = 0;
+    log->len = 0;
+    log->flushed = monotonic_ms();
+    if (pthread_mutex_init(&log->lock, NULL) != 0 || pthread_mutex_init(&log->flush_lock, NULL) != 0)
+    {
+        ERR("pthread_mutex_init");
+        exit(EXIT_FAILURE);
+    }
+
+    exit_log = log;
+    if (atexit(flush_at_exit) != 0)
+    {
+        ERR("atexit");
+        exit(EXIT_FAILURE);
+    }
+
+    return log;
+}
+
+// flush and close log
+void log_close(Log* log)
+{
+    log_flush(log);
+    exit_log = NULL;
+    if (close(log->fd) < 0)
+    {
+        ERR("close");
+        exit(EXIT_FAILURE);
+    }
+    pthread_mutex_destroy(&log->lock);
+    pthread_mutex_destroy(&log->flush_lock);
+    free(log->ring);
+    free(log);
+}
+
+// write buffered records in one batch, ring lock isn't held while they're written
+// so other threads keep appending, only one thread writes at a time
+static void flush(Log* log, int wait)
+{
+    if (wait)
+        pthread_mutex_lock(&log->flush_lock);
+    else if (pthread_mutex_trylock(&log->flush_lock) != 0)
+        return;
+
+    pthread_mutex_lock(&log->lock);
+    size_t head = log->head;
+    size_t len = log->len;
+    pthread_mutex_unlock(&log->lock);
+
+    // records can wrap around the end of the ring
+    size_t first = LOG_RING_LEN - head;
+    if (first > len)
+        first = len;
+    struct iovec iov[2] = {{log->ring + head, first}, {log->ring, len - first}};
+    int count = len > first ? 2 : 1;
+
+    // records are lost on error, worker goes on
+    if (writev_all(log->fd, iov, count) < 0)
+        ERR("writev");
+
+    pthread_mutex_lock(&log->lock);
+    log->head = (head + len) % LOG_RING_LEN;
+    log->len -= len;
+    log->flushed = monotonic_ms();
+    pthread_mutex_unlock(&log->lock);
+
+    pthread_mutex_unlock(&log->flush_lock);
+}
+
+// copy bytes into the ring after buffered records, there is room for them
+static void ring_put(Log* log, const void* data, size_t len)
+{
+    size_t tail = (log->head + log->len) % LOG_RING_LEN;
+    size_t first = LOG_RING_LEN - tail;
+    if (first > len)
+        first = len;
+    memcpy(log->ring + tail, data, first);
+    memcpy(log->ring, (const char*)data + first, len - first);
+    log->len += len;
+}
+
+// append record to the ring, it's written when enough records are buffered or the oldest waits too long
+void log_write(Log* log, LogLevel level, const char* fmt, ...)
+{
+    if (level < log->level)
+        return;
+
+    char text[LOG_TEXT_MAX];
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(text, sizeof(text), fmt, args);
+    va_end(args);
+    if (len < 0)
+        return;
+    if (len >= (int)sizeof(text))
+        len = sizeof(text) - 1;
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    LogRecord record = {len, level, 0, getpid(), (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec};
+
+    // full ring - writer waits for the batch
+    pthread_mutex_lock(&log->lock);
+    while (log->len + sizeof(record) + len > LOG_RING_LEN)
+    {
+        pthread_mutex_unlock(&log->lock);
+        flush(log, 1);
+        pthread_mutex_lock(&log->lock);
+    }
+    ring_put(log, &record, sizeof(record));
+    ring_put(log, text, len);
+    int due = log->len >= LOG_FLUSH_LEN || monotonic_ms() - log->flushed >= LOG_FLUSH_MS;
+    pthread_mutex_unlock(&log->lock);
+
+    // thread that is already writing takes these records later
+    if (due)
+        flush(log, 0);
+}
+
+// write all buffered records, before fork so the child doesn't write them again
+void log_flush(Log* log)
+{
+    if (log != NULL)
+        flush(log, 1);
+}
+
+// write buffered records that waited too long, for processes that stopped logging
+void log_tick(Log* log, long long now)
+{
+    if (log_timeout(log, now) == 0)
+        flush(log, 0);
+}
+
+// ms until buffered records have to be written, -1 if nothing is buffered
+int log_timeout(Log* log, long long now)
+{
+    pthread_mutex_lock(&log->lock);
+    long long deadline = log->flushed + LOG_FLUSH_MS;
+    int timeout = log->len == 0 ? -1 : deadline > now ? deadline - now : 0;
+    pthread_mutex_unlock(&log->lock);
+
+    return timeout;
+}
+
+// level from its name, -1 if name is unknown
+int log_parse_level(const char* name, LogLevel* level)
+{
+    for (int i = 0; i < (int)(sizeof(level_names) / sizeof(level_names[0])); i++)
+    {
+        if (strcmp(name, level_names[i]) == 0)
+        {
+            *level = i;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+// print binary log as text, -1 if it can't be read or is broken
+int log_decode(const char* path, FILE* out)
+{
+    FILE* in = fopen(path, "rb");
+    if (in == NULL)
+    {
+        ERR("fopen");
+        return -1;
+    }
+
+    LogRecord record;
+    char text[LOG_TEXT_MAX];
+    int ret = 0;
+    while (fread(&record, sizeof(record), 1, in) == 1)
+    {
+        if (record.len >= sizeof(text) || record.level > LOG_LEVEL_WARN || fread(text, 1, record.len, in) != record.len)
+        {
+            fprintf(stderr, "Broken record at offset %ld\n", ftell(in));
+            ret = -1;
+            break;
+        }
+
+        time_t sec = record.time_ns / 1000000000;
+        struct tm tm;
+        localtime_r(&sec, &tm);
+        char stamp[32];
+        strftime(stamp, sizeof(stamp), "%H:%M:%S", &tm);
+        fprintf(out, "%s.%03lld %-5s [%d] %.*s\n", stamp, (long long)(record.time_ns % 1000000000) / 1000000,
+                level_names[record.level], record.pid, (int)record.len, text);
+    }
+
+    if (fclose(in) != 0)
+    {
+        ERR("fclose");
+        return -1;
+    }
+    return ret;
+}
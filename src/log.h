@@ -0,0 +1,73 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include "utils.h"
+
+#include <pthread.h>
+#include <stdint.h>
+
+#define LOG_RING_LEN (64 * 1024)   // bytes of records buffered by one process
+#define LOG_FLUSH_LEN (16 * 1024)  // buffered bytes that are written at once
+#define LOG_FLUSH_MS 250           // longest time a record waits in the buffer
+#define LOG_TEXT_MAX 1024          // longest text of one record
+
+// records below this level aren't compiled in, set with make LOG_LEVEL=N
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL LOG_LEVEL_DEBUG
+#endif
+
+typedef enum LogLevel
+{
+    LOG_LEVEL_DEBUG,  // every source event
+    LOG_LEVEL_INFO,   // ops applied to targets, workers starting and ending
+    LOG_LEVEL_WARN,   // lost events and other recovered problems
+} LogLevel;
+
+// header of binary record in log file, text of len bytes without '\0' follows it
+typedef struct LogRecord
+{
+    uint16_t len;     // bytes of text
+    uint8_t level;    // LogLevel
+    uint8_t unused;   // keeps header 8-byte aligned
+    int32_t pid;      // process that wrote record
+    int64_t time_ns;  // realtime clock
+} LogRecord;
+
+// ring buffer of records of one process, threads of process share it
+typedef struct Log
+{
+    int fd;                      // log file, records of all processes are appended
+    LogLevel level;              // records below level are dropped at runtime
+    char* ring;                  // LOG_RING_LEN bytes of records
+    size_t head;                 // offset of the oldest buffered byte
+    size_t len;                  // buffered bytes
+    long long flushed;           // monotonic ms of last flush
+    pthread_mutex_t lock;        // ring lock
+    pthread_mutex_t flush_lock;  // held by thread that writes records
+} Log;
+
+// record is formatted only when its level is compiled in and enabled
+#define LOG(log, lvl, ...)                                   \
+    do                                                       \
+    {                                                        \
+        if ((lvl) >= LOG_MIN_LEVEL && (lvl) >= (log)->level) \
+            log_write((log), (lvl), __VA_ARGS__);            \
+    } while (0)
+
+Log* log_open(const char* path, LogLevel level);
+
+void log_close(Log* log);
+
+void log_write(Log* log, LogLevel level, const char* fmt, ...) __attribute__((format(printf, 3, 4)));
+
+void log_flush(Log* log);
+
+void log_tick(Log* log, long long now);
+
+int log_timeout(Log* log, long long now);
+
+int log_parse_level(const char* name, LogLevel* level);
+
+int log_decode(const char* path, FILE* out);
+
+#endif
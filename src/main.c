@@ -1,27 +1,66 @@
 #include "command_handler.h"
 #include "dict.h"
+#include "log.h"
 #include "parser.h"
 #include "signal_handler.h"
 #include "utils.h"
 
-int main()
+// program options, log of records below level isn't written, engine has threads or is disabled with 0
+static void parse_args(int n_args, char** args, LogLevel* level, int* engine)
 {
+    for (int i = 1; i < n_args; i++)
+    {
+        if (strncmp(args[i], "--log-level=", 12) == 0 && log_parse_level(args[i] + 12, level) == 0)
+            continue;
+
+        // backups share threads of one engine process
+        if (strncmp(args[i], "--engine=", 9) == 0)
+        {
+            *engine = atoi(args[i] + 9);
+            if (*engine >= 1 && *engine <= ENGINE_MAX_THREADS)
+                continue;
+        }
+
+        // print binary log as text and end
+        if (strcmp(args[i], "--decode-log") == 0 && i + 1 < n_args)
+            exit(log_decode(args[i + 1], stdout) == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+
+        fprintf(stderr, "Usage: %s [--log-level=debug|info|warn] [--engine=N] [--decode-log <log file>]\n", args[0]);
+        exit(EXIT_FAILURE);
+    }
+}
+
+int main(int n_args, char** args)
+{
+    LogLevel level = LOG_LEVEL_DEBUG;
+    int threads = 0;
+    parse_args(n_args, args, &level, &threads);
+
     // Program usage
     usage();
 
     // setup:
-    char* cmd = NULL;                         // user input line
-    size_t len = 0;                           // input length
-    char* argv[MAX_ARGS];                     // arguments array
-    int argc = 0;                             // arguments count
-    Dict* dict = create_dict();               // dict for active copies with workers pids
-    FILE* logs = fopen("workers.log", "w+");  // file for storing workers logs
+    char* cmd = NULL;                            // user input line
+    size_t len = 0;                              // input length
+    char* argv[MAX_ARGS];                        // arguments array
+    int argc = 0;                                // arguments count
+    Dict* dict = create_dict();                  // dict for active copies with workers pids
+    Log* logs = log_open("workers.log", level);  // binary log of workers
+    StatsTable* stats = stats_init();            // live counters of workers in shared memory
+    Engine* engine = engine_init(threads);       // threads serving all backups, NULL without --engine
 
     // signal handling:
-    set_ign();                          // ignore all signals
-    set_handler(sig_handler, SIGINT);   // handler for SIGINT
-    set_handler(sig_handler, SIGTERM);  // handler for SIGTERM
-    set_handler(sig_handler, SIGCHLD);  // handler for SIGCHLD
+    set_ign();                                      // ignore all signals
+    set_handler(sig_handler, SIGINT);               // handler for SIGINT
+    set_handler(sig_handler, SIGTERM);              // handler for SIGTERM
+    set_handler(sig_handler, SIGCHLD);              // handler for SIGCHLD
+    set_handler(wake_handler, PAIR_FAILED_SIGNAL);  // engine reports failed pairs
+
+    // fan-out worker inherits blocked ends of targets, they're queued until it waits for events
+    sigset_t block;
+    sigemptyset(&block);
+    sigaddset(&block, TARGET_END_SIGNAL);
+    sigprocmask(SIG_BLOCK, &block, NULL);
 
     // Waiting for user input
     while (last_signal != SIGINT && last_signal != SIGTERM)
@@ -50,12 +89,18 @@ int main()
                     ERR_KILL("waitpid");
                 }
 
-                // delete child from workers dict
-                fprintf(stdout, "\nWorker [%d] stopped working unexpectedly!\n", child_pid);
-                delete_pid(dict, child_pid);
+                // delete child from workers dict, restorers report how they ended
+                handle_child_exit(dict, child_pid, engine);
             }
         }
 
+        // pairs that failed in engine are removed, signal of engine interrupted reading of command
+        if (handle_engine_failures(dict, engine) > 0)
+        {
+            len = 0;
+            clearerr(stdin);
+        }
+
         fprintf(stdout, "> ");
         if (getline(&cmd, &len, stdin) > 1)
         {
@@ -65,20 +110,32 @@ int main()
             {
                 if (strcmp("add", argv[0]) == 0)
                 {
-                    handle_add(dict, argv, argc, logs);
+                    handle_add(dict, argv, argc, stats, engine, logs);
                 }
                 else if (strcmp("end", argv[0]) == 0)
                 {
-                    handle_end(dict, argv, argc);
+                    handle_end(dict, argv, argc, engine);
                 }
                 else if (strcmp("list", argv[0]) == 0)
                 {
                     handle_list(dict);
                 }
+                else if (strcmp("stats", argv[0]) == 0)
+                {
+                    handle_stats(dict);
+                }
+                else if (strcmp("latency", argv[0]) == 0)
+                {
+                    handle_latency(dict, argv, argc);
+                }
                 else if (strcmp("restore", argv[0]) == 0)
                 {
                     handle_restore(dict, argv, argc, logs);
                 }
+                else if (strcmp("cancel", argv[0]) == 0)
+                {
+                    handle_cancel(dict, argv, argc);
+                }
                 else if (strcmp("exit", argv[0]) == 0)
                 {
                     break;
@@ -99,12 +156,13 @@ int main()
 
     // exit cleanup
     fprintf(stdout, "\nExiting...\n");
-    // kill all workers
+    // engine ends its pairs, then kill all workers
+    free_engine(engine);
     handle_exit(dict);
 
     // free memory and close files
-    if (fclose(logs))
-        ERR_KILL("fclose");
+    log_close(logs);
+    free_stats(stats);
     free(cmd);
     free_argv(argv, argc);
 
@@ -0,0 +1,702 @@
+#include "manifest.h"
+
+#include <limits.h>
+#include <sys/mman.h>
+
+#include "dir_iter.h"
+
+#define NO_SLOT UINT32_MAX     // no entry in list of children
+#define ORPHAN (UINT32_MAX - 1)  // parent of entry whose directory isn't in manifest
+
+// FNV-1a hash of path, never 0
+static uint64_t path_hash(const char* path, size_t len)
+{
+    uint64_t hash = 1469598103934665603ULL;
+    for (size_t i = 0; i < len; i++)
+    {
+        hash ^= (unsigned char)path[i];
+        hash *= 1099511628211ULL;
+    }
+
+    return hash == 0 ? 1 : hash;
+}
+
+// size of manifest file with given table and heap
+static size_t layout_len(uint64_t cap, uint64_t heap_cap)
+{
+    return sizeof(ManifestHeader) + cap * sizeof(ManifestEntry) + heap_cap;
+}
+
+// find entry of path, when it's missing free_slot is set to slot where it can be added
+static ManifestEntry* find_entry(Manifest* m, const char* rel, size_t len, uint64_t key, ManifestEntry** free_slot)
+{
+    size_t mask = m->header->cap - 1;
+    ManifestEntry* deleted = NULL;
+
+    for (size_t i = key & mask;; i = (i + 1) & mask)
+    {
+        ManifestEntry* e = &m->entries[i];
+        if (e->key == 0)
+        {
+            if (free_slot != NULL)
+                *free_slot = deleted != NULL ? deleted : e;
+            return NULL;
+        }
+        if (e->path_len == 0 && deleted == NULL)
+            deleted = e;
+        else if (e->key == key && e->path_len == len && memcmp(m->heap + e->path, rel, len) == 0)
+            return e;
+    }
+}
+
+// add new entry at slot i to children of its directory, entries in target root aren't linked
+static void link_entry(Manifest* m, uint32_t i)
+{
+    m->up[i] = NO_SLOT;
+    m->prev[i] = NO_SLOT;
+    m->next[i] = NO_SLOT;
+
+    char* path = m->heap + m->entries[i].path;
+    char* slash = memrchr(path, '/', m->entries[i].path_len);
+    if (slash == NULL)
+        return;
+
+    // directory could be missing, e.g. after it was removed without its subtree
+    size_t len = slash - path;
+    ManifestEntry* parent = find_entry(m, path, len, path_hash(path, len), NULL);
+    m->up[i] = parent != NULL ? (uint32_t)(parent - m->entries) : ORPHAN;
+    uint32_t* head = parent != NULL ? &m->first[m->up[i]] : &m->orphans;
+    m->next[i] = *head;
+    if (*head != NO_SLOT)
+        m->prev[*head] = i;
+    *head = i;
+}
+
+// take entry at slot i out of children of its directory, its own children become orphans
+static void unlink_entry(Manifest* m, uint32_t i)
+{
+    if (m->up[i] != NO_SLOT)
+    {
+        uint32_t* head = m->up[i] == ORPHAN ? &m->orphans : &m->first[m->up[i]];
+        if (m->prev[i] != NO_SLOT)
+            m->next[m->prev[i]] = m->next[i];
+        else
+            *head = m->next[i];
+        if (m->next[i] != NO_SLOT)
+            m->prev[m->next[i]] = m->prev[i];
+    }
+    m->up[i] = NO_SLOT;
+
+    while (m->first[i] != NO_SLOT)
+    {
+        uint32_t child = m->first[i];
+        m->first[i] = m->next[child];
+        m->up[child] = ORPHAN;
+        m->prev[child] = NO_SLOT;
+        m->next[child] = m->orphans;
+        if (m->orphans != NO_SLOT)
+            m->prev[m->orphans] = child;
+        m->orphans = child;
+    }
+}
+
+// build children of every directory from the whole table
+static void index_table(Manifest* m)
+{
+    size_t size = sizeof(uint32_t) * m->header->cap;
+    m->first = realloc(m->first, size);
+    m->next = realloc(m->next, size);
+    m->prev = realloc(m->prev, size);
+    m->up = realloc(m->up, size);
+    if (m->first == NULL || m->next == NULL || m->prev == NULL || m->up == NULL)
+    {
+        ERR("realloc");
+        exit(EXIT_FAILURE);
+    }
+    memset(m->first, 0xff, size);
+    m->orphans = NO_SLOT;
+
+    for (uint32_t i = 0; i < m->header->cap; i++)
+    {
+        if (m->entries[i].key != 0 && m->entries[i].path_len != 0)
+            link_entry(m, i);
+    }
+}
+
+// map len bytes of manifest file
+static void map_file(Manifest* m, size_t len)
+{
+    if (m->header != NULL && munmap(m->header, m->len) != 0)
+    {
+        ERR("munmap");
+        exit(EXIT_FAILURE);
+    }
+
+    int prot = m->writable ? PROT_READ | PROT_WRITE : PROT_READ;
+    void* map = mmap(NULL, len, prot, MAP_SHARED, m->fd, 0);
+    if (map == MAP_FAILED)
+    {
+        ERR("mmap");
+        exit(EXIT_FAILURE);
+    }
+
+    m->len = len;
+    m->header = map;
+    m->entries = (ManifestEntry*)(m->header + 1);
+    m->heap = (char*)(m->entries + m->header->cap);
+    if (m->writable)
+        index_table(m);
+}
+
+// resize manifest file to given table and heap, content of table and heap is lost
+static void resize_file(Manifest* m, uint64_t cap, uint64_t heap_cap)
+{
+    if (m->header != NULL && munmap(m->header, m->len) != 0)
+    {
+        ERR("munmap");
+        exit(EXIT_FAILURE);
+    }
+    m->header = NULL;
+
+    // new size is filled with zeros
+    size_t len = layout_len(cap, heap_cap);
+    if (ftruncate(m->fd, sizeof(ManifestHeader)) != 0 || ftruncate(m->fd, len) != 0)
+    {
+        ERR("ftruncate");
+        exit(EXIT_FAILURE);
+    }
+
+    // header is still in file, table size is needed for mapping
+    ManifestHeader header;
+    memcpy(header.magic, MANIFEST_MAGIC, sizeof(header.magic));
+    header.clean = 0;
+    header.cap = cap;
+    header.count = 0;
+    header.used = 0;
+    header.heap_len = 0;
+    header.heap_cap = heap_cap;
+    if (pwrite(m->fd, &header, sizeof(header), 0) != sizeof(header))
+    {
+        ERR("pwrite");
+        exit(EXIT_FAILURE);
+    }
+
+    map_file(m, len);
+}
+
+// check if header describes valid manifest of file with given size
+static int valid_header(ManifestHeader* h, off_t size)
+{
+    return memcmp(h->magic, MANIFEST_MAGIC, sizeof(h->magic)) == 0 && h->cap >= MANIFEST_MIN_CAP
+           && (h->cap & (h->cap - 1)) == 0 && h->heap_len <= h->heap_cap
+           && (off_t)layout_len(h->cap, h->heap_cap) == size;
+}
+
+// open manifest of target, writable manifest is created when it's missing or broken
+// returns NULL when there's no manifest, backup works without it
+Manifest* manifest_open(char* target, int writable)
+{
+    char path[PATH_MAX];
+    if (snprintf(path, sizeof(path), "%s%s", target, MANIFEST_SUFFIX) >= (int)sizeof(path))
+        return NULL;
+
+    int fd = open(path, writable ? O_RDWR | O_CREAT | O_CLOEXEC : O_RDONLY | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return NULL;
+
+    Manifest* m = malloc(sizeof(Manifest));
+    if (m == NULL)
+    {
+        ERR("malloc");
+        exit(EXIT_FAILURE);
+    }
+    m->root = strdup(target);
+    if (m->root == NULL)
+    {
+        ERR("strdup");
+        exit(EXIT_FAILURE);
+    }
+    m->root_len = strlen(target);
+    m->fd = fd;
+    m->writable = writable;
+    m->len = 0;
+    m->header = NULL;
+    m->first = NULL;
+    m->next = NULL;
+    m->prev = NULL;
+    m->up = NULL;
+
+    // header decides the size of mapping
+    struct stat stat_info;
+    ManifestHeader header;
+    if (fstat(fd, &stat_info) != 0)
+    {
+        ERR("fstat");
+        exit(EXIT_FAILURE);
+    }
+    int valid = stat_info.st_size >= (off_t)sizeof(header) && pread(fd, &header, sizeof(header), 0) == sizeof(header)
+                && valid_header(&header, stat_info.st_size);
+
+    if (valid)
+        map_file(m, stat_info.st_size);
+    else if (writable)
+        resize_file(m, MANIFEST_MIN_CAP, MANIFEST_MIN_HEAP);
+    else
+    {
+        manifest_close(m);
+        return NULL;
+    }
+
+    // manifest doesn't match the target until worker exits
+    if (writable)
+        m->header->clean = 0;
+
+    return m;
+}
+
+// open manifest of worker, it's built from the target
+// target could be changed while no worker ran, so old manifest isn't trusted
+Manifest* manifest_start(char* target)
+{
+    Manifest* m = manifest_open(target, 1);
+    manifest_clear(m);
+    manifest_add_tree(m, "");
+    return m;
+}
+
+// unmap manifest, manifest of worker is marked as matching the target
+void manifest_close(Manifest* m)
+{
+    if (m == NULL)
+        return;
+
+    if (m->header != NULL)
+    {
+        if (m->writable)
+        {
+            m->header->clean = 1;
+            if (msync(m->header, m->len, MS_SYNC) != 0)
+            {
+                ERR("msync");
+                exit(EXIT_FAILURE);
+            }
+        }
+        if (munmap(m->header, m->len) != 0)
+        {
+            ERR("munmap");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (close(m->fd) < 0)
+    {
+        ERR("close");
+        exit(EXIT_FAILURE);
+    }
+
+    free(m->root);
+    free(m->first);
+    free(m->next);
+    free(m->prev);
+    free(m->up);
+    free(m);
+}
+
+// remove all entries
+void manifest_clear(Manifest* m)
+{
+    if (m != NULL)
+        resize_file(m, MANIFEST_MIN_CAP, MANIFEST_MIN_HEAP);
+}
+
+// path relative to target root of path inside target
+const char* manifest_rel(Manifest* m, const char* path)
+{
+    const char* rel = path + m->root_len;
+    return *rel == '/' ? rel + 1 : rel;
+}
+
+// entry of path relative to target root, NULL if it's not in manifest
+ManifestEntry* manifest_get(Manifest* m, const char* rel)
+{
+    if (m == NULL)
+        return NULL;
+
+    size_t len = strlen(rel);
+    return find_entry(m, rel, len, path_hash(rel, len), NULL);
+}
+
+// rewrite table without deleted entries, table and heap grow to fit need more bytes of paths
+static void rebuild(Manifest* m, size_t need)
+{
+    ManifestHeader* h = m->header;
+
+    // entries and their paths are copied out of the mapping
+    ManifestEntry* live = malloc(sizeof(ManifestEntry) * (h->count + 1));
+    if (live == NULL)
+    {
+        ERR("malloc");
+        exit(EXIT_FAILURE);
+    }
+    uint64_t count = 0;
+    size_t heap_len = 0;
+    for (uint64_t i = 0; i < h->cap; i++)
+    {
+        if (m->entries[i].key != 0 && m->entries[i].path_len != 0)
+        {
+            live[count++] = m->entries[i];
+            heap_len += m->entries[i].path_len + 1;
+        }
+    }
+    char* paths = malloc(heap_len + 1);
+    if (paths == NULL)
+    {
+        ERR("malloc");
+        exit(EXIT_FAILURE);
+    }
+    size_t offset = 0;
+    for (uint64_t i = 0; i < count; i++)
+    {
+        memcpy(paths + offset, m->heap + live[i].path, live[i].path_len + 1);
+        live[i].path = offset;
+        offset += live[i].path_len + 1;
+    }
+
+    // table is at most quarter full after rebuild
+    uint64_t cap = MANIFEST_MIN_CAP;
+    while (cap < (count + 1) * 4)
+        cap *= 2;
+    uint64_t heap_cap = MANIFEST_MIN_HEAP;
+    while (heap_cap < (heap_len + need) * 2)
+        heap_cap *= 2;
+
+    resize_file(m, cap, heap_cap);
+    memcpy(m->heap, paths, heap_len);
+    for (uint64_t i = 0; i < count; i++)
+    {
+        size_t j = live[i].key & (cap - 1);
+        while (m->entries[j].key != 0)
+            j = (j + 1) & (cap - 1);
+        m->entries[j] = live[i];
+    }
+    m->header->count = count;
+    m->header->used = count;
+    m->header->heap_len = heap_len;
+    index_table(m);
+
+    free(live);
+    free(paths);
+}
+
+// add or change entry of path with fields of given entry
+static void put_fields(Manifest* m, const char* rel, ManifestEntry* fields)
+{
+    size_t len = strlen(rel);
+    if (len == 0)
+        return; // target root isn't stored
+
+    // rebuild maps the file again
+    if ((m->header->used + 1) * 2 > m->header->cap || m->header->heap_len + len + 1 > m->header->heap_cap)
+        rebuild(m, len + 1);
+    ManifestHeader* h = m->header;
+
+    uint64_t key = path_hash(rel, len);
+    ManifestEntry* slot = NULL;
+    ManifestEntry* e = find_entry(m, rel, len, key, &slot);
+    if (e == NULL)
+    {
+        // new path goes to the end of heap
+        if (slot->key == 0)
+            h->used++;
+        h->count++;
+        e = slot;
+        e->key = key;
+        e->path = h->heap_len;
+        e->path_len = len;
+        memcpy(m->heap + h->heap_len, rel, len + 1);
+        h->heap_len += len + 1;
+        link_entry(m, e - m->entries);
+    }
+    // content didn't change, its hash is still valid
+    else if (fields->hash == 0 && e->size == fields->size && e->mtime_sec == fields->mtime_sec
+             && e->mtime_nsec == fields->mtime_nsec)
+    {
+        fields->hash = e->hash;
+    }
+
+    e->mode = fields->mode;
+    e->size = fields->size;
+    e->mtime_sec = fields->mtime_sec;
+    e->mtime_nsec = fields->mtime_nsec;
+    e->hash = fields->hash;
+}
+
+// add or change entry of path relative to target root
+void manifest_put(Manifest* m, const char* rel, struct statx* stx, uint64_t hash)
+{
+    if (m == NULL)
+        return;
+
+    ManifestEntry fields;
+    fields.mode = stx->stx_mode;
+    fields.size = stx->stx_size;
+    fields.mtime_sec = stx->stx_mtime.tv_sec;
+    fields.mtime_nsec = stx->stx_mtime.tv_nsec;
+    fields.hash = hash;
+    put_fields(m, rel, &fields);
+}
+
+// read entry of path from the target again, entry is removed when path is gone
+void manifest_refresh(Manifest* m, const char* rel, uint64_t hash)
+{
+    if (m == NULL)
+        return;
+
+    char* path = join_paths(m->root, (char*)rel);
+    struct statx stx;
+    if (stat_at(AT_FDCWD, path, STATX_TYPE | STATX_MODE | STATX_SIZE | STATX_MTIME, &stx) != 0)
+    {
+        if (errno != ENOENT && errno != ENOTDIR)
+        {
+            ERR("statx");
+            exit(EXIT_FAILURE);
+        }
+        free(path);
+        manifest_remove(m, rel, 1);
+        return;
+    }
+
+    free(path);
+    manifest_put(m, rel, &stx, hash);
+}
+
+// check if entry is path or is inside it
+static int inside_path(Manifest* m, ManifestEntry* e, const char* rel, size_t len)
+{
+    if (e->key == 0 || e->path_len == 0)
+        return 0;
+    if (len == 0)
+        return 1;
+
+    char* path = m->heap + e->path;
+    return e->path_len >= len && memcmp(path, rel, len) == 0 && (path[len] == '\0' || path[len] == '/');
+}
+
+// mark entry as deleted
+static void delete_entry(Manifest* m, ManifestEntry* e)
+{
+    unlink_entry(m, e - m->entries);
+    e->path_len = 0;
+    m->header->count--;
+}
+
+// append slot to growing array
+static void push_slot(uint32_t** slots, size_t* count, size_t* cap, uint32_t i)
+{
+    if (*count == *cap)
+    {
+        *cap *= 2;
+        *slots = realloc(*slots, sizeof(uint32_t) * *cap);
+        if (*slots == NULL)
+        {
+            ERR("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    (*slots)[(*count)++] = i;
+}
+
+// slots of entry of path and of all entries inside it, directories come before their files
+// subtree is walked by children of directories, only orphans are checked by path
+static uint32_t* subtree_slots(Manifest* m, const char* rel, size_t* count)
+{
+    size_t len = strlen(rel);
+    size_t cap = 16;
+    uint32_t* slots = malloc(sizeof(uint32_t) * cap);
+    if (slots == NULL)
+    {
+        ERR("malloc");
+        exit(EXIT_FAILURE);
+    }
+    *count = 0;
+
+    // every entry is inside target root
+    if (len == 0)
+    {
+        for (uint32_t i = 0; i < m->header->cap; i++)
+        {
+            if (inside_path(m, &m->entries[i], rel, len))
+                push_slot(&slots, count, &cap, i);
+        }
+        return slots;
+    }
+
+    // entry itself could be an orphan too
+    ManifestEntry* e = find_entry(m, rel, len, path_hash(rel, len), NULL);
+    uint32_t top = e != NULL ? (uint32_t)(e - m->entries) : NO_SLOT;
+    if (top != NO_SLOT)
+        push_slot(&slots, count, &cap, top);
+    for (uint32_t i = m->orphans; i != NO_SLOT; i = m->next[i])
+    {
+        if (i != top && inside_path(m, &m->entries[i], rel, len))
+            push_slot(&slots, count, &cap, i);
+    }
+
+    // children of every found entry are appended after it
+    for (size_t k = 0; k < *count; k++)
+    {
+        for (uint32_t i = m->first[slots[k]]; i != NO_SLOT; i = m->next[i])
+            push_slot(&slots, count, &cap, i);
+    }
+
+    return slots;
+}
+
+// remove entry of path, with subtree entries of all files inside it
+void manifest_remove(Manifest* m, const char* rel, int subtree)
+{
+    if (m == NULL)
+        return;
+
+    size_t len = strlen(rel);
+    if (!subtree)
+    {
+        ManifestEntry* e = find_entry(m, rel, len, path_hash(rel, len), NULL);
+        if (e != NULL)
+            delete_entry(m, e);
+        return;
+    }
+
+    size_t count;
+    uint32_t* slots = subtree_slots(m, rel, &count);
+    for (size_t i = 0; i < count; i++)
+        delete_entry(m, &m->entries[slots[i]]);
+    free(slots);
+}
+
+// change path of moved file or directory with all files inside it
+void manifest_rename(Manifest* m, const char* old_rel, const char* new_rel)
+{
+    if (m == NULL)
+        return;
+
+    // moved file has no subtree
+    size_t len = strlen(old_rel);
+    ManifestEntry* e = find_entry(m, old_rel, len, path_hash(old_rel, len), NULL);
+    if (e != NULL && !S_ISDIR(e->mode))
+    {
+        ManifestEntry fields = *e;
+        delete_entry(m, e);
+        manifest_remove(m, new_rel, 1);
+        put_fields(m, new_rel, &fields);
+        return;
+    }
+
+    // moved entries are taken out, their keys change
+    size_t count;
+    uint32_t* slots = subtree_slots(m, old_rel, &count);
+    ManifestEntry* moved = malloc(sizeof(ManifestEntry) * (count + 1));
+    char** paths = malloc(sizeof(char*) * (count + 1));
+    if (moved == NULL || paths == NULL)
+    {
+        ERR("malloc");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < count; i++)
+    {
+        e = &m->entries[slots[i]];
+        paths[i] = malloc(strlen(new_rel) + strlen(m->heap + e->path + len) + 1);
+        if (paths[i] == NULL)
+        {
+            ERR("malloc");
+            exit(EXIT_FAILURE);
+        }
+        strcpy(paths[i], new_rel);
+        strcat(paths[i], m->heap + e->path + len);
+        moved[i] = *e;
+        delete_entry(m, e);
+    }
+
+    // rename replaces files at new path, directories are put before their files
+    manifest_remove(m, new_rel, 1);
+    for (size_t i = 0; i < count; i++)
+    {
+        put_fields(m, paths[i], &moved[i]);
+        free(paths[i]);
+    }
+
+    free(slots);
+    free(moved);
+    free(paths);
+}
+
+// add entries of all files inside directory fd with path rel, fd is closed at the end
+static void add_tree_at(Manifest* m, int fd, const char* rel)
+{
+    DirIter* it = dir_iter_open(fd);
+    DirEntry entry;
+    struct statx stx;
+
+    while (dir_iter_next(it, &entry))
+    {
+        if (stat_at(fd, entry.name, STATX_TYPE | STATX_MODE | STATX_SIZE | STATX_MTIME, &stx) != 0)
+            continue;
+
+        char* path = *rel == '\0' ? strdup(entry.name) : join_paths((char*)rel, entry.name);
+        if (path == NULL)
+        {
+            ERR("strdup");
+            exit(EXIT_FAILURE);
+        }
+        manifest_put(m, path, &stx, 0);
+
+        if (S_ISDIR(stx.stx_mode))
+            add_tree_at(m, open_dir_at(fd, entry.name), path);
+        free(path);
+    }
+
+    // closes fd
+    dir_iter_close(it);
+}
+
+// add entries of path and all files inside it, used when a whole directory was copied
+void manifest_add_tree(Manifest* m, const char* rel)
+{
+    if (m == NULL)
+        return;
+
+    manifest_refresh(m, rel, 0);
+
+    char* path = join_paths(m->root, (char*)rel);
+    int fd = openat(AT_FDCWD, path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0 && errno != ENOENT && errno != ENOTDIR)
+    {
+        ERR("openat");
+        exit(EXIT_FAILURE);
+    }
+    free(path);
+    if (fd >= 0)
+        add_tree_at(m, fd, rel);
+}
+
+// check if source file described by stx differs from its entry, by size and mtime like needs_update()
+int manifest_needs_update(ManifestEntry* entry, struct statx* stx)
+{
+    return entry->size != (int64_t)stx->stx_size || entry->mtime_sec != stx->stx_mtime.tv_sec
+           || entry->mtime_nsec != stx->stx_mtime.tv_nsec;
+}
+
+// count regular files in manifest and their bytes
+void manifest_totals(Manifest* m, unsigned long long* files, unsigned long long* bytes)
+{
+    *files = 0;
+    *bytes = 0;
+    for (uint32_t i = 0; i < m->header->cap; i++)
+    {
+        ManifestEntry* entry = &m->entries[i];
+        if (entry->key != 0 && entry->path_len != 0 && S_ISREG(entry->mode))
+        {
+            (*files)++;
+            *bytes += entry->size;
+        }
+    }
+}
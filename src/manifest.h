@@ -0,0 +1,82 @@
+#ifndef MANIFEST_H
+#define MANIFEST_H
+
+#include "utils.h"
+
+#include <stdint.h>
+
+#define MANIFEST_MAGIC "SOPMAN01"
+#define MANIFEST_SUFFIX ".manifest"  // manifest of target dir is next to it, so it isn't backed up or restored
+#define MANIFEST_MIN_CAP 1024        // slots of empty manifest, power of 2
+#define MANIFEST_MIN_HEAP (64 * 1024)
+
+// file in the target, fixed size so the table can be used straight from the mapping
+typedef struct ManifestEntry
+{
+    uint64_t key;        // hash of path, 0 for empty slot
+    uint64_t path;       // offset of path in heap, path is relative to target root
+    uint32_t path_len;   // length of path without '\0', 0 for deleted entry
+    uint32_t mode;       // type and permissions
+    int64_t size;        // size in bytes
+    int64_t mtime_sec;   // modification time
+    int64_t mtime_nsec;  // nanoseconds of modification time
+    uint64_t hash;       // hash of content, 0 if it wasn't computed
+} ManifestEntry;
+
+typedef struct ManifestHeader
+{
+    char magic[8];      // MANIFEST_MAGIC
+    uint32_t clean;     // manifest matches the target, 0 while worker changes it
+    uint32_t cap;       // slots in table, power of 2
+    uint64_t count;     // entries in table
+    uint64_t used;      // entries and deleted entries in table
+    uint64_t heap_len;  // bytes of heap in use, paths of deleted entries too
+    uint64_t heap_cap;  // size of heap
+} ManifestHeader;
+
+// mapped manifest file: header, table of entries and heap of paths
+// writable manifest keeps children of every directory in memory, so moved and deleted subtrees aren't searched in whole table
+typedef struct Manifest
+{
+    char* root;              // target root
+    size_t root_len;         // length of root
+    int fd;                  // manifest file
+    int writable;            // opened by worker
+    size_t len;              // size of mapping
+    ManifestHeader* header;  // start of mapping
+    ManifestEntry* entries;  // table after header
+    char* heap;              // paths after table
+    uint32_t* first;         // first child of every slot, only for writable manifest
+    uint32_t* next;          // next sibling of every slot
+    uint32_t* prev;          // previous sibling of every slot
+    uint32_t* up;            // parent slot of every slot
+    uint32_t orphans;        // first entry whose directory isn't in manifest
+} Manifest;
+
+Manifest* manifest_open(char* target, int writable);
+
+Manifest* manifest_start(char* target);
+
+void manifest_close(Manifest* m);
+
+void manifest_clear(Manifest* m);
+
+const char* manifest_rel(Manifest* m, const char* path);
+
+ManifestEntry* manifest_get(Manifest* m, const char* rel);
+
+void manifest_put(Manifest* m, const char* rel, struct statx* stx, uint64_t hash);
+
+void manifest_refresh(Manifest* m, const char* rel, uint64_t hash);
+
+void manifest_remove(Manifest* m, const char* rel, int subtree);
+
+void manifest_rename(Manifest* m, const char* old_rel, const char* new_rel);
+
+void manifest_add_tree(Manifest* m, const char* rel);
+
+int manifest_needs_update(ManifestEntry* entry, struct statx* stx);
+
+void manifest_totals(Manifest* m, unsigned long long* files, unsigned long long* bytes);
+
+#endif
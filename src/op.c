@@ -0,0 +1,394 @@
+#include "op.h"
+
+#include "command_handler.h"
+#include "worker.h"
+
+// check if op reads the source
+// moves only rename the target, the source could be moved again already
+static int reads_source(OpType type)
+{
+    return type != OP_DELETE_DIR && type != OP_DELETE_FILE && type != OP_MOVE_DIR && type != OP_MOVE_FILE;
+}
+
+// path relative to source root, the same path is used in the target
+static const char* rel_path(const char* path, const char* src)
+{
+    const char* rel = path + strlen(src);
+    return *rel == '/' ? rel + 1 : rel;
+}
+
+// rename copy of moved directory or file, returns 0 or -1 when the copy isn't in the target
+static int move_copy(Op* op, char* file_path, char* src, char* target, Log* logs)
+{
+    char* from_path = src2target_path(op->from, src, target);
+    int ret = rename(from_path, file_path);
+    // rescan after lost events could copy the dir to its new path already
+    if (ret < 0 && (errno == ENOTEMPTY || errno == EEXIST))
+    {
+        rm_dir_recursive(file_path);
+        ret = rename(from_path, file_path);
+    }
+    if (ret < 0 && errno != ENOENT)
+    {
+        ERR("rename");
+        exit(EXIT_FAILURE);
+    }
+    if (ret == 0)
+        write_log(logs, src, target, "Renamed in target: ", from_path);
+
+    free(from_path);
+    return ret;
+}
+
+// copy moved file again when renamed copy is missing or was older than the source
+static void refresh_moved_file(char* path, char* file_path, char* src, char* target, Log* logs)
+{
+    struct stat stat_info, target_info;
+    if (lstat(path, &stat_info) != 0)
+        return; // moved again, next move renames the copy
+
+    int missing = lstat(file_path, &target_info) != 0;
+    if (S_ISLNK(stat_info.st_mode) && missing)
+        copy_symlink(path, file_path, src, target, logs);
+    else if (S_ISREG(stat_info.st_mode) && (missing || needs_update(path, file_path)))
+        copy_file(path, file_path, logs);
+}
+
+// copy directory from the source to file_path, when it still exists
+static void copy_new_dir(char* path, char* file_path, char* src, char* target, Log* logs)
+{
+    struct stat stat_info;
+    if (lstat(path, &stat_info) != 0 || !S_ISDIR(stat_info.st_mode))
+    {
+        write_log(logs, src, target, "Source vanished, skipping: ", path);
+        copy_stats->failed++;
+        return;
+    }
+
+    // old copy could be left by rescan after lost events
+    struct stat target_info;
+    if (lstat(file_path, &target_info) == 0 && S_ISDIR(target_info.st_mode))
+        rm_dir_recursive(file_path);
+    else if (unlink(file_path) < 0 && errno != ENOENT)
+    {
+        ERR("unlink");
+        exit(EXIT_FAILURE);
+    }
+
+    if (mkdir(file_path, 0777) < 0)
+    {
+        ERR("mkdir");
+        exit(EXIT_FAILURE);
+    }
+    copy_permissions(path, file_path);
+    copy_dir(path, file_path, src, target, logs);
+}
+
+// remove entry name of target dir fd, file_path is its full path
+static void remove_entry(int fd, char* name, char* file_path, int is_dir, DeltaCache* cache, Manifest* manifest)
+{
+    if (cache != NULL)
+        delta_forget(cache, file_path);
+    if (manifest != NULL)
+        manifest_remove(manifest, manifest_rel(manifest, file_path), is_dir);
+
+    if (is_dir)
+        rm_dir_at(fd, name);
+    else if (unlinkat(fd, name, 0) < 0 && errno != ENOENT)
+    {
+        ERR("unlinkat");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// type of entry name in target dir fd as d_type, DT_UNKNOWN if it's missing
+// manifest answers without stat of the target
+static int target_type(int fd, char* name, char* file_path, Manifest* manifest)
+{
+    if (manifest != NULL)
+    {
+        ManifestEntry* known = manifest_get(manifest, manifest_rel(manifest, file_path));
+        return known == NULL ? DT_UNKNOWN : IFTODT(known->mode);
+    }
+
+    struct statx target_stat;
+    if (stat_at(fd, name, STATX_TYPE, &target_stat) == 0)
+        return IFTODT(target_stat.stx_mode);
+    if (errno != ENOENT)
+    {
+        ERR("statx");
+        exit(EXIT_FAILURE);
+    }
+    return DT_UNKNOWN;
+}
+
+// check if copy name in target dir fd doesn't point where symlink path points now
+// link changed while events were lost isn't missing, but it's wrong
+static int link_changed(char* path, int fd, char* name, char* src, char* target)
+{
+    int inside = 0;
+    char* expected = symlink_copy_path(path, src, target, &inside);
+    // dangling link isn't copied, its old copy is removed
+    if (expected == NULL)
+        return 1;
+
+    char buf[PATH_MAX];
+    ssize_t len = readlinkat(fd, name, buf, sizeof(buf));
+    int changed = len < 0 || (size_t)len != strlen(expected) || memcmp(buf, expected, len) != 0;
+    free(expected);
+    return changed;
+}
+
+// compare entries of source dir path with target dir file_path, missing and changed files are copied,
+// removed files are deleted, subdirs that exist in both are left for their own sync
+static void sync_dir(char* path, char* file_path, char* src, char* target, DeltaCache* cache, Manifest* manifest,
+                     Log* logs)
+{
+    int src_fd = open_dir_at(AT_FDCWD, path);
+    int target_fd = open_dir_at(AT_FDCWD, file_path);
+    copy_permissions_fd(src_fd, target_fd);
+
+    // entries of the source
+    DirIter* it = dir_iter_open(open_dir_at(src_fd, "."));
+    DirEntry entry;
+    while (dir_iter_next(it, &entry))
+    {
+        char* name = entry.name;
+        char* entry_path = join_paths(path, name);
+        char* copy_path = join_paths(file_path, name);
+
+        // entry changed its type
+        int type = target_type(target_fd, name, copy_path, manifest);
+        if (type != DT_UNKNOWN && type != entry.type)
+        {
+            remove_entry(target_fd, name, copy_path, type == DT_DIR, cache, manifest);
+            type = DT_UNKNOWN;
+        }
+        int missing = type == DT_UNKNOWN;
+
+        if (entry.type == DT_DIR && missing)
+        {
+            write_log(logs, src, target, "Sync, copying dir: ", entry_path);
+            if (mkdirat(target_fd, name, 0777) != 0)
+            {
+                ERR("mkdir");
+                exit(EXIT_FAILURE);
+            }
+            int sub1 = open_dir_at(src_fd, name);
+            int sub2 = open_dir_at(target_fd, name);
+            copy_permissions_fd(sub1, sub2);
+            copy_dir_at(sub1, sub2, entry_path, src, target, logs);
+            if (close(sub2) < 0)
+            {
+                ERR("close");
+                exit(EXIT_FAILURE);
+            }
+            if (manifest != NULL)
+                manifest_add_tree(manifest, manifest_rel(manifest, copy_path));
+        }
+        else if (entry.type == DT_REG && (missing || needs_update_known(src_fd, name, target_fd, name, copy_path, manifest)))
+        {
+            write_log(logs, src, target, "Sync, copying file: ", entry_path);
+            if (cache != NULL)
+                delta_forget(cache, copy_path);
+            copy_file_at(src_fd, name, target_fd, name, logs);
+            if (manifest != NULL)
+                manifest_refresh(manifest, manifest_rel(manifest, copy_path), 0);
+        }
+        // target of symlink is rewritten, copy is compared with the path it should point to
+        else if (entry.type == DT_LNK && (missing || link_changed(entry_path, target_fd, name, src, target)))
+        {
+            write_log(logs, src, target, "Sync, copying link: ", entry_path);
+            if (!missing && unlinkat(target_fd, name, 0) < 0 && errno != ENOENT)
+            {
+                ERR("unlinkat");
+                exit(EXIT_FAILURE);
+            }
+            copy_symlink_at(entry_path, target_fd, name, src, target, logs);
+            if (manifest != NULL)
+                manifest_refresh(manifest, manifest_rel(manifest, copy_path), 0);
+        }
+        free(entry_path);
+        free(copy_path);
+    }
+    dir_iter_close(it);
+
+    // entries removed from the source, closes target_fd at the end
+    it = dir_iter_open(target_fd);
+    while (dir_iter_next(it, &entry))
+    {
+        struct stat stat_info;
+        if (fstatat(src_fd, entry.name, &stat_info, AT_SYMLINK_NOFOLLOW) == 0)
+            continue;
+        if (errno != ENOENT)
+        {
+            ERR("fstatat");
+            exit(EXIT_FAILURE);
+        }
+
+        char* old_path = join_paths(file_path, entry.name);
+        write_log(logs, src, target, "Sync, deleting: ", old_path);
+        remove_entry(target_fd, entry.name, old_path, entry.type == DT_DIR, cache, manifest);
+        free(old_path);
+    }
+    dir_iter_close(it);
+
+    if (close(src_fd) < 0)
+    {
+        ERR("close");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// apply op to the target directory
+void execute_op(Op* op, char* src, char* target, DeltaCache* cache, Manifest* manifest, Log* logs)
+{
+    // source could be removed after event was read
+    struct stat stat_info;
+    int found = reads_source(op->type) ? lstat(op->path, &stat_info) == 0 : 0;
+    if (reads_source(op->type) && !found && errno == ENOENT)
+    {
+        write_log(logs, src, target, "Source vanished, skipping: ", op->path);
+        copy_stats->failed++;
+        return;
+    }
+    // file was replaced by symlink after event was read
+    if (found && (op->type == OP_COPY_FILE || op->type == OP_UPDATE_FILE) && S_ISLNK(stat_info.st_mode))
+    {
+        Op link_op = {OP_DELETE_FILE, op->path, NULL, 0};
+        execute_op(&link_op, src, target, cache, manifest, logs);
+        link_op.type = OP_SYMLINK;
+        execute_op(&link_op, src, target, cache, manifest, logs);
+        return;
+    }
+
+    char* file_path = src2target_path(op->path, src, target);
+    // same relative path in the target and in manifest
+    const char* rel = manifest != NULL ? manifest_rel(manifest, file_path) : NULL;
+
+    switch (op->type)
+    {
+        case OP_COPY_DIR:
+            // make new dir in the backup directory with its files and subdirs
+            copy_new_dir(op->path, file_path, src, target, logs);
+            manifest_add_tree(manifest, rel);
+            break;
+        case OP_DELETE_DIR:
+            if (cache != NULL)
+                delta_forget(cache, file_path);
+            // copy could be never made, when dir was created and deleted before its event was read
+            if (lstat(file_path, &stat_info) == 0)
+                rm_dir_recursive(file_path);
+            manifest_remove(manifest, rel, 1);
+            break;
+        case OP_UPDATE_FILE:
+            // modified file - rewrite only changed blocks, their hashes give hash of content
+            if (cache != NULL)
+            {
+                off_t written = 0;
+                if (delta_update(cache, op->path, file_path, &written) == 0)
+                {
+                    LOG(logs, LOG_LEVEL_INFO, "Delta update wrote %lld bytes", (long long)written);
+                    manifest_refresh(manifest, rel, delta_content_hash(cache, file_path));
+                    break;
+                }
+                // source could be deleted or replaced by symlink since it was checked, op is checked again
+                if (lstat(op->path, &stat_info) != 0 || S_ISLNK(stat_info.st_mode))
+                {
+                    execute_op(op, src, target, cache, manifest, logs);
+                    break;
+                }
+            }
+            copy_file(op->path, file_path, logs);
+            manifest_refresh(manifest, rel, 0);
+            break;
+        case OP_COPY_FILE:
+            copy_file(op->path, file_path, logs);
+            manifest_refresh(manifest, rel, 0);
+            break;
+        case OP_SYMLINK:
+            // link could be copied already by rescan after lost events
+            if (unlink(file_path) < 0 && errno != ENOENT)
+            {
+                ERR("unlink");
+                exit(EXIT_FAILURE);
+            }
+            copy_symlink(op->path, file_path, src, target, logs);
+            manifest_refresh(manifest, rel, 0);
+            break;
+        case OP_DELETE_FILE:
+            if (cache != NULL)
+                delta_forget(cache, file_path);
+            // copy could be never made, when file was created and deleted in one window
+            if (unlink(file_path) < 0 && errno != ENOENT)
+            {
+                ERR("unlink");
+                exit(EXIT_FAILURE);
+            }
+            manifest_remove(manifest, rel, 0);
+            break;
+        case OP_ATTRIB:
+            copy_permissions(op->path, file_path);
+            manifest_refresh(manifest, rel, 0);
+            break;
+        case OP_MOVE_DIR:
+            // copy of old dir is missing - copy the dir again
+            if (move_copy(op, file_path, src, target, logs) < 0)
+            {
+                copy_new_dir(op->path, file_path, src, target, logs);
+                manifest_add_tree(manifest, rel);
+            }
+            else if (manifest != NULL)
+                manifest_rename(manifest, rel_path(op->from, src), rel);
+            break;
+        case OP_MOVE_FILE:
+            // file could be changed before the move and its changes were dropped
+            if (move_copy(op, file_path, src, target, logs) == 0 && manifest != NULL)
+                manifest_rename(manifest, rel_path(op->from, src), rel);
+            refresh_moved_file(op->path, file_path, src, target, logs);
+            manifest_refresh(manifest, rel, 0);
+            break;
+        case OP_SYNC_DIR:
+            // dir itself could be missing, then it's copied whole
+            if (lstat(file_path, &stat_info) == 0 && S_ISDIR(stat_info.st_mode))
+                sync_dir(op->path, file_path, src, target, cache, manifest, logs);
+            else
+            {
+                copy_new_dir(op->path, file_path, src, target, logs);
+                manifest_add_tree(manifest, rel);
+            }
+            break;
+    }
+
+    free(file_path);
+}
+
+// name of op for logs
+const char* op_name(OpType type)
+{
+    switch (type)
+    {
+        case OP_COPY_DIR:
+            return "copy dir";
+        case OP_DELETE_DIR:
+            return "delete dir";
+        case OP_COPY_FILE:
+            return "copy file";
+        case OP_UPDATE_FILE:
+            return "update file";
+        case OP_SYMLINK:
+            return "copy symlink";
+        case OP_DELETE_FILE:
+            return "delete file";
+        case OP_ATTRIB:
+            return "attrib";
+        case OP_MOVE_DIR:
+            return "move dir";
+        case OP_MOVE_FILE:
+            return "move file";
+        case OP_SYNC_DIR:
+            return "sync dir";
+    }
+
+    return "unknown";
+}
@@ -0,0 +1,35 @@
+#ifndef OP_H
+#define OP_H
+
+#include "delta.h"
+#include "log.h"
+#include "manifest.h"
+#include "utils.h"
+
+typedef enum OpType
+{
+    OP_COPY_DIR,     // create directory and copy its content
+    OP_DELETE_DIR,   // delete directory with its content
+    OP_COPY_FILE,    // copy whole regular file
+    OP_UPDATE_FILE,  // update modified regular file
+    OP_SYMLINK,      // copy symlink
+    OP_DELETE_FILE,  // delete file or symlink
+    OP_ATTRIB,       // copy permissions and times
+    OP_MOVE_DIR,     // rename directory moved inside the source
+    OP_MOVE_FILE,    // rename file or symlink moved inside the source
+    OP_SYNC_DIR,     // make entries of directory in the target the same as in the source
+} OpType;
+
+typedef struct Op
+{
+    OpType type;       // what to do in the target
+    char* path;        // path of changed file in the source
+    char* from;        // path before the move in the source, only for moves
+    long long queued;  // monotonic us when first event of op was read, 0 for ops without event
+} Op;
+
+void execute_op(Op* op, char* src, char* target, DeltaCache* cache, Manifest* manifest, Log* logs);
+
+const char* op_name(OpType type);
+
+#endif
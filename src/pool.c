@@ -0,0 +1,251 @@
+#include "pool.h"
+
+#include "copy.h"
+
+// index of deque owned by current thread
+static _Thread_local int self = 0;
+
+typedef struct PoolThread
+{
+    Pool* pool;       // pool of thread
+    int index;        // index of thread deque
+    CopyStats* copy;  // copy counters of thread that runs the pool
+} PoolThread;
+
+// create pool with given number of threads
+Pool* pool_init(int threads)
+{
+    if (threads < 1)
+        threads = 1;
+    if (threads > POOL_MAX_THREADS)
+        threads = POOL_MAX_THREADS;
+
+    Pool* pool = malloc(sizeof(Pool));
+    if (pool == NULL)
+    {
+        ERR("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    pool->threads = threads;
+    pool->deques = malloc(sizeof(Deque) * threads);
+    pool->ids = malloc(sizeof(pthread_t) * threads);
+    if (pool->deques == NULL || pool->ids == NULL)
+    {
+        ERR("malloc");
+        exit(EXIT_FAILURE);
+    }
+    atomic_init(&pool->pending, 0);
+    atomic_init(&pool->queued, 0);
+    atomic_init(&pool->idle, 0);
+    if (pthread_mutex_init(&pool->lock, NULL) != 0 || pthread_cond_init(&pool->wake, NULL) != 0)
+    {
+        ERR("pthread init");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int i = 0; i < threads; i++)
+    {
+        Deque* d = &pool->deques[i];
+        d->tasks = malloc(sizeof(Task) * POOL_DEQUE_CAP);
+        if (d->tasks == NULL)
+        {
+            ERR("malloc");
+            exit(EXIT_FAILURE);
+        }
+        d->cap = POOL_DEQUE_CAP;
+        d->top = 0;
+        d->size = 0;
+        if (pthread_mutex_init(&d->lock, NULL) != 0)
+        {
+            ERR("pthread_mutex_init");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    return pool;
+}
+
+// free pool, all tasks must be finished
+void free_pool(Pool* pool)
+{
+    if (pool == NULL)
+        return;
+
+    for (int i = 0; i < pool->threads; i++)
+    {
+        pthread_mutex_destroy(&pool->deques[i].lock);
+        free(pool->deques[i].tasks);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->wake);
+    free(pool->deques);
+    free(pool->ids);
+    free(pool);
+}
+
+// push task at the bottom of deque of current thread
+void pool_submit(Pool* pool, TaskFunc run, void* arg)
+{
+    Deque* d = &pool->deques[self];
+    atomic_fetch_add(&pool->pending, 1);
+
+    pthread_mutex_lock(&d->lock);
+    // grow buffer
+    if (d->size == d->cap)
+    {
+        Task* tasks = malloc(sizeof(Task) * d->cap * 2);
+        if (tasks == NULL)
+        {
+            ERR("malloc");
+            exit(EXIT_FAILURE);
+        }
+        for (int i = 0; i < d->size; i++)
+        {
+            tasks[i] = d->tasks[(d->top + i) % d->cap];
+        }
+        free(d->tasks);
+        d->tasks = tasks;
+        d->top = 0;
+        d->cap *= 2;
+    }
+    d->tasks[(d->top + d->size) % d->cap] = (Task){run, arg};
+    d->size++;
+    atomic_fetch_add(&pool->queued, 1);
+    pthread_mutex_unlock(&d->lock);
+
+    // idle thread counted itself before it checked for tasks, so it can't miss this one
+    if (atomic_load(&pool->idle) > 0)
+    {
+        pthread_mutex_lock(&pool->lock);
+        pthread_cond_signal(&pool->wake);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+// pop newest task of own deque, 0 if deque is empty
+static int pop_task(Pool* pool, Deque* d, Task* task)
+{
+    int found = 0;
+
+    pthread_mutex_lock(&d->lock);
+    if (d->size > 0)
+    {
+        d->size--;
+        *task = d->tasks[(d->top + d->size) % d->cap];
+        atomic_fetch_sub(&pool->queued, 1);
+        found = 1;
+    }
+    pthread_mutex_unlock(&d->lock);
+
+    return found;
+}
+
+// steal oldest task of other thread deque, 0 if deque is empty
+static int steal_task(Pool* pool, Deque* d, Task* task)
+{
+    int found = 0;
+
+    pthread_mutex_lock(&d->lock);
+    if (d->size > 0)
+    {
+        *task = d->tasks[d->top];
+        d->top = (d->top + 1) % d->cap;
+        d->size--;
+        atomic_fetch_sub(&pool->queued, 1);
+        found = 1;
+    }
+    pthread_mutex_unlock(&d->lock);
+
+    return found;
+}
+
+// wait until some deque has a task or all work is finished
+static void wait_for_task(Pool* pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    atomic_fetch_add(&pool->idle, 1);
+    while (atomic_load(&pool->queued) == 0 && atomic_load(&pool->pending) > 0)
+    {
+        pthread_cond_wait(&pool->wake, &pool->lock);
+    }
+    atomic_fetch_sub(&pool->idle, 1);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// run tasks until every submitted task is finished
+static void* pool_thread(void* arg)
+{
+    PoolThread* t = arg;
+    Pool* pool = t->pool;
+    self = t->index;
+    copy_stats = t->copy;
+
+    Task task;
+    while (atomic_load(&pool->pending) > 0)
+    {
+        int found = pop_task(pool, &pool->deques[self], &task);
+
+        // own deque is empty - try to steal from others
+        for (int i = 1; !found && i < pool->threads; i++)
+        {
+            found = steal_task(pool, &pool->deques[(self + i) % pool->threads], &task);
+        }
+
+        // running tasks can still submit more, thread sleeps until they do
+        if (!found)
+        {
+            wait_for_task(pool);
+            continue;
+        }
+
+        task.run(pool, task.arg);
+
+        // last task ended the work, every idle thread has to exit
+        if (atomic_fetch_sub(&pool->pending, 1) == 1)
+        {
+            pthread_mutex_lock(&pool->lock);
+            pthread_cond_broadcast(&pool->wake);
+            pthread_mutex_unlock(&pool->lock);
+        }
+    }
+
+    return NULL;
+}
+
+// run submitted tasks on all pool threads, returns when there is no more work
+void pool_run(Pool* pool)
+{
+    PoolThread* args = malloc(sizeof(PoolThread) * pool->threads);
+    if (args == NULL)
+    {
+        ERR("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int i = 1; i < pool->threads; i++)
+    {
+        args[i] = (PoolThread){pool, i, copy_stats};
+        if (pthread_create(&pool->ids[i], NULL, pool_thread, &args[i]) != 0)
+        {
+            ERR("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // calling thread works too
+    args[0] = (PoolThread){pool, 0, copy_stats};
+    pool_thread(&args[0]);
+
+    for (int i = 1; i < pool->threads; i++)
+    {
+        if (pthread_join(pool->ids[i], NULL) != 0)
+        {
+            ERR("pthread_join");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    self = 0;
+    free(args);
+}
@@ -0,0 +1,51 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include "utils.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+#define POOL_MAX_THREADS 64
+#define POOL_DEQUE_CAP 64  // initial capacity of every deque
+
+struct Pool;
+
+typedef void (*TaskFunc)(struct Pool* pool, void* arg);
+
+typedef struct Task
+{
+    TaskFunc run;  // function that executes task
+    void* arg;     // task argument, owned by task
+} Task;
+
+typedef struct Deque
+{
+    Task* tasks;           // circular buffer of tasks
+    int cap;               // capacity of buffer
+    int top;               // index of oldest task, thieves take from here
+    int size;              // number of tasks, owner pushes and pops at top + size
+    pthread_mutex_t lock;  // deque lock
+} Deque;
+
+typedef struct Pool
+{
+    int threads;              // number of threads
+    Deque* deques;            // one deque per thread
+    pthread_t* ids;           // thread ids, ids[0] is the caller of pool_run()
+    atomic_long pending;      // submitted tasks that didn't finish yet
+    atomic_long queued;       // tasks waiting in deques
+    atomic_int idle;          // threads waiting for tasks
+    pthread_mutex_t lock;     // lock of idle threads
+    pthread_cond_t wake;      // signals new task or the end of work
+} Pool;
+
+Pool* pool_init(int threads);
+
+void free_pool(Pool* pool);
+
+void pool_submit(Pool* pool, TaskFunc run, void* arg);
+
+void pool_run(Pool* pool);
+
+#endif
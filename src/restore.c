@@ -0,0 +1,346 @@
+#include "restore.h"
+
+#include "command_handler.h"
+
+#include <sys/mman.h>
+
+static void restore_dir_task(Pool* pool, void* arg);
+
+// compare entries by name
+static int entry_cmp(const void* a, const void* b) { return strcmp(((DirEntry*)a)->name, ((DirEntry*)b)->name); }
+
+// read all entries of dir fd sorted by name, fd stays open
+static void read_listing(int fd, Listing* list)
+{
+    list->size = 0;
+    list->cap = RESTORE_LISTING_CAP;
+    list->entries = malloc(sizeof(DirEntry) * list->cap);
+    if (list->entries == NULL)
+    {
+        ERR("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    DirIter* it = dir_iter_open(open_dir_at(fd, "."));
+    DirEntry entry;
+    while (dir_iter_next(it, &entry))
+    {
+        if (list->size == list->cap)
+        {
+            list->cap *= 2;
+            list->entries = realloc(list->entries, sizeof(DirEntry) * list->cap);
+            if (list->entries == NULL)
+            {
+                ERR("realloc");
+                exit(EXIT_FAILURE);
+            }
+        }
+        // name is valid only until next entry
+        entry.name = strdup(entry.name);
+        if (entry.name == NULL)
+        {
+            ERR("strdup");
+            exit(EXIT_FAILURE);
+        }
+        list->entries[list->size++] = entry;
+    }
+    dir_iter_close(it);
+
+    qsort(list->entries, list->size, sizeof(DirEntry), entry_cmp);
+}
+
+static void free_listing(Listing* list)
+{
+    for (int i = 0; i < list->size; i++)
+    {
+        free(list->entries[i].name);
+    }
+    free(list->entries);
+}
+
+// create new task, it owns src and target
+static RestoreTask* restore_task(char* src, char* target, RestoreJob* job)
+{
+    RestoreTask* task = malloc(sizeof(RestoreTask));
+    if (task == NULL)
+    {
+        ERR("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    task->src = src;
+    task->target = target;
+    task->size = 0;
+    task->job = job;
+
+    return task;
+}
+
+static void free_task(RestoreTask* task)
+{
+    free(task->src);
+    free(task->target);
+    free(task);
+}
+
+// restore was cancelled, tasks that didn't start are dropped
+static int cancelled() { return last_signal == SIGTERM; }
+
+// file of backup is done, it was copied or it didn't change
+static void file_done(RestoreProgress* p, unsigned long long size)
+{
+    atomic_fetch_add(&p->files, 1);
+    atomic_fetch_add(&p->bytes, size);
+}
+
+// copy regular file from backup task
+static void restore_file_task(Pool* pool, void* arg)
+{
+    RestoreTask* task = arg;
+
+    if (!cancelled())
+    {
+        copy_file(task->target, task->src, task->job->logs);
+        file_done(task->job->progress, task->size);
+    }
+
+    free_task(task);
+}
+
+// check if file name in src dir differs from its backup by size or mtime, like needs_update_known()
+// size of backup file is stored in size, backup is described by manifest when it has its entry
+static int needs_restore(int src_fd, int target_fd, char* name, char* file_target, int missing, RestoreJob* job,
+                         unsigned long long* size)
+{
+    unsigned int mask = STATX_SIZE | STATX_MTIME;
+    struct statx src_stat, target_stat;
+
+    ManifestEntry* known = NULL;
+    if (job->manifest != NULL)
+        known = manifest_get(job->manifest, manifest_rel(job->manifest, file_target));
+    if (known != NULL)
+        *size = known->size;
+    else if (stat_at(target_fd, name, mask, &target_stat) == 0)
+        *size = target_stat.stx_size;
+    else
+        return 0; // error in statx, omit copying
+
+    if (missing || stat_at(src_fd, name, mask, &src_stat) == -1)
+        return 1; // doesn't exist or statx error, so copy it from target
+
+    if (known != NULL)
+        return manifest_needs_update(known, &src_stat);
+    return src_stat.stx_size != target_stat.stx_size || src_stat.stx_mtime.tv_sec != target_stat.stx_mtime.tv_sec
+           || src_stat.stx_mtime.tv_nsec != target_stat.stx_mtime.tv_nsec;
+}
+
+// delete entry of src dir that isn't in backup
+static void delete_entry(int src_fd, DirEntry* entry, RestoreTask* task)
+{
+    char* file_src = join_paths(task->src, entry->name);
+    if (entry->type == DT_DIR)
+    {
+        rm_dir_at(src_fd, entry->name);
+        write_log(task->job->logs, task->src, task->target, "Delete directory ", file_src);
+    }
+    else
+    {
+        if (unlinkat(src_fd, entry->name, 0) < 0)
+        {
+            ERR("unlinkat");
+            exit(EXIT_FAILURE);
+        }
+        write_log(task->job->logs, task->src, task->target, "Delete file ", file_src);
+    }
+    free(file_src);
+}
+
+// bring entry of backup to src dir, missing if src has no entry of that name
+// dirs and files become new tasks
+static void restore_entry(Pool* pool, int src_fd, int target_fd, DirEntry* entry, int missing, RestoreTask* task)
+{
+    RestoreJob* job = task->job;
+    char* name = entry->name;
+    char* file_src = join_paths(task->src, name);
+    char* file_target = join_paths(task->target, name);
+
+    if (entry->type == DT_DIR)
+    {
+        if (missing && mkdirat(src_fd, name, 0777) < 0 && errno != EEXIST)
+        {
+            ERR("mkdir");
+            exit(EXIT_FAILURE);
+        }
+        write_log(job->logs, task->src, task->target, "Restore directory ", file_src);
+        pool_submit(pool, restore_dir_task, restore_task(file_src, file_target, job));
+        return;
+    }
+
+    // size and mtime of existing entry decide, backup is described by manifest when it has one
+    unsigned long long size = 0;
+    if (entry->type == DT_REG && needs_restore(src_fd, target_fd, name, file_target, missing, job, &size))
+    {
+        write_log(job->logs, task->src, task->target, "Restore file ", file_src);
+        RestoreTask* file_task = restore_task(file_src, file_target, job);
+        file_task->size = size;
+        pool_submit(pool, restore_file_task, file_task);
+        return;
+    }
+    if (entry->type == DT_REG)
+        file_done(job->progress, size);
+    // copy symlink, realpath needs full path
+    if (entry->type == DT_LNK
+        && (missing || needs_update_known(src_fd, name, target_fd, name, file_target, job->manifest) == 1))
+    {
+        if (!missing && unlinkat(src_fd, name, 0) < 0 && errno != ENOENT)
+        {
+            ERR("unlinkat");
+            exit(EXIT_FAILURE);
+        }
+        copy_symlink_at(file_target, src_fd, name, job->target_root, job->src_root, job->logs);
+        write_log(job->logs, task->src, task->target, "Restore symlink ", file_src);
+    }
+
+    free(file_src);
+    free(file_target);
+}
+
+// restore dir task, listings of src dir and its backup are read once and merge-joined by name
+static void restore_dir_task(Pool* pool, void* arg)
+{
+    RestoreTask* task = arg;
+    if (cancelled())
+    {
+        free_task(task);
+        return;
+    }
+
+    int src_fd = open_dir_at(AT_FDCWD, task->src);
+    int target_fd = open_dir_at(AT_FDCWD, task->target);
+    copy_permissions_fd(target_fd, src_fd); // set correct permissions
+
+    Listing src_list, target_list;
+    read_listing(src_fd, &src_list);
+    read_listing(target_fd, &target_list);
+
+    int i = 0, j = 0;
+    while ((i < src_list.size || j < target_list.size) && !cancelled())
+    {
+        DirEntry* s = i < src_list.size ? &src_list.entries[i] : NULL;
+        DirEntry* t = j < target_list.size ? &target_list.entries[j] : NULL;
+        int cmp = s == NULL ? 1 : t == NULL ? -1 : strcmp(s->name, t->name);
+
+        // only in src - deleted since backup
+        if (cmp < 0)
+        {
+            delete_entry(src_fd, s, task);
+            i++;
+        }
+        // only in backup - missing in src
+        else if (cmp > 0)
+        {
+            restore_entry(pool, src_fd, target_fd, t, 1, task);
+            j++;
+        }
+        // in both, entry that changed its type is replaced
+        else
+        {
+            int missing = s->type != t->type;
+            if (missing)
+                delete_entry(src_fd, s, task);
+            restore_entry(pool, src_fd, target_fd, t, missing, task);
+            i++;
+            j++;
+        }
+    }
+
+    free_listing(&src_list);
+    free_listing(&target_list);
+    if (close(src_fd) < 0 || close(target_fd) < 0)
+    {
+        ERR("close");
+        exit(EXIT_FAILURE);
+    }
+    free_task(task);
+}
+
+// shared progress of restore of src from target, both are real paths
+RestoreProgress* progress_init(char* src, char* target)
+{
+    RestoreProgress* p = mmap(NULL, sizeof(RestoreProgress), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+    {
+        ERR("mmap");
+        exit(EXIT_FAILURE);
+    }
+
+    snprintf(p->src, sizeof(p->src), "%s", src);
+    snprintf(p->target, sizeof(p->target), "%s", target);
+    atomic_init(&p->state, RESTORE_SCANNING);
+    atomic_init(&p->total_files, 0);
+    atomic_init(&p->total_bytes, 0);
+    atomic_init(&p->files, 0);
+    atomic_init(&p->bytes, 0);
+
+    return p;
+}
+
+void free_progress(RestoreProgress* p)
+{
+    if (p != NULL && munmap(p, sizeof(RestoreProgress)) != 0)
+    {
+        ERR("munmap");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// count regular files of backup dir fd and their bytes, fd is closed at the end
+static void scan_dir(int fd, unsigned long long* files, unsigned long long* bytes)
+{
+    DirIter* it = dir_iter_open(fd);
+    DirEntry entry;
+    struct statx stx;
+    while (dir_iter_next(it, &entry) && !cancelled())
+    {
+        if (entry.type == DT_DIR)
+            scan_dir(open_dir_at(it->fd, entry.name), files, bytes);
+        else if (entry.type == DT_REG && stat_at(it->fd, entry.name, STATX_SIZE, &stx) == 0)
+        {
+            (*files)++;
+            *bytes += stx.stx_size;
+        }
+    }
+    dir_iter_close(it);
+}
+
+// quick count of the backup, clean manifest knows it without walking the backup
+void restore_scan(RestoreProgress* p, Manifest* manifest)
+{
+    unsigned long long files = 0, bytes = 0;
+    if (manifest != NULL)
+        manifest_totals(manifest, &files, &bytes);
+    else
+        scan_dir(open_dir_at(AT_FDCWD, p->target), &files, &bytes);
+
+    atomic_store(&p->total_files, files);
+    atomic_store(&p->total_bytes, bytes);
+}
+
+// make source of p the same as its backup with given number of threads
+// every dir is read once, independent subtrees are restored in parallel
+void restore_tree(RestoreProgress* p, Manifest* manifest, int threads, Log* logs)
+{
+    RestoreJob job = {p->src, p->target, manifest, p, logs};
+    char* root_src = strdup(p->src);
+    char* root_target = strdup(p->target);
+    if (root_src == NULL || root_target == NULL)
+    {
+        ERR("strdup");
+        exit(EXIT_FAILURE);
+    }
+
+    Pool* pool = pool_init(threads);
+    pool_submit(pool, restore_dir_task, restore_task(root_src, root_target, &job));
+    pool_run(pool);
+    free_pool(pool);
+}
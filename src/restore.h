@@ -0,0 +1,69 @@
+#ifndef RESTORE_H
+#define RESTORE_H
+
+#include "dir_iter.h"
+#include "manifest.h"
+#include "utils.h"
+#include "worker.h"
+
+#include <limits.h>
+#include <stdatomic.h>
+
+#define RESTORE_LISTING_CAP 64  // initial capacity of dir listing
+
+typedef enum RestoreState
+{
+    RESTORE_SCANNING,   // backup is counted
+    RESTORE_RUNNING,    // files are restored
+    RESTORE_DONE,       // source matches backup
+    RESTORE_CANCELLED,  // stopped by cancel command
+} RestoreState;
+
+// progress of background restore, shared by restorer and main process
+typedef struct RestoreProgress
+{
+    char src[PATH_MAX];         // real path of restored source
+    char target[PATH_MAX];      // real path of backup
+    atomic_int state;           // RestoreState
+    atomic_ullong total_files;  // regular files in backup, known after scan
+    atomic_ullong total_bytes;  // bytes of regular files in backup
+    atomic_ullong files;        // files checked or copied
+    atomic_ullong bytes;        // bytes of files checked or copied
+} RestoreProgress;
+
+// entries of one dir sorted by name
+typedef struct Listing
+{
+    DirEntry* entries;  // entries with own copies of names
+    int size;           // number of entries
+    int cap;            // capacity of entries
+} Listing;
+
+// state shared by all tasks of one restore
+typedef struct RestoreJob
+{
+    char* src_root;             // source that is restored
+    char* target_root;          // backup it's restored from
+    Manifest* manifest;         // entries of backup, NULL if it isn't clean
+    RestoreProgress* progress;  // progress seen by main process
+    Log* logs;                  // logs file
+} RestoreJob;
+
+// restore task of dir or file src from target
+typedef struct RestoreTask
+{
+    char* src;                // path in source
+    char* target;             // path in backup
+    unsigned long long size;  // size of backup file
+    RestoreJob* job;          // restore that task belongs to
+} RestoreTask;
+
+RestoreProgress* progress_init(char* src, char* target);
+
+void free_progress(RestoreProgress* p);
+
+void restore_scan(RestoreProgress* p, Manifest* manifest);
+
+void restore_tree(RestoreProgress* p, Manifest* manifest, int threads, Log* logs);
+
+#endif
@@ -0,0 +1,168 @@
+#include "resync.h"
+
+#include <limits.h>
+
+// counts of one rescan
+typedef struct RescanStats
+{
+    unsigned long dirs;    // dirs walked
+    unsigned long synced;  // dirs compared with the target
+    unsigned long files;   // files updated outside of compared dirs
+} RescanStats;
+
+// ctime in ns, it changes with every change of the file and can't be set by user
+static long long ctime_ns(struct statx* stx) { return (long long)stx->stx_ctime.tv_sec * 1000000000 + stx->stx_ctime.tv_nsec; }
+
+// walk dir fd with given path, dirs and files changed since checkpoint are synced with the target
+// every dir gets a watch, fd is closed at the end
+static void rescan_dir(Worker* wk, int fd, char* path, long long checkpoint, RescanStats* stats)
+{
+    struct statx stx;
+    if (statx(fd, "", AT_EMPTY_PATH, STATX_CTIME, &stx) != 0)
+    {
+        ERR("statx");
+        exit(EXIT_FAILURE);
+    }
+
+    // new dirs weren't watched, keeper adds shared watches
+    if (wk->watch_role != WATCH_SHARED)
+    {
+        char* watch_path = strdup(path);
+        if (watch_path == NULL)
+        {
+            ERR("strdup");
+            exit(EXIT_FAILURE);
+        }
+        add_watch(wk->watchers, watch_path);
+    }
+    stats->dirs++;
+
+    // entries of dir changed - created, deleted and moved files are found by comparing it with the target
+    int changed = ctime_ns(&stx) >= checkpoint;
+    if (changed)
+    {
+        run_op(wk, OP_SYNC_DIR, path);
+        stats->synced++;
+    }
+
+    DirIter* it = dir_iter_open(fd);
+    DirEntry entry;
+    while (dir_iter_next(it, &entry))
+    {
+        char* name = entry.name;
+
+        // dir could be removed while it's walked
+        if (entry.type == DT_DIR)
+        {
+            int sub = openat(fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            if (sub < 0 && errno != ENOENT && errno != ENOTDIR)
+            {
+                ERR("openat");
+                exit(EXIT_FAILURE);
+            }
+            if (sub >= 0)
+            {
+                char* sub_path = join_paths(path, name);
+                rescan_dir(wk, sub, sub_path, checkpoint, stats);
+                free(sub_path);
+            }
+        }
+        // file written in place doesn't change its dir
+        else if (entry.type == DT_REG && !changed && stat_at(fd, name, STATX_CTIME, &stx) == 0
+                 && ctime_ns(&stx) >= checkpoint)
+        {
+            char* file_path = join_paths(path, name);
+            run_op(wk, OP_UPDATE_FILE, file_path);
+            free(file_path);
+            stats->files++;
+        }
+    }
+
+    // closes fd
+    dir_iter_close(it);
+}
+
+// walk the whole source from its root
+static void rescan_source(Worker* wk, long long checkpoint, RescanStats* stats)
+{
+    int fd = openat(AT_FDCWD, wk->src, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd >= 0)
+        rescan_dir(wk, fd, wk->src, checkpoint, stats);
+    else if (errno != ENOENT)
+    {
+        ERR("openat");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// events were lost - bring the target back in sync with the source
+// only dirs and files changed since the last checkpoint are compared with the target
+void resync_source(Worker* wk)
+{
+    long long start = monotonic_ms();
+    long long now = realtime_ns();
+    wk->rescan = 0;
+    wk->overflows++;
+
+    // changes that came before overflow go to the target first
+    finish_move(wk, LLONG_MAX);
+    run_pending_ops(wk, LLONG_MAX);
+
+    // IN_IGNORED events of removed dirs could be lost too
+    if (wk->watch_role != WATCH_SHARED)
+        prune_watches(wk->watchers);
+
+    // clock went back, timestamps can't be trusted - whole tree is compared
+    long long checkpoint = wk->checkpoint - RESYNC_SLACK_NS;
+    if (now < wk->checkpoint)
+        checkpoint = LLONG_MIN;
+
+    RescanStats stats = {0, 0, 0};
+    rescan_source(wk, checkpoint, &stats);
+
+    // changes made during the rescan have events or are found by the next rescan
+    wk->checkpoint = now;
+
+    long long took = monotonic_ms() - start;
+    wk->resync_ms += took;
+    LOG(wk->logs, LOG_LEVEL_WARN, "Event queue overflow %lu, rescanned %lu dirs, synced %lu dirs and %lu files in %lld ms",
+        wk->overflows, stats.dirs, stats.synced, stats.files, took);
+}
+
+// read that started at before drained the event queue without overflow, it got events of all older changes
+// their ops ran or wait in the worker, so the next rescan compares only what changed after the read
+void advance_checkpoint(Worker* wk, long long before, ssize_t len)
+{
+    if (wk->rescan || (size_t)len + sizeof(struct inotify_event) + NAME_MAX + 1 > EVENT_BUF_LEN)
+        return;
+
+    wk->checkpoint = before;
+}
+
+// worker joined shared watches after its setup, changes made since its checkpoint had no events for it
+void catch_up_source(Worker* wk)
+{
+    long long start = monotonic_ms();
+    long long now = realtime_ns();
+
+    RescanStats stats = {0, 0, 0};
+    rescan_source(wk, wk->checkpoint - RESYNC_SLACK_NS, &stats);
+    wk->checkpoint = now;
+
+    LOG(wk->logs, LOG_LEVEL_INFO, "Caught up with changes made during setup, synced %lu dirs and %lu files in %lld ms",
+        stats.synced, stats.files, monotonic_ms() - start);
+}
+
+// target has a backup from earlier worker - every dir is compared with the target instead of the initial copy
+void resume_source(Worker* wk)
+{
+    long long start = monotonic_ms();
+    long long now = realtime_ns();
+
+    RescanStats stats = {0, 0, 0};
+    rescan_source(wk, LLONG_MIN, &stats);
+    wk->checkpoint = now;
+
+    LOG(wk->logs, LOG_LEVEL_INFO, "Resumed backup, compared %lu dirs with the target in %lld ms", stats.synced,
+        monotonic_ms() - start);
+}
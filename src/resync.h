@@ -0,0 +1,17 @@
+#ifndef RESYNC_H
+#define RESYNC_H
+
+#include "utils.h"
+#include "worker.h"
+
+#define RESYNC_SLACK_NS 1000000000LL  // file timestamps can lag behind the clock, changes this old are checked too
+
+void resync_source(Worker* wk);
+
+void catch_up_source(Worker* wk);
+
+void resume_source(Worker* wk);
+
+void advance_checkpoint(Worker* wk, long long before, ssize_t len);
+
+#endif
@@ -2,6 +2,9 @@
 
 volatile sig_atomic_t last_signal = 0;
 
+// bit mask of fan-out targets ended by the user, worker takes it with atomic_exchange()
+atomic_int ended_targets = 0;
+
 // setting handler with sigaction
 void set_handler(void (*f)(int), int sigNo)
 {
@@ -18,6 +21,18 @@ void set_handler(void (*f)(int), int sigNo)
         ERR_KILL("sigaction");
 }
 
+// setting handler that gets signal info with sigaction, interrupted calls are restarted
+void set_info_handler(void (*f)(int, siginfo_t*, void*), int sigNo)
+{
+    struct sigaction act;
+    memset(&act, 0, sizeof(struct sigaction));
+    act.sa_sigaction = f;
+    act.sa_flags = SA_SIGINFO | SA_RESTART;
+
+    if (sigaction(sigNo, &act, NULL) == -1)
+        ERR_KILL("sigaction");
+}
+
 // ignore all signals
 void set_ign()
 {
@@ -34,3 +49,10 @@ void set_ign()
 
 // signal handler for parent and children processes
 void sig_handler(int sig) { last_signal = sig; }
+
+// signal handler that only interrupts blocking calls, last_signal isn't changed
+void wake_handler(int sig) {}
+
+// signal handler for fan-out worker, value of signal is index of ended target
+// last_signal isn't changed, SIGTERM that waits in it mustn't be lost
+void target_end_handler(int sig, siginfo_t* info, void* context) { atomic_fetch_or(&ended_targets, 1 << info->si_value.sival_int); }
@@ -3,12 +3,28 @@
 
 #include "utils.h"
 
+#include <stdatomic.h>
+
+// signal of main that ends one target of fan-out worker, real-time signals are queued so ends aren't merged
+#define TARGET_END_SIGNAL SIGRTMIN
+
+// signal of engine that wakes main from reading a command, failed pairs wait in the pipe of reports
+#define PAIR_FAILED_SIGNAL SIGUSR1
+
 extern volatile sig_atomic_t last_signal;
 
+extern atomic_int ended_targets;
+
 void set_ign();
 
 void set_handler(void (*f)(int), int sigNo);
 
+void set_info_handler(void (*f)(int, siginfo_t*, void*), int sigNo);
+
 void sig_handler(int sig);
 
+void target_end_handler(int sig, siginfo_t* info, void* context);
+
+void wake_handler(int sig);
+
 #endif
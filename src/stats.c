@@ -0,0 +1,143 @@
+#include "stats.h"
+
+#include <sys/mman.h>
+
+static const char* class_names[] = {"copy", "mkdir", "delete", "attrib", "move"};
+
+// shared table of worker statistics, workers inherit it with fork
+StatsTable* stats_init()
+{
+    StatsTable* table = mmap(NULL, sizeof(StatsTable), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (table == MAP_FAILED)
+    {
+        ERR("mmap");
+        exit(EXIT_FAILURE);
+    }
+
+    // anonymous mapping is zeroed, every slot is free
+    return table;
+}
+
+void free_stats(StatsTable* table)
+{
+    if (munmap(table, sizeof(StatsTable)) != 0)
+    {
+        ERR("munmap");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// free slot with zeroed counters for worker that is started, NULL if every slot is taken
+WorkerStats* stats_claim(StatsTable* table)
+{
+    for (int i = 0; i < STATS_SLOTS; i++)
+    {
+        WorkerStats* slot = &table->slots[i];
+        int free_pid = 0;
+        if (!atomic_compare_exchange_strong(&slot->pid, &free_pid, STATS_STARTING))
+            continue;
+
+        slot->started = monotonic_ms();
+        atomic_store(&slot->copy.files, 0);
+        atomic_store(&slot->copy.bytes, 0);
+        atomic_store(&slot->copy.holes, 0);
+        atomic_store(&slot->copy.failed, 0);
+        atomic_store(&slot->events, 0);
+        atomic_store(&slot->ops, 0);
+        atomic_store(&slot->queue, 0);
+        atomic_store(&slot->watches, 0);
+        memset(slot->latency, 0, sizeof(slot->latency));
+        return slot;
+    }
+
+    return NULL;
+}
+
+// give claimed slot to worker pid, both worker and main process do it after fork
+void stats_own(WorkerStats* slot, pid_t pid)
+{
+    int starting = STATS_STARTING;
+    if (slot != NULL)
+        atomic_compare_exchange_strong(&slot->pid, &starting, pid);
+}
+
+// free slot of worker pid, slot that was already given to other worker is kept
+void stats_release(WorkerStats* slot, pid_t pid)
+{
+    if (slot != NULL)
+        atomic_compare_exchange_strong(&slot->pid, &pid, 0);
+}
+
+// histogram of op type, -1 for ops that don't come from events
+static int latency_class(OpType type)
+{
+    switch (type)
+    {
+        case OP_COPY_FILE:
+        case OP_UPDATE_FILE:
+        case OP_SYMLINK:
+            return LATENCY_COPY;
+        case OP_COPY_DIR:
+            return LATENCY_MKDIR;
+        case OP_DELETE_FILE:
+        case OP_DELETE_DIR:
+            return LATENCY_DELETE;
+        case OP_ATTRIB:
+            return LATENCY_ATTRIB;
+        case OP_MOVE_DIR:
+        case OP_MOVE_FILE:
+            return LATENCY_MOVE;
+        default:
+            return -1;
+    }
+}
+
+// op was applied to the target, its latency is recorded from the read of its first event
+void stats_record(WorkerStats* slot, Op* op)
+{
+    int class = latency_class(op->type);
+    if (slot == NULL || op->queued == 0 || class < 0)
+        return;
+
+    long long us = monotonic_us() - op->queued;
+    latency_record(&slot->latency[class], us > 0 ? us : 0);
+}
+
+// print counters of worker, they're read without stopping it
+void print_stats(WorkerStats* slot, FILE* out)
+{
+    long long secs = (monotonic_ms() - slot->started) / 1000;
+    unsigned long long events = atomic_load_explicit(&slot->events, memory_order_relaxed);
+    unsigned long long ops = atomic_load_explicit(&slot->ops, memory_order_relaxed);
+
+    fprintf(out, "      up %lld s, %d watched dirs, %d ops waiting\n", secs,
+            atomic_load_explicit(&slot->watches, memory_order_relaxed),
+            atomic_load_explicit(&slot->queue, memory_order_relaxed));
+    fprintf(out, "      %llu events received, %llu ops applied (%.1f events/s)\n", events, ops,
+            secs > 0 ? (double)events / secs : (double)events);
+    fprintf(out, "      %llu files, %llu bytes copied, %llu bytes of holes skipped, %llu copies failed\n",
+            atomic_load_explicit(&slot->copy.files, memory_order_relaxed),
+            atomic_load_explicit(&slot->copy.bytes, memory_order_relaxed),
+            atomic_load_explicit(&slot->copy.holes, memory_order_relaxed),
+            atomic_load_explicit(&slot->copy.failed, memory_order_relaxed));
+}
+
+// print latency percentiles of every kind of op
+void print_latencies(WorkerStats* slot, FILE* out)
+{
+    for (int i = 0; i < LATENCY_CLASSES; i++)
+    {
+        print_latency(&slot->latency[i], class_names[i], out);
+    }
+}
+
+// write latency histograms of worker, lines start with its pid
+void dump_latencies(WorkerStats* slot, FILE* out)
+{
+    char name[64];
+    for (int i = 0; i < LATENCY_CLASSES; i++)
+    {
+        snprintf(name, sizeof(name), "%d %s", atomic_load(&slot->pid), class_names[i]);
+        dump_latency(&slot->latency[i], name, out);
+    }
+}
@@ -0,0 +1,62 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include "copy.h"
+#include "latency.h"
+#include "op.h"
+#include "utils.h"
+
+#include <stdatomic.h>
+
+#define STATS_SLOTS 64     // workers with live statistics at once
+#define STATS_STARTING -1  // pid of claimed slot before its worker is known
+
+// kinds of ops with own latency histogram
+typedef enum LatencyClass
+{
+    LATENCY_COPY,    // copied or updated files and symlinks
+    LATENCY_MKDIR,   // created directories copied with their content
+    LATENCY_DELETE,  // deleted files and directories
+    LATENCY_ATTRIB,  // copied permissions and times
+    LATENCY_MOVE,    // renamed files and directories
+    LATENCY_CLASSES,
+} LatencyClass;
+
+// live counters of one worker, only the worker writes them, main process reads them
+typedef struct WorkerStats
+{
+    atomic_int pid;                        // worker that owns slot, 0 for free slot
+    long long started;                     // monotonic ms when worker was started
+    CopyStats copy;                        // files and bytes copied by worker and its threads
+    atomic_ullong events;                  // events received
+    atomic_ullong ops;                     // ops applied to targets or queued for fan-out targets
+    atomic_int queue;                      // file ops waiting for the end of their debounce window
+    atomic_int watches;                    // watched dirs of source
+    LatencyHist latency[LATENCY_CLASSES];  // time from read of event to its op applied in target
+} WorkerStats;
+
+// statistics of all workers, shared memory made by main process before workers are forked
+typedef struct StatsTable
+{
+    WorkerStats slots[STATS_SLOTS];
+} StatsTable;
+
+StatsTable* stats_init();
+
+void free_stats(StatsTable* table);
+
+WorkerStats* stats_claim(StatsTable* table);
+
+void stats_own(WorkerStats* slot, pid_t pid);
+
+void stats_release(WorkerStats* slot, pid_t pid);
+
+void stats_record(WorkerStats* slot, Op* op);
+
+void print_stats(WorkerStats* slot, FILE* out);
+
+void print_latencies(WorkerStats* slot, FILE* out);
+
+void dump_latencies(WorkerStats* slot, FILE* out);
+
+#endif
@@ -0,0 +1,160 @@
+#include "trace.h"
+
+#include <sys/mman.h>
+
+// write whole header and data in one call
+static void write_header(int fd, void* header, size_t header_len, const void* data, size_t len)
+{
+    struct iovec iov[2] = {{header, header_len}, {(void*)data, len}};
+    if (writev_all(fd, iov, 2) < 0)
+    {
+        ERR("writev");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static Trace* new_trace(int fd, const char* src, size_t src_len)
+{
+    Trace* t = malloc(sizeof(Trace));
+    if (t == NULL)
+    {
+        ERR("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    t->fd = fd;
+    t->start = monotonic_us();
+    t->map = NULL;
+    t->len = 0;
+    t->pos = 0;
+    t->src = strndup(src, src_len);
+    if (t->src == NULL)
+    {
+        ERR("strndup");
+        exit(EXIT_FAILURE);
+    }
+    return t;
+}
+
+// create trace file of worker watching src, existing file is replaced
+Trace* trace_open(const char* path, const char* src)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        ERR("open");
+        exit(EXIT_FAILURE);
+    }
+
+    TraceHeader header;
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.src_len = strlen(src);
+    header.unused = 0;
+    write_header(fd, &header, sizeof(header), src, header.src_len);
+
+    return new_trace(fd, src, header.src_len);
+}
+
+static void write_record(Trace* t, TraceType type, int wd, const void* data, size_t len, long long now)
+{
+    TraceRecord record = {type, len, wd, 0, now - t->start};
+    write_header(t->fd, &record, sizeof(record), data, len);
+}
+
+// record buffer of events read at now, in monotonic us
+void trace_events(Trace* t, const char* buffer, size_t len, long long now)
+{
+    write_record(t, TRACE_EVENTS, 0, buffer, len, now);
+}
+
+// record new watch, replay maps its wd to the watch of the same dir
+void trace_watch(Trace* t, int wd, const char* path) { write_record(t, TRACE_WATCH, wd, path, strlen(path), monotonic_us()); }
+
+// map trace file for replay, NULL if it isn't a trace
+Trace* trace_load(const char* path)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        ERR("open");
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        ERR("fstat");
+        exit(EXIT_FAILURE);
+    }
+    if ((size_t)st.st_size < sizeof(TraceHeader))
+    {
+        fprintf(stderr, "%s isn't a trace\n", path);
+        close(fd);
+        return NULL;
+    }
+
+    char* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED)
+    {
+        ERR("mmap");
+        exit(EXIT_FAILURE);
+    }
+
+    TraceHeader* header = (TraceHeader*)map;
+    if (memcmp(header->magic, TRACE_MAGIC, sizeof(header->magic)) != 0
+        || sizeof(TraceHeader) + header->src_len > (size_t)st.st_size)
+    {
+        fprintf(stderr, "%s isn't a trace\n", path);
+        munmap(map, st.st_size);
+        close(fd);
+        return NULL;
+    }
+
+    Trace* t = new_trace(fd, map + sizeof(TraceHeader), header->src_len);
+    t->map = map;
+    t->len = st.st_size;
+    trace_rewind(t);
+    return t;
+}
+
+// next record of mapped trace, data points into the mapping, returns 0 at the end
+// record cut off by worker that was killed while writing it ends the trace
+int trace_next(Trace* t, TraceRecord* record, const char** data)
+{
+    if (t->pos + sizeof(TraceRecord) > t->len)
+        return 0;
+
+    memcpy(record, t->map + t->pos, sizeof(TraceRecord));
+    if (record->len > t->len - t->pos - sizeof(TraceRecord))
+        return 0;
+
+    *data = t->map + t->pos + sizeof(TraceRecord);
+    t->pos += sizeof(TraceRecord) + record->len;
+    return 1;
+}
+
+// go back to the first record
+void trace_rewind(Trace* t)
+{
+    TraceHeader* header = (TraceHeader*)t->map;
+    t->pos = sizeof(TraceHeader) + header->src_len;
+}
+
+void trace_close(Trace* t)
+{
+    if (t == NULL)
+        return;
+
+    if (t->map != NULL && munmap(t->map, t->len) != 0)
+    {
+        ERR("munmap");
+        exit(EXIT_FAILURE);
+    }
+    if (close(t->fd) < 0)
+    {
+        ERR("close");
+        exit(EXIT_FAILURE);
+    }
+    free(t->src);
+    free(t);
+}
@@ -0,0 +1,59 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "utils.h"
+
+#include <stdint.h>
+
+#define TRACE_MAGIC "SOPTRC01"
+
+typedef enum TraceType
+{
+    TRACE_EVENTS = 1,  // raw buffer returned by one read of events
+    TRACE_WATCH = 2,   // new watch, its wd is used by later events
+} TraceType;
+
+// start of trace file, source path of recorded worker without '\0' follows it
+typedef struct TraceHeader
+{
+    char magic[8];     // TRACE_MAGIC
+    uint32_t src_len;  // bytes of source path
+    uint32_t unused;   // header is 16 bytes
+} TraceHeader;
+
+// header of record, len bytes of event buffer or watch path without '\0' follow it
+typedef struct TraceRecord
+{
+    uint32_t type;    // TraceType
+    uint32_t len;     // bytes after header
+    int32_t wd;       // wd of new watch, 0 for events
+    uint32_t unused;  // keeps time 8-byte aligned
+    int64_t time_us;  // monotonic us since trace was opened
+} TraceRecord;
+
+// trace written by worker or mapped for replay
+typedef struct Trace
+{
+    int fd;           // trace file
+    long long start;  // monotonic us when trace was opened for writing
+    char* map;        // mapped trace, NULL while writing
+    size_t len;       // size of mapping
+    size_t pos;       // offset of the next record in mapping
+    char* src;        // source path of recorded worker
+} Trace;
+
+Trace* trace_open(const char* path, const char* src);
+
+void trace_events(Trace* t, const char* buffer, size_t len, long long now);
+
+void trace_watch(Trace* t, int wd, const char* path);
+
+Trace* trace_load(const char* path);
+
+int trace_next(Trace* t, TraceRecord* record, const char** data);
+
+void trace_rewind(Trace* t);
+
+void trace_close(Trace* t);
+
+#endif
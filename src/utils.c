@@ -1,37 +1,51 @@
 #include "utils.h"
 
+#include "dir_iter.h"
+
 // program usage
 void usage()
 {
     fprintf(stdout, "-------------------------- Backup wizard --------------------------\n");
     fprintf(stdout, "Commands:\n");
-    fprintf(stdout, "    - add <source path> <target path>\n");
+    fprintf(stdout, "    - add [options] <source path> <target path>\n");
     fprintf(stdout, "       > starts backup of folder <source path> to <target path>\n");
+    fprintf(stdout, "       > --threads=N copies the folder with N threads at the start\n");
+    fprintf(stdout, "       > --fanout one worker reads source once for all targets\n");
+    fprintf(stdout, "       > --debounce=MS merges changes of a file made within MS ms\n");
+    fprintf(stdout, "       > --backend=fanotify watches whole filesystem instead of every dir\n");
+    fprintf(stdout, "       > --resume continues backup into target that isn't empty\n");
+    fprintf(stdout, "       > --trace=FILE records events read by the worker into FILE for replay\n");
     fprintf(stdout, "    - end <source path> <target path>\n");
     fprintf(stdout, "       > ends backup\n");
     fprintf(stdout, "    - list\n");
-    fprintf(stdout, "       > lists all folders that have backups\n");
-    fprintf(stdout, "    - restore <source path> <target path>\n");
-    fprintf(stdout, "       > restores backup\n");
+    fprintf(stdout, "       > lists all folders that have backups and running restores\n");
+    fprintf(stdout, "    - stats\n");
+    fprintf(stdout, "       > shows live counters of every backup worker\n");
+    fprintf(stdout, "    - latency [<file>]\n");
+    fprintf(stdout, "       > shows event to target latency percentiles, <file> gets whole histograms\n");
+    fprintf(stdout, "    - restore [--threads=N] <source path> <target path>\n");
+    fprintf(stdout, "       > restores backup, --threads=N restores it with N threads\n");
+    fprintf(stdout, "    - cancel <source path> <target path>\n");
+    fprintf(stdout, "       > stops running restore\n");
     fprintf(stdout, "    - exit\n");
     fprintf(stdout, "       > ends program\n");
     fprintf(stdout, "--------------------------------------------------------------------\n");
 }
 
-// check dir
-int check_dir(char* path)
+// check dir, resumed backup can use dir that isn't empty
+int check_dir(char* path, int resume)
 {
     errno = 0;
-    DIR* dir = opendir(path);
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
 
     // permission denied
-    if (dir == NULL && errno == EACCES)
+    if (fd < 0 && errno == EACCES)
     {
         fprintf(stdout, "Access to %s denied, cannot start backup!\n", path);
         return -1;
     }
     // dir doesn't exits
-    if (dir == NULL && errno == ENOENT)
+    if (fd < 0 && errno == ENOENT)
     {
         // create new dir for backup
         if (mkdir(path, 0777) != 0)
@@ -43,33 +57,38 @@ int check_dir(char* path)
         return 0;
     }
     // path is not a directory
-    if (dir == NULL && errno == ENOTDIR)
+    if (fd < 0 && errno == ENOTDIR)
     {
         fprintf(stdout, "%s is not a directory.\n", path);
         return -1;
     }
+    if (fd < 0)
+    {
+        ERR("open, worker didn't start");
+        return -1;
+    }
 
     // directory exists -> we have to check if it's empty
-    struct dirent* file_info;
-
-    while ((file_info = readdir(dir)) != NULL)
+    if (resume)
     {
-        // ignore "." and ".."
-        if (strcmp(file_info->d_name, ".") == 0 || strcmp(file_info->d_name, "..") == 0)
+        if (close(fd) < 0)
         {
-            continue;
+            ERR("close");
+            exit(EXIT_FAILURE);
         }
+        return 0;
+    }
+    DirIter* it = dir_iter_open(fd);
+    DirEntry entry;
+    int empty = !dir_iter_next(it, &entry);
+    dir_iter_close(it);
 
+    if (!empty)
+    {
         fprintf(stdout, "Directory %s is not empty.\n", path);
-        if (closedir(dir) < 0)
-        {
-            ERR("closedir, worker didn't start");
-            return -1;
-        }
         return -1;
     }
 
-    closedir(dir);
     return 0;
 }
 
@@ -91,59 +110,122 @@ char* join_paths(char* path, char* filename)
     return full_path;
 }
 
-void rm_dir_recursive(char* path)
+// open directory name relative to dirfd and return its fd, follows no symlinks
+int open_dir_at(int dirfd, char* name)
 {
-    DIR* dir = opendir(path);
-    if (dir == NULL)
+    int fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0)
     {
-        ERR("opendir");
+        ERR("openat");
         exit(EXIT_FAILURE);
     }
 
-    struct dirent* file_info;
-    struct stat stat_info;
+    return fd;
+}
+
+// remove directory name relative to parent_fd with all its content
+void rm_dir_at(int parent_fd, char* name)
+{
+    DirIter* it = dir_iter_open(open_dir_at(parent_fd, name));
+    DirEntry entry;
 
     // read all dir files
-    while ((file_info = readdir(dir)) != NULL)
+    while (dir_iter_next(it, &entry))
     {
-        // ignore "." and ".."
-        if (strcmp(file_info->d_name, ".") == 0 || strcmp(file_info->d_name, "..") == 0)
+        if (entry.type == DT_DIR)
         {
-            continue;
+            rm_dir_at(it->fd, entry.name);
         }
-
-        char* file = join_paths(path, file_info->d_name);
-
-        if (lstat(file, &stat_info) != 0)
+        else if (unlinkat(it->fd, entry.name, 0) < 0)
         {
-            ERR("lstat");
+            ERR("unlinkat");
             exit(EXIT_FAILURE);
         }
+    }
 
-        if (S_ISREG(stat_info.st_mode) || S_ISLNK(stat_info.st_mode))
-        {
-            if (unlink(file) < 0)
-            {
-                ERR("unlink");
-                exit(EXIT_FAILURE);
-            }
-        }
-        else if (S_ISDIR(stat_info.st_mode))
-        {
-            rm_dir_recursive(file);
-        }
-        free(file);
+    dir_iter_close(it);
+
+    if (unlinkat(parent_fd, name, AT_REMOVEDIR) < 0)
+    {
+        ERR("rmdir");
+        exit(EXIT_FAILURE);
     }
+}
+
+// remove directory with all its content
+void rm_dir_recursive(char* path) { rm_dir_at(AT_FDCWD, path); }
 
-    if (closedir(dir) < 0)
+// monotonic clock in milliseconds
+long long monotonic_ms()
+{
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0)
     {
-        ERR("closedir");
+        ERR("clock_gettime");
         exit(EXIT_FAILURE);
     }
 
-    if (rmdir(path) < 0)
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// monotonic clock in microseconds
+long long monotonic_us()
+{
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0)
     {
-        ERR("rmdir");
+        ERR("clock_gettime");
         exit(EXIT_FAILURE);
     }
+
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// wall clock in nanoseconds, same clock as file timestamps
+long long realtime_ns()
+{
+    struct timespec ts;
+    if (clock_gettime(CLOCK_REALTIME, &ts) != 0)
+    {
+        ERR("clock_gettime");
+        exit(EXIT_FAILURE);
+    }
+
+    return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// write whole buffers of iov, short writes go on where they stopped and change iov
+// -1 on error, errno tells why
+int writev_all(int fd, struct iovec* iov, int count)
+{
+    while (count > 0)
+    {
+        ssize_t written = writev(fd, iov, count);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written < 0)
+            return -1;
+
+        // skip written buffers, rest of the last one is written again
+        size_t done = written;
+        while (count > 0 && done >= iov->iov_len)
+        {
+            done -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0)
+        {
+            iov->iov_base = (char*)iov->iov_base + done;
+            iov->iov_len -= done;
+        }
+    }
+    return 0;
+}
+
+// write whole buffer, -1 on error
+int write_all(int fd, const void* buf, size_t len)
+{
+    struct iovec iov = {(void*)buf, len};
+    return writev_all(fd, &iov, 1);
 }
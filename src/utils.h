@@ -5,11 +5,13 @@
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/inotify.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
@@ -25,10 +27,24 @@
 
 void usage();
 
-int check_dir(char* path);
+int check_dir(char* path, int resume);
 
 char* join_paths(char* path, char* filename);
 
+int open_dir_at(int dirfd, char* name);
+
+void rm_dir_at(int parent_fd, char* name);
+
 void rm_dir_recursive(char* path);
 
+long long monotonic_ms();
+
+long long monotonic_us();
+
+long long realtime_ns();
+
+int writev_all(int fd, struct iovec* iov, int count);
+
+int write_all(int fd, const void* buf, size_t len);
+
 #endif
@@ -1,7 +1,192 @@
 #include "watchers.h"
 
-// init inotify and watchers struct
-Watchers* watchers_init()
+#include <stdint.h>
+
+#include "fan_watchers.h"
+#include "trace.h"
+
+// hash of wd, multiplication spreads consecutive wds over the table
+static size_t wd_hash(int wd) { return (uint32_t)wd * 2654435761u; }
+
+// FNV-1a hash of first len chars of path
+static size_t path_hash(const char* path, size_t len)
+{
+    uint64_t hash = 1469598103934665603ULL;
+    for (size_t i = 0; i < len; i++)
+    {
+        hash ^= (unsigned char)path[i];
+        hash *= 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+// key of watch in table of wds
+static size_t watch_wd_hash(Watch* watch) { return wd_hash(watch->wd); }
+
+// key of watch in table of paths
+static size_t watch_path_hash(Watch* watch) { return watch->hash; }
+
+// allocate empty hash table
+Watch** watch_table_new(int cap)
+{
+    Watch** table = calloc(cap, sizeof(Watch*));
+    if (table == NULL)
+    {
+        ERR("calloc");
+        exit(EXIT_FAILURE);
+    }
+
+    return table;
+}
+
+// put watch in the first free slot from its hash on
+void watch_table_insert(Watch** table, int cap, Watch* watch, WatchHash hash)
+{
+    size_t mask = cap - 1;
+    size_t i = hash(watch) & mask;
+
+    while (table[i] != NULL)
+    {
+        i = (i + 1) & mask;
+    }
+    table[i] = watch;
+}
+
+// remove watch from table, next watches of its probe chain are moved back so no tombstones are needed
+void watch_table_remove(Watch** table, int cap, Watch* watch, WatchHash hash)
+{
+    size_t mask = cap - 1;
+    size_t i = hash(watch) & mask;
+
+    while (table[i] != watch)
+    {
+        if (table[i] == NULL)
+            return;
+        i = (i + 1) & mask;
+    }
+    table[i] = NULL;
+
+    // i is the empty slot, j walks the rest of the chain
+    size_t j = i;
+    while (1)
+    {
+        j = (j + 1) & mask;
+        if (table[j] == NULL)
+            return;
+
+        // watch in slot j can fill slot i, if its home slot isn't between them
+        size_t home = hash(table[j]) & mask;
+        int between = i < j ? (home > i && home <= j) : (home > i || home <= j);
+        if (!between)
+        {
+            table[i] = table[j];
+            table[j] = NULL;
+            i = j;
+        }
+    }
+}
+
+// double capacity of tables when they are half full
+static void grow_tables(Watchers* w)
+{
+    if ((w->size + 1) * 2 <= w->cap)
+        return;
+
+    int cap = w->cap * 2;
+    Watch** by_wd = watch_table_new(cap);
+    Watch** by_path = watch_table_new(cap);
+
+    for (int i = 0; i < w->cap; i++)
+    {
+        if (w->by_wd[i] == NULL)
+            continue;
+        watch_table_insert(by_wd, cap, w->by_wd[i], watch_wd_hash);
+        watch_table_insert(by_path, cap, w->by_wd[i], watch_path_hash);
+    }
+
+    free(w->by_wd);
+    free(w->by_path);
+    w->by_wd = by_wd;
+    w->by_path = by_path;
+    w->cap = cap;
+}
+
+// searches for Watch of first len chars of path
+static Watch* search_path_len(Watchers* w, const char* path, size_t len)
+{
+    size_t hash = path_hash(path, len);
+    size_t mask = w->cap - 1;
+
+    for (size_t i = hash & mask; w->by_path[i] != NULL; i = (i + 1) & mask)
+    {
+        Watch* p = w->by_path[i];
+        if (p->hash == hash && strncmp(p->path, path, len) == 0 && p->path[len] == '\0')
+            return p;
+    }
+
+    return NULL;
+}
+
+// add watch to subdirs of its parent, parent is found by path
+static void link_watch(Watchers* w, Watch* watch)
+{
+    char* slash = strrchr(watch->path, '/');
+    watch->parent = slash == NULL ? NULL : search_path_len(w, watch->path, slash - watch->path);
+    watch->prev = NULL;
+    watch->next = NULL;
+
+    if (watch->parent == NULL)
+        return;
+
+    watch->next = watch->parent->child;
+    if (watch->next != NULL)
+        watch->next->prev = watch;
+    watch->parent->child = watch;
+}
+
+// remove watch from subdirs of its parent
+static void unlink_watch(Watch* watch)
+{
+    if (watch->prev != NULL)
+        watch->prev->next = watch->next;
+    else if (watch->parent != NULL)
+        watch->parent->child = watch->next;
+    if (watch->next != NULL)
+        watch->next->prev = watch->prev;
+
+    watch->parent = NULL;
+    watch->prev = NULL;
+    watch->next = NULL;
+}
+
+// set new path of watch, path is owned by watch
+static void set_watch_path(Watchers* w, Watch* watch, char* path)
+{
+    if (watch->path != NULL)
+        watch_table_remove(w->by_path, w->cap, watch, watch_path_hash);
+    free(watch->path);
+
+    watch->path = path;
+    watch->hash = path_hash(path, strlen(path));
+    watch_table_insert(w->by_path, w->cap, watch, watch_path_hash);
+}
+
+// init inotify for watchers, -1 when limit of instances was hit
+static int inotify_backend(Watchers* w)
+{
+    w->fd = inotify_init();
+    if (w->fd < 0)
+    {
+        ERR("inotify_init");
+        return -1;
+    }
+    return 0;
+}
+
+// init watchers struct with given backend, inotify is used when fanotify is unavailable
+// NULL when neither can be used, only the worker that needs them fails
+Watchers* watchers_init(WatchBackend backend)
 {
     Watchers* new_dict = malloc(sizeof(Watchers));
     if (new_dict == NULL)
@@ -10,15 +195,21 @@ Watchers* watchers_init()
         exit(EXIT_FAILURE);
     }
 
-    new_dict->head = NULL;
+    new_dict->cap = WATCHERS_MIN_CAP;
+    new_dict->by_wd = watch_table_new(new_dict->cap);
+    new_dict->by_path = watch_table_new(new_dict->cap);
     new_dict->size = 0;
+    new_dict->fan = NULL;
+    new_dict->trace = NULL;
+    new_dict->failed = 0;
 
-    // init inotify
-    new_dict->fd = inotify_init();
-    if (new_dict->fd < 0)
+    // init fanotify or inotify
+    if ((backend != WATCH_FANOTIFY || fan_init(new_dict) != 0) && inotify_backend(new_dict) != 0)
     {
-        ERR("inotify_init");
-        exit(EXIT_FAILURE);
+        free(new_dict->by_wd);
+        free(new_dict->by_path);
+        free(new_dict);
+        return NULL;
     }
 
     return new_dict;
@@ -30,97 +221,154 @@ void free_watchers(Watchers* w)
     if (w == NULL)
         return;
 
-    Watch* p = w->head;
+    // fanotify has no watch per dir
+    int inotify = w->fan == NULL;
+    free_fan(w);
+
     // free watches
-    while (p != NULL)
+    for (int i = 0; i < w->cap; i++)
     {
-        Watch* next = p->next;
-        // removes watches
-        if (inotify_rm_watch(w->fd, p->wd) != 0)
+        Watch* p = w->by_wd[i];
+        if (p == NULL)
+            continue;
+
+        // removes watches, watch of deleted dir could be removed by the kernel already
+        if (inotify && inotify_rm_watch(w->fd, p->wd) != 0 && errno != EINVAL)
         {
             ERR("inotify_rm_watch");
             exit(EXIT_FAILURE);
         }
         free(p->path);
+        free(p->handle);
         free(p);
-        p = next;
     }
 
-    // close inotify
-    if (close(w->fd) < 0)
+    // close inotify, it's missing when fanotify fallback failed
+    if (w->fd >= 0 && close(w->fd) < 0)
     {
         ERR("close");
         exit(EXIT_FAILURE);
     }
 
+    free(w->by_wd);
+    free(w->by_path);
     free(w);
 }
 
-// create new watch, returns wd
+// add entry for wd and path to tables, path is owned by watchers
+Watch* new_watch_entry(Watchers* w, int wd, char* path)
+{
+    // create new Watch object
+    Watch* new_watch = malloc(sizeof(Watch));
+    if (new_watch == NULL)
+    {
+        ERR("new_watch");
+        exit(EXIT_FAILURE);
+    }
+
+    // add it to tables
+    grow_tables(w);
+    new_watch->wd = wd;
+    new_watch->path = NULL;
+    new_watch->child = NULL;
+    new_watch->handle = NULL;
+    set_watch_path(w, new_watch, path);
+    watch_table_insert(w->by_wd, w->cap, new_watch, watch_wd_hash);
+    link_watch(w, new_watch);
+    w->size++;
+    if (w->trace != NULL)
+        trace_watch(w->trace, wd, path);
+
+    return new_watch;
+}
+
+// dir at path can't be watched, returns -1 and frees path
+// dir that is gone is skipped, other errors like the limit of watches leave the source without events
+static int watch_failed(Watchers* w, char* path)
+{
+    if (errno != ENOENT && errno != ENOTDIR)
+    {
+        ERR("inotify_add_watch");
+        w->failed = 1;
+    }
+    free(path);
+    return -1;
+}
+
+// create new watch, returns wd or -1, path is owned by watchers
 int add_watch(Watchers* w, char* path)
 {
+    // whole filesystem is marked, dir is only remembered by its handle
+    if (w->fan != NULL)
+        return fan_add_dir(w, path);
+
     uint32_t mask = IN_CREATE | IN_DELETE | IN_CLOSE_WRITE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB;
 
     // add watcher
     int wd = inotify_add_watch(w->fd, path, mask);
     if (wd < 0)
+        return watch_failed(w, path);
+
+    // other dir was at this path before, its events were lost
+    Watch* stale = search_watch_path(w, path);
+    if (stale != NULL && stale->wd != wd)
     {
-        ERR("inotify_add_watch");
-        exit(EXIT_FAILURE);
+        remove_watch_tree(w, path);
+        // dir could be inside removed subtree
+        wd = inotify_add_watch(w->fd, path, mask);
+        if (wd < 0)
+            return watch_failed(w, path);
     }
 
-    // create new Watch object
-    Watch* new_watch = malloc(sizeof(Watch));
-    if (new_watch == NULL)
+    // directory is already watched under other path - it was moved
+    Watch* old_watch = search_watch(w, wd);
+    if (old_watch != NULL && strcmp(old_watch->path, path) == 0)
     {
-        ERR("new_watch");
-        exit(EXIT_FAILURE);
+        // root of watched tree gets its parent when the tree around it is watched
+        if (old_watch->parent == NULL)
+            link_watch(w, old_watch);
+        free(path);
+        return wd;
+    }
+    if (old_watch != NULL)
+    {
+        unlink_watch(old_watch);
+        set_watch_path(w, old_watch, path);
+        link_watch(w, old_watch);
+        return wd;
     }
 
-    // add it to dict
-    new_watch->path = path;
-    new_watch->wd = wd;
-    new_watch->next = w->head;
-    w->head = new_watch;
-    w->size++;
+    new_watch_entry(w, wd, path);
 
     // return wd
     return wd;
 }
 
-// delete watch from dict
+// delete watch from tables, watches of its subdirs lose their parent
 void delete_watch(Watchers* w, int wd)
 {
-    if (w == NULL)
+    Watch* p = search_watch(w, wd);
+    if (p == NULL)
         return;
 
-    Watch* p = w->head;
-    // if wd at the beginning of list
-    if (p->wd == wd)
+    watch_table_remove(w->by_wd, w->cap, p, watch_wd_hash);
+    watch_table_remove(w->by_path, w->cap, p, watch_path_hash);
+    unlink_watch(p);
+    while (p->child != NULL)
     {
-        w->head = p->next;
-        free(p->path);
-        free(p);
-        w->size--;
-        return;
+        Watch* child = p->child;
+        p->child = child->next;
+        child->parent = NULL;
+        child->prev = NULL;
+        child->next = NULL;
     }
 
-    p = p->next;
-    Watch* prev = w->head;
-    // search for wd and delete its Watch
-    while (p != NULL)
-    {
-        if (p->wd == wd)
-        {
-            prev->next = p->next;
-            free(p->path);
-            free(p);
-            w->size--;
-            return;
-        }
-        prev = p;
-        p = p->next;
-    }
+    if (p->handle != NULL)
+        fan_forget(w, p);
+    free(p->path);
+    free(p->handle);
+    free(p);
+    w->size--;
 }
 
 // searches for Watch for given wd
@@ -129,109 +377,198 @@ Watch* search_watch(Watchers* w, int wd)
     if (w == NULL)
         return NULL;
 
-    Watch* p = w->head;
-    // search for Watch
-    while (p != NULL)
+    size_t mask = w->cap - 1;
+    for (size_t i = wd_hash(wd) & mask; w->by_wd[i] != NULL; i = (i + 1) & mask)
     {
-        if (p->wd == wd)
-        {
-            return p;
-        }
-        p = p->next;
+        if (w->by_wd[i]->wd == wd)
+            return w->by_wd[i];
     }
 
     return NULL;
 }
 
+// searches for Watch of directory with given path
+Watch* search_watch_path(Watchers* w, const char* path)
+{
+    if (w == NULL)
+        return NULL;
+
+    return search_path_len(w, path, strlen(path));
+}
+
 // prints Watchers to logs
-void print_watchers(Watchers* w, FILE* logs, char* src, char* target)
+void print_watchers(Watchers* w, Log* logs, char* src, char* target)
 {
-    fprintf(logs, "[%d] INOTIFY STATUS\n", getpid());
     if (w == NULL)
     {
-        fprintf(logs, "\tNo active inotify.\n");
+        LOG(logs, LOG_LEVEL_INFO, "INOTIFY STATUS: No active inotify.");
         return;
     }
-    fprintf(logs, "\tInotify [%d], %d watchers:\n", w->fd, w->size);
+    if (w->fan != NULL)
+        LOG(logs, LOG_LEVEL_INFO, "INOTIFY STATUS: Fanotify [%d], moves are %s, %d dirs", w->fd,
+            w->fan->rename ? "matched" : "copied", w->size);
+    else
+        LOG(logs, LOG_LEVEL_INFO, "INOTIFY STATUS: Inotify [%d], %d watchers", w->fd, w->size);
 
-    Watch* p = w->head;
-
-    while (p != NULL)
+    for (int i = 0; i < w->cap; i++)
     {
-        fprintf(logs, "\t - watcher [%d] for %s\n", p->wd, p->path);
-        p = p->next;
+        Watch* p = w->by_wd[i];
+        if (p != NULL)
+            LOG(logs, LOG_LEVEL_DEBUG, "\t - watcher [%d] for %s", p->wd, p->path);
     }
-    fflush(logs);
 }
 
-// add watches recursively
+// add watches recursively, path is owned by watchers
 void add_watch_recursive(Watchers* w, char* path)
 {
-    DIR* dir = opendir(path);
-    if (dir == NULL)
+    // fanotify can't mark this filesystem
+    if (w->fan != NULL && w->size == 0 && fan_mark(w, path) != 0)
     {
-        ERR("opendir");
-        exit(EXIT_FAILURE);
+        free_fan(w);
+        if (close(w->fd) < 0)
+        {
+            ERR("close");
+            exit(EXIT_FAILURE);
+        }
+        if (inotify_backend(w) != 0)
+        {
+            w->failed = 1;
+            free(path);
+            return;
+        }
     }
 
-    // add main dir
-    add_watch(w, path);
+    add_watch_at(w, open_dir_at(AT_FDCWD, path), path);
+}
 
-    struct dirent* file_info;
-    struct stat stat_info;
+// add watches for directory fd with given path and its subdirs, fd is closed at the end
+void add_watch_at(Watchers* w, int fd, char* path)
+{
+    DirIter* it = dir_iter_open(fd);
 
-    // search for subdirs
-    while ((file_info = readdir(dir)) != NULL)
+    // add main dir, path is freed when dir is watched already
+    Watch* watch = search_watch(w, add_watch(w, path));
+    if (watch == NULL)
     {
-        // ignore "." and ".."
-        if (strcmp(file_info->d_name, ".") == 0 || strcmp(file_info->d_name, "..") == 0)
-        {
-            continue;
-        }
-        // get file path
-        char* file_path = join_paths(path, file_info->d_name);
-        // get stat
-        if (lstat(file_path, &stat_info) != 0)
-        {
-            ERR("lstat");
-            exit(EXIT_FAILURE);
-        }
+        dir_iter_close(it);
+        return;
+    }
 
-        // if dir run add_watch_recursive()
-        if (S_ISDIR(stat_info.st_mode))
-        {
-            add_watch_recursive(w, file_path);
-        }
-        else
+    // search for subdirs, d_type tells which entries are dirs, walk stops when a watch failed
+    DirEntry entry;
+    while (!w->failed && dir_iter_next(it, &entry))
+    {
+        // if dir run add_watch_at(), watch needs path of dir
+        if (entry.type == DT_DIR)
         {
-            free(file_path);
+            add_watch_at(w, open_dir_at(fd, entry.name), join_paths(watch->path, entry.name));
         }
     }
 
-    if (closedir(dir) < 0)
+    // closes fd
+    dir_iter_close(it);
+}
+
+// change prefix of paths of watch and its subdirs from old_len chars to new_path
+static void rename_subtree(Watchers* w, Watch* watch, size_t old_len, const char* new_path)
+{
+    char* path = malloc(strlen(new_path) + strlen(watch->path + old_len) + 1);
+    if (path == NULL)
     {
-        ERR("closedir");
+        ERR("malloc");
         exit(EXIT_FAILURE);
     }
+    strcpy(path, new_path);
+    strcat(path, watch->path + old_len);
+    set_watch_path(w, watch, path);
+
+    for (Watch* p = watch->child; p != NULL; p = p->next)
+    {
+        rename_subtree(w, p, old_len, new_path);
+    }
 }
 
-// updates watch paths
+// updates watch paths of moved directory and its subdirs
 void update_watch_paths(Watchers* w, const char* old_path, const char* new_path)
 {
-    size_t old_len = strlen(old_path);
+    Watch* watch = search_watch_path(w, old_path);
+    if (watch == NULL)
+        return;
+
+    unlink_watch(watch);
+    rename_subtree(w, watch, strlen(old_path), new_path);
+    link_watch(w, watch);
+}
+
+// remove watches of directory and its subdirs from inotify and tables
+static void remove_subtree(Watchers* w, Watch* watch)
+{
+    while (watch->child != NULL)
+    {
+        remove_subtree(w, watch->child);
+    }
+
+    // watch could be removed by the kernel already
+    if (w->fan == NULL && inotify_rm_watch(w->fd, watch->wd) != 0 && errno != EINVAL)
+    {
+        ERR("inotify_rm_watch");
+        exit(EXIT_FAILURE);
+    }
+    delete_watch(w, watch->wd);
+}
+
+// stop watching directory that left the source, with its subdirs
+void remove_watch_tree(Watchers* w, const char* path)
+{
+    Watch* watch = search_watch_path(w, path);
+    if (watch != NULL)
+        remove_subtree(w, watch);
+}
 
-    Watch* p = w->head;
+// remove watches of dirs that are gone, used when their events were lost
+void prune_watches(Watchers* w)
+{
+    // paths are collected first, removing changes the table
+    char** gone = malloc(sizeof(char*) * (w->size + 1));
+    if (gone == NULL)
+    {
+        ERR("malloc");
+        exit(EXIT_FAILURE);
+    }
 
-    while (p != NULL)
+    int count = 0;
+    struct stat stat_info;
+    for (int i = 0; i < w->cap; i++)
     {
-        if (strncmp(p->path, old_path, old_len) == 0 && (p->path[old_len] == '/' || p->path[old_len] == '\0'))
+        Watch* p = w->by_wd[i];
+        if (p == NULL || (lstat(p->path, &stat_info) == 0 && S_ISDIR(stat_info.st_mode)))
+            continue;
+
+        gone[count] = strdup(p->path);
+        if (gone[count] == NULL)
         {
-            char new_full_path[PATH_MAX];
-            snprintf(new_full_path, sizeof(new_full_path), "%s%s", new_path, p->path + old_len);
-            free(p->path);
-            p->path = strdup(new_full_path);
+            ERR("strdup");
+            exit(EXIT_FAILURE);
         }
+        count++;
+    }
 
-        p = p->next;
+    for (int i = 0; i < count; i++)
+    {
+        remove_watch_tree(w, gone[i]);
+        free(gone[i]);
     }
+    free(gone);
+}
+
+// read events of backend as inotify events
+ssize_t read_events(Watchers* w, char* buffer, size_t len)
+{
+    if (w->fan != NULL)
+        return fan_read(w, buffer, len);
+
+    return read(w->fd, buffer, len);
 }
+
+// name of backend for logs
+const char* backend_name(Watchers* w) { return w->fan != NULL ? "fanotify" : "inotify"; }
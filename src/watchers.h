@@ -1,23 +1,45 @@
 #ifndef WATCHERS_H
 #define WATCHERS_H
 
+#include "dir_iter.h"
+#include "log.h"
 #include "utils.h"
 
+#define WATCHERS_MIN_CAP 64  // initial capacity of hash tables, power of 2
+
+typedef enum WatchBackend
+{
+    WATCH_INOTIFY,   // inotify watch per directory
+    WATCH_FANOTIFY,  // one fanotify mark for whole filesystem
+} WatchBackend;
+
 typedef struct Watch
 {
-    int wd;              // watcher descriptor
-    char* path;          // path to watched dir
-    struct Watch* next;  // next watch in list
+    int wd;                      // watcher descriptor
+    char* path;                  // path to watched dir
+    size_t hash;                 // hash of path
+    struct Watch* parent;        // watch of parent dir, NULL for root of tree
+    struct Watch* child;         // first watched subdir
+    struct Watch* prev;          // previous watched subdir of parent
+    struct Watch* next;          // next watched subdir of parent
+    struct file_handle* handle;  // fanotify handle of dir, NULL with inotify
 } Watch;
 
 typedef struct Watchers
 {
-    Watch* head;  // head of list of watches
-    int size;     // size of list
-    int fd;       // inotify descriptor
+    Watch** by_wd;            // open addressing table of watches keyed by wd
+    Watch** by_path;          // open addressing table of watches keyed by path
+    int cap;                  // capacity of both tables, power of 2
+    int size;                 // number of watches
+    int fd;                   // inotify or fanotify descriptor
+    struct FanWatchers* fan;  // fanotify state, NULL with inotify
+    struct Trace* trace;      // trace that records new watches, NULL when events aren't recorded
+    int failed;               // a dir couldn't be watched, e.g. limit of watches was hit, source isn't followed
 } Watchers;
 
-Watchers* watchers_init();
+typedef size_t (*WatchHash)(Watch* watch);
+
+Watchers* watchers_init(WatchBackend backend);
 
 void free_watchers(Watchers* w);
 
@@ -27,10 +49,30 @@ void delete_watch(Watchers* w, int wd);
 
 Watch* search_watch(Watchers* w, int wd);
 
-void print_watchers(Watchers* w, FILE* logs, char* src, char* target);
+Watch* new_watch_entry(Watchers* w, int wd, char* path);
+
+Watch* search_watch_path(Watchers* w, const char* path);
+
+void print_watchers(Watchers* w, Log* logs, char* src, char* target);
 
 void add_watch_recursive(Watchers* w, char* path);
 
+void add_watch_at(Watchers* w, int fd, char* path);
+
 void update_watch_paths(Watchers* w, const char* old_path, const char* new_path);
 
+void remove_watch_tree(Watchers* w, const char* path);
+
+void prune_watches(Watchers* w);
+
+ssize_t read_events(Watchers* w, char* buffer, size_t len);
+
+const char* backend_name(Watchers* w);
+
+Watch** watch_table_new(int cap);
+
+void watch_table_insert(Watch** table, int cap, Watch* watch, WatchHash hash);
+
+void watch_table_remove(Watch** table, int cap, Watch* watch, WatchHash hash);
+
 #endif
@@ -1,101 +1,471 @@
 #include "worker.h"
 
-// start worker
-void start_worker(char* src, char* target, FILE* logs)
+#include "resync.h"
+
+#include <limits.h>
+#include <poll.h>
+
+// shorter of two timeouts, -1 means no timeout
+static int min_timeout(int a, int b) { return a < 0 || (b >= 0 && b < a) ? b : a; }
+
+// copy of path that is owned by its holder
+static char* copy_path(const char* path)
+{
+    char* copy = strdup(path);
+    if (copy == NULL)
+    {
+        ERR("strdup");
+        exit(EXIT_FAILURE);
+    }
+    return copy;
+}
+
+// ms that worker can wait for events without its logs, -1 if nothing waits for time
+int worker_timeout(Worker* wk, long long now)
+{
+    int timeout = coalesce_timeout(wk->pending, now);
+    if (wk->move_cookie == 0)
+        return timeout;
+
+    int move = wk->move_deadline > now ? wk->move_deadline - now : 0;
+    return min_timeout(timeout, move);
+}
+
+// counters of worker for stats command, worker is their only writer
+static void publish_stats(Worker* wk)
 {
+    if (wk->stats == NULL)
+        return;
+
+    atomic_store_explicit(&wk->stats->events, wk->events, memory_order_relaxed);
+    atomic_store_explicit(&wk->stats->ops, wk->ops, memory_order_relaxed);
+    atomic_store_explicit(&wk->stats->queue, wk->pending->size, memory_order_relaxed);
+    atomic_store_explicit(&wk->stats->watches, wk->watchers->size, memory_order_relaxed);
+}
+
+// copy or compare source with targets and watch it, targets are owned by worker
+// -1 when this source can't be backed up, worker_finish() frees the worker then
+int worker_setup(Worker* wk, char* src, char** targets, int count, WorkerOptions* opts, WorkerStats* stats, Log* logs)
+{
+    // copies of worker and its threads are counted in shared memory
+    stats_own(stats, getpid());
+    if (stats != NULL)
+        copy_stats = &stats->copy;
+
     // start new worker
-    write_log(logs, src, target, "New worker", "");
-    write_log(logs, src, target, "Copying source dir: ", src);
+    write_log(logs, src, targets[0], "New worker", "");
+
+    *wk = (Worker){.src = src, .target = targets[0], .logs = logs, .stats = stats, .targets = targets, .count = count,
+                   .watch_role = WATCH_OWN};
+    // changes made during initial copy could be missed
+    wk->checkpoint = realtime_ns();
+    // block hashes of updated target files
+    wk->cache = delta_cache_init();
+    // file ops merged over debounce window
+    wk->pending = coalescer_init(opts->debounce);
 
-    // check if target isn't inside source
-    if (path_cmp(src, target) == 0)
+    // check if targets aren't inside source
+    for (int i = 0; i < count; i++)
     {
-        fprintf(stdout, "\nInvalid target, can't be inside source\n");
-        exit(EXIT_FAILURE);
+        if (path_cmp(src, targets[i]) == 0)
+        {
+            fprintf(stdout, "\nInvalid target, can't be inside source\n");
+            return -1;
+        }
     }
 
     // initial copy
-    copy_dir(src, target, src, target, logs);
+    write_log(logs, src, targets[0], opts->resume ? "Resuming source dir: " : "Copying source dir: ", src);
+    if (opts->fanout)
+    {
+        // targets share one source reader
+        wk->target = NULL;
+        wk->fanout = fanout_init(src, targets, count, stats, logs);
+        if (opts->resume)
+            fanout_resume(wk->fanout);
+        else
+            fanout_initial_copy(wk->fanout, opts->threads);
+        fanout_start(wk->fanout);
+    }
+    else if (opts->resume)
+    {
+        // target is compared with the source once it's watched
+        wk->manifest = manifest_start(wk->target);
+    }
+    else
+    {
+        copy_dir_parallel(src, wk->target, src, wk->target, opts->threads, logs);
+        // manifest of copied target
+        wk->manifest = manifest_start(wk->target);
+    }
+
+    if (opts->watchers != NULL)
+    {
+        // keeper of shared watches already watches the source, they're listed by the keeper
+        wk->watchers = opts->watchers;
+        wk->watch_role = WATCH_SHARED;
+    }
+    else
+    {
+        // inotify or fanotify init, limit of instances fails only this worker
+        wk->watchers = watchers_init(opts->backend);
+        if (wk->watchers == NULL)
+            return -1;
+        // watches are recorded from the first one, events use their wds
+        if (opts->trace != NULL)
+        {
+            wk->trace = trace_open(opts->trace, src);
+            wk->watchers->trace = wk->trace;
+            write_log(logs, src, wk->target, "Recording events to ", opts->trace);
+        }
+        // root watch has its own copy of the path, it's freed when root is deleted
+        add_watch_recursive(wk->watchers, copy_path(src));
+        if (wk->watchers->failed)
+            return -1;
+        print_watchers(wk->watchers, logs, src, wk->target);
+        publish_stats(wk);
+    }
+    write_log(logs, src, wk->target, "Watching source with ", (char*)backend_name(wk->watchers));
+
+    // changes made while target is compared have events
+    if (opts->resume)
+        resume_source(wk);
+
+    write_log(logs, src, wk->target, "Waiting for changes...", "");
+    return 0;
+}
+
+// work that is due after events were read or a timeout passed
+void worker_tick(Worker* wk)
+{
+    // events were lost
+    if (wk->rescan)
+        resync_source(wk);
+
+    // move without pair left the source, run file ops whose window ended
+    finish_move(wk, monotonic_ms());
+    run_pending_ops(wk, monotonic_ms());
+    publish_stats(wk);
+}
+
+// apply changes that still wait and free worker, its stats slot is given back
+void worker_finish(Worker* wk)
+{
+    Log* logs = wk->logs;
+    write_log(logs, wk->src, wk->target, "Worker exiting...", "");
+    // changes waiting for their window still go to the target
+    finish_move(wk, LLONG_MAX);
+    run_pending_ops(wk, LLONG_MAX);
+    LOG(logs, LOG_LEVEL_INFO, "Received %lu events, executed %lu ops, merged %lu events", wk->events, wk->ops,
+        wk->pending->merged);
+    LOG(logs, LOG_LEVEL_INFO, "Recovered from %lu event queue overflows in %lld ms", wk->overflows, wk->resync_ms);
+    // free inotify and watchers, replicas finish queued changes, keeper frees shared watches
+    if (wk->watch_role != WATCH_SHARED)
+        free_watchers(wk->watchers);
+    trace_close(wk->trace);
+    free_fanout(wk->fanout);
+    free_delta_cache(wk->cache);
+    free_coalescer(wk->pending);
+    manifest_close(wk->manifest);
+    LOG(logs, LOG_LEVEL_INFO, "Copied %llu files, %llu bytes, skipped %llu bytes of holes", copy_stats->files,
+        copy_stats->bytes, copy_stats->holes);
+    stats_release(wk->stats, getpid());
+    for (int i = 0; i < wk->count; i++)
+    {
+        free(wk->targets[i]);
+    }
+    free(wk->src);
+}
+
+// keeper takes over watches of owner, owner and workers of sources inside its watched tree share them
+// move that waits in owner waits in keeper too, so both get its pair
+void keeper_setup(Worker* wk, Worker* owner)
+{
+    *wk = (Worker){.logs = owner->logs, .watchers = owner->watchers, .pending = coalescer_init(0),
+                   .watch_role = WATCH_KEEPER};
+    wk->src = copy_path(owner->src);
+    wk->checkpoint = realtime_ns();
+    if (owner->move_cookie != 0)
+    {
+        wk->move_cookie = owner->move_cookie;
+        wk->move_path = copy_path(owner->move_path);
+        wk->move_dir = owner->move_dir;
+        wk->move_deadline = owner->move_deadline;
+    }
+
+    owner->watch_role = WATCH_SHARED;
+    write_log(wk->logs, wk->src, NULL, "Sharing watches of ", wk->src);
+}
+
+// source that contains watched tree of keeper becomes its root, -1 when it can't be watched
+// watches added before the failure stay until the group ends, the old tree is still watched whole
+int keeper_add_source(Worker* wk, char* src)
+{
+    if (path_cmp(src, wk->src) != 0 || strcmp(src, wk->src) == 0)
+        return 0;
+
+    add_watch_recursive(wk->watchers, copy_path(src));
+    if (wk->watchers->failed)
+    {
+        wk->watchers->failed = 0;
+        return -1;
+    }
+    free(wk->src);
+    wk->src = copy_path(src);
+    write_log(wk->logs, wk->src, NULL, "Sharing watches of ", wk->src);
+    return 0;
+}
+
+// free shared watches after their last worker ended
+void keeper_finish(Worker* wk)
+{
+    free_watchers(wk->watchers);
+    free_coalescer(wk->pending);
+    free(wk->move_path);
+    free(wk->src);
+}
+
+// start worker for one or many (fan-out) targets
+void start_worker(char* src, char** targets, int count, WorkerOptions* opts, WorkerStats* stats, Log* logs)
+{
+    // target can be ended during the initial copy, worker inherited SIG_IGN from main
+    if (opts->fanout)
+        set_info_handler(target_end_handler, TARGET_END_SIGNAL);
+
+    Worker worker;
+    if (worker_setup(&worker, src, targets, count, opts, stats, logs) != 0)
+    {
+        worker_finish(&worker);
+        exit(EXIT_FAILURE);
+    }
 
-    // inotify init
-    Watchers* watchers = watchers_init();
-    add_watch_recursive(watchers, src);
-    print_watchers(watchers, logs, src, target);
+    // ends of targets are blocked since main, they come only while worker waits
+    // none comes between the check and the wait, ends sent during the initial copy are queued
+    sigset_t wait_mask;
+    pthread_sigmask(SIG_BLOCK, NULL, &wait_mask);
+    sigdelset(&wait_mask, TARGET_END_SIGNAL);
 
     // wait for changes and handle them
-    write_log(logs, src, target, "Waiting for changes...", "");
-    while (last_signal != SIGTERM && watchers->size > 0)
+    while (last_signal != SIGTERM && worker.watchers->size > 0 && !worker.watchers->failed)
     {
+        // stop fan-out targets ended by the user, also those ended during the initial copy
+        int ended = atomic_exchange(&ended_targets, 0);
+        if (worker.fanout != NULL && ended != 0)
+        {
+            for (int i = 0; i < count; i++)
+            {
+                if (ended & (1 << i))
+                    fanout_end(worker.fanout, i);
+            }
+            if (worker.fanout->active == 0)
+                break;
+        }
+
+        // wait for events, for the end of the oldest debounce window or for pair of waiting move
+        long long now = monotonic_ms();
+        int timeout = min_timeout(worker_timeout(&worker, now), log_timeout(logs, now));
+        struct timespec ts = {timeout / 1000, (long)(timeout % 1000) * 1000000};
+        struct pollfd pfd = {worker.watchers->fd, POLLIN, 0};
+        int ready = ppoll(&pfd, 1, timeout < 0 ? NULL : &ts, &wait_mask);
+        if (ready < 0 && errno != EINTR)
+        {
+            ERR("ppoll");
+            exit(EXIT_FAILURE);
+        }
+
         // handle inotify events
-        read_watch(watchers, src, target, logs);
+        if (ready > 0)
+            read_watch(&worker);
+        worker_tick(&worker);
+        // records of quiet worker don't wait in the ring
+        log_tick(logs, monotonic_ms());
     }
 
-    // exit cleanup
-    write_log(logs, src, target, "Worker exiting...", "");
-    // free inotify and watchers
-    free_watchers(watchers);
-    free(target);
+    // exit cleanup, source that can't be watched anymore ends the worker with an error
+    int failed = worker.watchers->failed;
+    worker_finish(&worker);
+    exit(failed ? EXIT_FAILURE : EXIT_SUCCESS);
+}
 
-    // exit
-    exit(EXIT_SUCCESS);
+// apply op to the target or queue it for all fan-out targets, replicas record latency of queued op
+static void submit_op(Worker* wk, Op* op)
+{
+    // keeper has no target
+    if (wk->watch_role == WATCH_KEEPER)
+        return;
+
+    wk->ops++;
+
+    if (wk->fanout != NULL)
+    {
+        fanout_push(wk->fanout, op);
+        return;
+    }
+
+    execute_op(op, wk->src, wk->target, wk->cache, wk->manifest, wk->logs);
+    stats_record(wk->stats, op);
+}
+
+// apply op of changed path, event that is handled is its first event
+void run_op(Worker* wk, OpType type, char* path)
+{
+    Op op = {type, path, NULL, wk->event_us};
+    submit_op(wk, &op);
+}
+
+// apply move from one path of the source to another
+void run_move_op(Worker* wk, OpType type, char* from, char* path)
+{
+    Op op = {type, path, from, wk->event_us};
+    submit_op(wk, &op);
+}
+
+// merge file op with pending ops of its path, the oldest ops run when too many are pending
+// created is set for op of IN_CREATE
+static void queue_file_op(Worker* wk, OpType type, char* path, int created)
+{
+    coalesce_add(wk->pending, type, path, monotonic_ms(), wk->event_us, created);
+
+    Op op;
+    while (wk->pending->size > COALESCE_MAX_PENDING && coalesce_next(wk->pending, LLONG_MAX, &op))
+    {
+        submit_op(wk, &op);
+        free(op.path);
+    }
+}
+
+// remember IN_MOVED_FROM until its IN_MOVED_TO comes
+static void wait_move(Worker* wk, uint32_t cookie, char* path, int is_dir)
+{
+    wk->move_cookie = cookie;
+    wk->move_path = strdup(path);
+    if (wk->move_path == NULL)
+    {
+        ERR("strdup");
+        exit(EXIT_FAILURE);
+    }
+    wk->move_dir = is_dir;
+    wk->move_deadline = monotonic_ms() + MOVE_WAIT;
+}
+
+// forget waiting move
+static void clear_move(Worker* wk)
+{
+    free(wk->move_path);
+    wk->move_path = NULL;
+    wk->move_cookie = 0;
+}
+
+// waiting IN_MOVED_FROM didn't get its pair before now - entry was moved out of the source
+void finish_move(Worker* wk, long long now)
+{
+    if (wk->move_cookie == 0 || wk->move_deadline > now)
+        return;
+
+    write_log(wk->logs, wk->src, wk->target, "Moved out of source: ", wk->move_path);
+    if (wk->move_dir)
+    {
+        // file ops could be inside the moved dir
+        run_pending_ops(wk, LLONG_MAX);
+        if (wk->watch_role != WATCH_SHARED)
+            remove_watch_tree(wk->watchers, wk->move_path);
+        run_op(wk, OP_DELETE_DIR, wk->move_path);
+    }
+    else
+    {
+        queue_file_op(wk, OP_DELETE_FILE, wk->move_path, 0);
+    }
+
+    clear_move(wk);
+}
+
+// run pending file ops whose debounce window ended before now
+void run_pending_ops(Worker* wk, long long now)
+{
+    Op op;
+    while (coalesce_next(wk->pending, now, &op))
+    {
+        LOG(wk->logs, LOG_LEVEL_INFO, "Running %s '%s'", op_name(op.type), op.path);
+        submit_op(wk, &op);
+        free(op.path);
+    }
 }
 
 // write log to workers.log file
-void write_log(FILE* logs, char* src, char* target, char* msg, char* arg)
+void write_log(Log* logs, char* src, char* target, char* msg, char* arg)
 {
-    fprintf(logs, "[%d] %s '%s'\n", getpid(), msg, arg);
-    fflush(logs);
+    LOG(logs, LOG_LEVEL_INFO, "%s '%s'", msg, arg);
 }
 
-// copy file from file1 to file2
-void copy_file(char* file1, char* file2)
+// copy file from file1 to file2, returns copy method that was used
+CopyMethod copy_file(char* file1, char* file2, Log* logs) { return copy_file_at(AT_FDCWD, file1, AT_FDCWD, file2, logs); }
+
+// copy file name1 in dirfd1 to name2 in dirfd2, returns copy method that was used
+CopyMethod copy_file_at(int dirfd1, char* name1, int dirfd2, char* name2, Log* logs)
 {
-    FILE* src = fopen(file1, "r");
-    if (src == NULL)
+    int src = openat(dirfd1, name1, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (src < 0)
     {
-        ERR("fopen");
+        ERR("openat");
         exit(EXIT_FAILURE);
     }
 
-    FILE* dst = fopen(file2, "w");
-    if (dst == NULL)
+    struct stat stat_info;
+    if (fstat(src, &stat_info) != 0)
     {
-        ERR("fopen");
+        ERR("fstat");
         exit(EXIT_FAILURE);
     }
 
-    char buf[4096];
-    size_t n;
+    int dst = openat(dirfd2, name2, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (dst < 0)
+    {
+        ERR("openat");
+        exit(EXIT_FAILURE);
+    }
 
-    while ((n = fread(buf, 1, sizeof(buf), src)) > 0)
+    // copy data with the cheapest method supported, skipping holes
+    off_t holes = 0;
+    CopyMethod method = copy_data(src, dst, stat_info.st_size, &holes);
+    write_log(logs, name1, name2, "Copied file with ", (char*)copy_method_name(method));
+    if (holes > 0)
     {
-        fwrite(buf, 1, n, dst);
+        LOG(logs, LOG_LEVEL_INFO, "Skipped %lld bytes of holes", (long long)holes);
     }
 
     // copy permissions
-    copy_permissions(file1, file2);
+    copy_permissions_fd(src, dst);
 
     // close files
-    if (fclose(src))
+    if (close(src))
     {
-        ERR("fclose");
+        ERR("close");
         exit(EXIT_FAILURE);
     }
-    if (fclose(dst))
+    if (close(dst))
     {
-        ERR("fclose");
+        ERR("close");
         exit(EXIT_FAILURE);
     }
+
+    return method;
 }
 
 // copy symlink
-void copy_symlink(char* file1, char* file2, char* src, char* target, FILE* logs)
+void copy_symlink(char* file1, char* file2, char* src, char* target, Log* logs)
+{
+    copy_symlink_at(file1, AT_FDCWD, file2, src, target, logs);
+}
+
+// path that copy of symlink file1 points to, NULL if link is dangling and isn't copied
+// link inside src points to the same file in target, inside is set for it
+char* symlink_copy_path(char* file1, char* src, char* target, int* inside)
 {
     char* link_path = realpath(file1, NULL);
 
     if (link_path == NULL && errno == ENOENT)
     {
-        return;
+        return NULL;
     }
     if (link_path == NULL)
     {
@@ -104,78 +474,172 @@ void copy_symlink(char* file1, char* file2, char* src, char* target, FILE* logs)
     }
 
     // compare real paths
-    if (path_cmp(src, link_path) == 0)
-    {
-        write_log(logs, src, target, "Link inside src:\n\t", link_path);
-        // create symlink to file in target dir
-        // get ending of path after src real path
-        char* new_path = link_path + strlen(src) + 1;
-        new_path = join_paths(target, new_path);
+    *inside = path_cmp(src, link_path) == 0;
+    if (!*inside)
+        return link_path;
 
-        if (symlink(new_path, file2) != 0)
-        {
-            ERR("symlink");
-            exit(EXIT_FAILURE);
-        }
+    // get ending of path after src real path
+    char* new_path = join_paths(target, link_path + strlen(src) + 1);
+    free(link_path);
+    return new_path;
+}
 
-        free(new_path);
-    }
-    else
+// copy symlink file1 to name2 in dirfd2
+void copy_symlink_at(char* file1, int dirfd2, char* name2, char* src, char* target, Log* logs)
+{
+    int inside = 0;
+    char* link_path = symlink_copy_path(file1, src, target, &inside);
+    if (link_path == NULL)
+        return;
+
+    // symlink to file in target dir, link outside src is created without changes to path
+    write_log(logs, src, target, inside ? "Link inside src:\n\t" : "Link outside src:\n\t", link_path);
+    if (symlinkat(link_path, dirfd2, name2) != 0)
     {
-        write_log(logs, src, target, "Link outside src:\n\t", link_path);
-        // create symlink without changes to path
-        if (symlink(link_path, file2) != 0)
-        {
-            ERR("symlink");
-            exit(EXIT_FAILURE);
-        }
+        ERR("symlink");
+        exit(EXIT_FAILURE);
     }
 
     free(link_path);
 }
 
 // copy whole directory from path1 to path2
-void copy_dir(char* path1, char* path2, char* src_path, char* target_path, FILE* logs)
+void copy_dir(char* path1, char* path2, char* src_path, char* target_path, Log* logs)
 {
-    // open src dir
-    DIR* src = opendir(path1);
-    if (src == NULL)
+    int fd2 = open_dir_at(AT_FDCWD, path2);
+    copy_dir_at(open_dir_at(AT_FDCWD, path1), fd2, path1, src_path, target_path, logs);
+
+    if (close(fd2) < 0)
     {
-        ERR("opendir");
+        ERR("close");
         exit(EXIT_FAILURE);
     }
+}
 
-    struct dirent* file_info;
-    struct stat stat_info;
+// copy content of directory fd1 to directory fd2, fd1 is closed at the end
+// path1 is path of fd1, it's only needed for symlinks
+void copy_dir_at(int fd1, int fd2, char* path1, char* src_path, char* target_path, Log* logs)
+{
+    // open src dir
+    DirIter* it = dir_iter_open(fd1);
+    DirEntry entry;
 
-    // read all dir files
-    while ((file_info = readdir(src)) != NULL)
+    // read all dir files, d_type tells type of entry
+    while (dir_iter_next(it, &entry))
     {
-        // ignore "." and ".."
-        if (strcmp(file_info->d_name, ".") == 0 || strcmp(file_info->d_name, "..") == 0)
+        char* name = entry.name;
+
+        // copy regular file
+        if (entry.type == DT_REG)
         {
-            continue;
+            write_log(logs, path1, NULL, "Copying file: ", name);
+            copy_file_at(fd1, name, fd2, name, logs);
         }
-
-        char* file1 = join_paths(path1, file_info->d_name);
-        char* file2 = join_paths(path2, file_info->d_name);
-
-        if (lstat(file1, &stat_info) != 0)
+        // copy whole directory recursively
+        else if (entry.type == DT_DIR)
         {
-            ERR("lstat");
-            exit(EXIT_FAILURE);
+            write_log(logs, path1, NULL, "Copying dir: ", name);
+            if (mkdirat(fd2, name, 0777) != 0)
+            {
+                ERR("mkdir");
+                exit(EXIT_FAILURE);
+            }
+            int sub1 = open_dir_at(fd1, name);
+            int sub2 = open_dir_at(fd2, name);
+            // set permissions
+            copy_permissions_fd(sub1, sub2);
+            // copy directory recursively
+            char* file1 = join_paths(path1, name);
+            copy_dir_at(sub1, sub2, file1, src_path, target_path, logs);
+            free(file1);
+            if (close(sub2) < 0)
+            {
+                ERR("close");
+                exit(EXIT_FAILURE);
+            }
         }
+        // copy link
+        else if (entry.type == DT_LNK)
+        {
+            write_log(logs, path1, NULL, "Copying link: ", name);
+            // copy symlink, realpath needs full path
+            char* file1 = join_paths(path1, name);
+            copy_symlink_at(file1, fd2, name, src_path, target_path, logs);
+            free(file1);
+        }
+    }
 
-        // copy regular file
-        if (S_ISREG(stat_info.st_mode))
+    // closes fd1
+    dir_iter_close(it);
+}
+
+// parallel copy task, copies file or directory file1 to file2
+typedef struct CopyTask
+{
+    char* file1;        // source file
+    char* file2;        // target file
+    char* src_path;     // source root
+    char* target_path;  // target root
+    Log* logs;          // logs file
+} CopyTask;
+
+// create new copy task
+static CopyTask* copy_task(char* file1, char* file2, CopyTask* parent)
+{
+    CopyTask* task = malloc(sizeof(CopyTask));
+    if (task == NULL)
+    {
+        ERR("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    task->file1 = file1;
+    task->file2 = file2;
+    task->src_path = parent->src_path;
+    task->target_path = parent->target_path;
+    task->logs = parent->logs;
+
+    return task;
+}
+
+// copy regular file task
+static void copy_file_task(Pool* pool, void* arg)
+{
+    CopyTask* task = arg;
+
+    copy_file(task->file1, task->file2, task->logs);
+
+    free(task->file1);
+    free(task->file2);
+    free(task);
+}
+
+// copy directory task, files and subdirectories become new tasks
+static void copy_dir_task(Pool* pool, void* arg)
+{
+    CopyTask* task = arg;
+
+    // open src dir
+    DirIter* it = dir_iter_open(open_dir_at(AT_FDCWD, task->file1));
+    DirEntry entry;
+
+    // read all dir files, d_type tells type of entry
+    while (dir_iter_next(it, &entry))
+    {
+        char* file1 = join_paths(task->file1, entry.name);
+        char* file2 = join_paths(task->file2, entry.name);
+
+        // copy regular file in other task
+        if (entry.type == DT_REG)
         {
-            write_log(logs, path1, path2, "Copying file: ", file_info->d_name);
-            copy_file(file1, file2);
+            write_log(task->logs, task->file1, task->file2, "Copying file: ", entry.name);
+            pool_submit(pool, copy_file_task, copy_task(file1, file2, task));
+            continue;
         }
-        // copy whole directory recursively
-        else if (S_ISDIR(stat_info.st_mode))
+        // create directory and copy its content in other task
+        else if (entry.type == DT_DIR)
         {
-            write_log(logs, path1, path2, "Copying dir: ", file_info->d_name);
+            write_log(task->logs, task->file1, task->file2, "Copying dir: ", entry.name);
             if (mkdir(file2, 0777) != 0)
             {
                 ERR("mkdir");
@@ -183,26 +647,50 @@ void copy_dir(char* path1, char* path2, char* src_path, char* target_path, FILE*
             }
             // set permissions
             copy_permissions(file1, file2);
-            // copy directory recursively
-            copy_dir(file1, file2, src_path, target_path, logs);
+            pool_submit(pool, copy_dir_task, copy_task(file1, file2, task));
+            continue;
         }
         // copy link
-        else if (S_ISLNK(stat_info.st_mode))
+        else if (entry.type == DT_LNK)
         {
-            write_log(logs, path1, path2, "Copying link: ", file_info->d_name);
-            // copy symlink
-            copy_symlink(file1, file2, src_path, target_path, logs);
+            write_log(task->logs, task->file1, task->file2, "Copying link: ", entry.name);
+            copy_symlink(file1, file2, task->src_path, task->target_path, task->logs);
         }
 
         free(file1);
         free(file2);
     }
 
-    if (closedir(src) < 0)
+    dir_iter_close(it);
+
+    free(task->file1);
+    free(task->file2);
+    free(task);
+}
+
+// copy whole directory from path1 to path2 with given number of threads
+// builds the same tree as copy_dir()
+void copy_dir_parallel(char* path1, char* path2, char* src_path, char* target_path, int threads, Log* logs)
+{
+    if (threads <= 1)
+    {
+        copy_dir(path1, path2, src_path, target_path, logs);
+        return;
+    }
+
+    CopyTask root = {NULL, NULL, src_path, target_path, logs};
+    char* file1 = strdup(path1);
+    char* file2 = strdup(path2);
+    if (file1 == NULL || file2 == NULL)
     {
-        ERR("closedir");
+        ERR("strdup");
         exit(EXIT_FAILURE);
     }
+
+    Pool* pool = pool_init(threads);
+    pool_submit(pool, copy_dir_task, copy_task(file1, file2, &root));
+    pool_run(pool);
+    free_pool(pool);
 }
 
 // compare if path2 includes path1
@@ -231,16 +719,36 @@ int path_cmp(char* path1, char* path2)
     return 0;
 }
 
-// read inotify fd and handle events
-void read_watch(Watchers* w, char* src, char* target, FILE* logs)
+// name of event for logs, first of its kinds
+static const char* event_name(uint32_t mask)
 {
-    // cookie for moved from & moved to event
-    uint32_t pending_cookie = 0;
-    char pending_move_path[PATH_MAX] = "";
+    if (mask & IN_Q_OVERFLOW)
+        return "OVERFLOW";
+    if (mask & IN_IGNORED)
+        return "IGNORED";
+    if (mask & IN_CREATE)
+        return "CREATED";
+    if (mask & IN_DELETE)
+        return "DELETED";
+    if (mask & IN_MOVED_FROM)
+        return "MOVED_FROM";
+    if (mask & IN_MOVED_TO)
+        return "MOVED_TO";
+    if (mask & IN_CLOSE_WRITE)
+        return "CLOSE_WRITE";
+    if (mask & IN_ATTRIB)
+        return "ATTRIB_CHANGE";
+    return "CHANGED";
+}
 
+// read inotify fd and handle events
+void read_watch(Worker* wk)
+{
     char buffer[EVENT_BUF_LEN];
+    // changes made before the read have their events in the queue
+    long long before = realtime_ns();
     // read buffer from inotify
-    ssize_t len = read(w->fd, buffer, EVENT_BUF_LEN);
+    ssize_t len = read_events(wk->watchers, buffer, EVENT_BUF_LEN);
     if (len < 0 && errno == EINTR)
     {
         // interrupted by signal - exit
@@ -252,221 +760,246 @@ void read_watch(Watchers* w, char* src, char* target, FILE* logs)
         exit(EXIT_FAILURE);
     }
 
-    // handle buffer
+    // events of buffer were dequeued now, latency of their ops starts here
+    wk->event_us = monotonic_us();
+    if (wk->trace != NULL)
+        trace_events(wk->trace, buffer, len, wk->event_us);
+
+    handle_events(wk, buffer, len);
+    advance_checkpoint(wk, before, len);
+}
+
+// handle buffer of events read at wk->event_us, replay of recorded events calls it too
+void handle_events(Worker* wk, char* buffer, ssize_t len)
+{
     ssize_t i = 0;
     while (i < len)
     {
         // get event struct
         struct inotify_event* event = (struct inotify_event*)&buffer[i];
+        handle_event(wk, event);
+
+        // skip to the next event struct
+        i += sizeof(struct inotify_event) + event->len;
+    }
+    // ops made later, like rescans, don't belong to any event
+    wk->event_us = 0;
+}
+
+// event of shared watches is in the source of worker, events of parent dir about the source root aren't
+// removed watches are left to keeper
+static int in_source(Worker* wk, Watch* watch, struct inotify_event* event, char* event_path)
+{
+    if (event->mask & IN_Q_OVERFLOW)
+        return 1;
+    if (watch == NULL || event->mask & IN_IGNORED || path_cmp(wk->src, event_path) != 0)
+        return 0;
+
+    return event->len == 0 || strlen(event_path) > strlen(wk->src);
+}
+
+// handle one event, worker of shared watches gets events of the whole watched tree
+void handle_event(Worker* wk, struct inotify_event* event)
+{
+    Watchers* w = wk->watchers;
+    Log* logs = wk->logs;
 
-        // log
-        fprintf(logs, "[%d] New event: [i=%ld] [ev=0x%08x] [wd=%d]\n", getpid(), i, event->mask, event->wd);
+    // moved from & moved to events of one move come one after another
+    if (wk->move_cookie != 0 && !(event->mask & IN_MOVED_TO && event->cookie == wk->move_cookie))
+        finish_move(wk, LLONG_MAX);
 
-        // find watch path
-        Watch* watch = search_watch(w, event->wd);
+    // find watch path
+    Watch* watch = search_watch(w, event->wd);
 
-        // create event path
-        char* event_path = NULL;
-        if (watch && event->len > 0)
+    // create event path
+    char* event_path = NULL;
+    if (watch && event->len > 0)
+    {
+        event_path = join_paths(watch->path, event->name);
+    }
+    else if (watch)
+    {
+        event_path = malloc(sizeof(char) * (strlen(watch->path) + 1));
+        if (event_path == NULL)
         {
-            event_path = join_paths(watch->path, event->name);
+            ERR("malloc");
+            exit(EXIT_FAILURE);
         }
-        else if (watch)
+        strcpy(event_path, watch->path);
+    }
+
+    // other sources in the tree aren't for this worker, its waiting move went to one of them
+    if (wk->watch_role == WATCH_SHARED && !in_source(wk, watch, event, event_path))
+    {
+        finish_move(wk, LLONG_MAX);
+        free(event_path);
+        return;
+    }
+    // one record per event, keeper writes it for workers of shared watches, file events too
+    if (wk->watch_role != WATCH_SHARED)
+        LOG(logs, LOG_LEVEL_DEBUG, "Event [ev=0x%08x] [wd=%d] %s '%s' was %s (cookie=%u)", event->mask, event->wd,
+            event->mask & IN_ISDIR ? "Directory" : "File", event_path ? event_path : "", event_name(event->mask),
+            event->cookie);
+    // keeper follows only directories
+    if (wk->watch_role == WATCH_KEEPER && !(event->mask & (IN_ISDIR | IN_IGNORED | IN_Q_OVERFLOW)))
+    {
+        free(event_path);
+        return;
+    }
+
+    wk->events++;
+
+    // handle event
+    if (event->mask & IN_Q_OVERFLOW)
+    {
+        // source is rescanned after this buffer
+        LOG(logs, LOG_LEVEL_WARN, "Event queue overflow, events were lost");
+        wk->rescan = 1;
+    }
+    else if (watch == NULL && !(event->mask & IN_IGNORED))
+    {
+        // watch was already removed
+        LOG(logs, LOG_LEVEL_DEBUG, "No watch for [wd=%d], skipping", event->wd);
+    }
+    else if (event->mask & IN_IGNORED)
+    {
+        // watch was removed by the kernel
+        LOG(logs, LOG_LEVEL_DEBUG, "Removed watch [wd=%d]", event->wd);
+        delete_watch(w, event->wd);
+    }
+    // handle directories
+    else if (event->mask & IN_ISDIR)
+    {
+        // pending file ops could be inside this directory, they run first
+        // moved dir keeps them, their paths are changed with the dir
+        int moved = event->mask & IN_MOVED_FROM || (event->mask & IN_MOVED_TO && event->cookie == wk->move_cookie);
+        if (!moved)
+            run_pending_ops(wk, LLONG_MAX);
+
+        if (event->mask & IN_CREATE)
         {
-            event_path = malloc(sizeof(char) * (strlen(watch->path) + 1));
-            if (event_path == NULL)
-            {
-                ERR("malloc");
-                exit(EXIT_FAILURE);
-            }
-            strcpy(event_path, watch->path);
-        }
+            // make new dir in the backup directory with its content
+            run_op(wk, OP_COPY_DIR, event_path);
 
-        // handle event
-        if (event->mask & IN_IGNORED)
+            // add new watches
+            if (wk->watch_role != WATCH_SHARED)
+                add_watch_recursive(w, strdup(event_path));
+            LOG(logs, LOG_LEVEL_DEBUG, "%d watchers", w->size);
+        }
+        if (event->mask & IN_DELETE)
         {
-            // watch was removed by the kernel
-            fprintf(logs, "\t Removed watch [wd=%d]\n", event->wd);
-            fflush(logs);
-            delete_watch(w, event->wd);
+            // delete dir from the backup directory
+            run_op(wk, OP_DELETE_DIR, event_path);
         }
-        // handle directories
-        else if (event->mask & IN_ISDIR)
+        else if (event->mask & IN_MOVED_FROM)
         {
-            fprintf(logs, "\tDirectory '%s' was ", event_path);
-
-            if (event->mask & IN_CREATE)
-            {
-                fprintf(logs, "CREATED\n");
-                // make new dir in the backup directory
-                char* file_path = src2target_path(event_path, src, target);
-                if (mkdir(file_path, 0777) < 0)
-                {
-                    ERR("mkdir");
-                    exit(EXIT_FAILURE);
-                }
-                // copy permissions
-                copy_permissions(event_path, file_path);
-                // copy dir files and subdirs into backup
-                copy_dir(event_path, file_path, src, target, logs);
-                free(file_path);
-
-                // add new watches
-                add_watch_recursive(w, strdup(event_path));
-                print_watchers(w, logs, src, target);
-            }
-            if (event->mask & IN_DELETE)
-            {
-                fprintf(logs, "DELETED");
-                // delete dir from the backup directory
-                char* file_path = src2target_path(event_path, src, target);
-                rm_dir_recursive(file_path);
-                free(file_path);
-            }
-            else if (event->mask & IN_MOVED_FROM)
+            // wait for moved to event, it can come in the next read
+            wait_move(wk, event->cookie, event_path, 1);
+        }
+        else if (event->mask & IN_MOVED_TO)
+        {
+            if (event->cookie == wk->move_cookie && wk->move_cookie != 0)
             {
-                fprintf(logs, "MOVED_FROM (cookie=%u)", event->cookie);
-                pending_cookie = event->cookie;
-                strncpy(pending_move_path, event_path, sizeof(pending_move_path));
-                // delete dir from the backup directory
-                char* file_path = src2target_path(event_path, src, target);
-                rm_dir_recursive(file_path);
-                free(file_path);
+                // update watch_paths and paths of pending ops
+                if (wk->watch_role != WATCH_SHARED)
+                    update_watch_paths(w, wk->move_path, event_path);
+                coalesce_rename(wk->pending, wk->move_path, event_path);
+                // rename dir in the backup directory
+                run_move_op(wk, OP_MOVE_DIR, wk->move_path, event_path);
+                // update cookie
+                clear_move(wk);
             }
-            else if (event->mask & IN_MOVED_TO)
+            else
             {
-                fprintf(logs, "MOVED_TO (cookie=%u)", event->cookie);
-                if (event->cookie == pending_cookie && pending_cookie != 0)
-                {
-                    // update watch_paths
-                    update_watch_paths(w, pending_move_path, event_path);
-                    // update cookie
-                    pending_cookie = 0;
-                    pending_move_path[0] = '\0';
-                    // copy dir in the backup directory
-                    char* file_path = src2target_path(event_path, src, target);
-                    if (mkdir(file_path, 0777) < 0)
-                    {
-                        ERR("mkdir");
-                        exit(EXIT_FAILURE);
-                    }
-                    // copy permissions
-                    copy_permissions(event_path, file_path);
-                    // copy dir files and subdirs into backup
-                    copy_dir(event_path, file_path, src, target, logs);
-                    free(file_path);
-                }
-                else
-                {
-                    // copy moved dir into backup folder
-                    char* new_path = src2target_path(event_path, src, target);
-                    if (mkdir(new_path, 0777) < 0)
-                    {
-                        ERR("mkdir");
-                        exit(EXIT_FAILURE);
-                    }
-                    fprintf(logs, "\n");
-                    // copy permissions
-                    copy_permissions(event_path, new_path);
-                    // copy dir
-                    copy_dir(event_path, new_path, src, target, logs);
-                    free(new_path);
+                // copy moved dir into backup folder
+                run_op(wk, OP_COPY_DIR, event_path);
+                if (wk->watch_role != WATCH_SHARED)
                     add_watch_recursive(w, strdup(event_path));
-                }
-            }
-            else if (event->mask & IN_ATTRIB)
-            {
-                fprintf(logs, "ATTRIB_CHANGE");
-                char* file_path = src2target_path(event_path, src, target);
-                copy_permissions(event_path, file_path);
-                free(file_path);
-            }
-            else if (event->mask & IN_CLOSE_WRITE)
-            {
-                fprintf(logs, "CLOSE_WRITE");
             }
-            fprintf(logs, "\n");
         }
-        // handle files
-        else
+        else if (event->mask & IN_ATTRIB)
         {
-            fprintf(logs, "\tFile '%s' was ", event_path);
-
-            // handle creation, modification and moved to events (copy file)
-            if (event->mask & IN_CREATE || event->mask & IN_CLOSE_WRITE || event->mask & IN_MOVED_TO)
+            run_op(wk, OP_ATTRIB, event_path);
+        }
+    }
+    // handle files
+    else
+    {
+        // file moved inside the source
+        if (event->mask & IN_MOVED_TO && event->cookie == wk->move_cookie && wk->move_cookie != 0)
+        {
+            // rename replaces file at new path, its pending ops are superseded
+            // pending ops of moved file, like chmod before the move, run at its new path after the move
+            coalesce_drop(wk->pending, event_path);
+            coalesce_rename(wk->pending, wk->move_path, event_path);
+            run_move_op(wk, OP_MOVE_FILE, wk->move_path, event_path);
+            clear_move(wk);
+        }
+        // handle creation, modification and moved to events (copy file)
+        else if (event->mask & IN_CREATE || event->mask & IN_CLOSE_WRITE || event->mask & IN_MOVED_TO)
+        {
+            // check if file is a symlink
+            struct stat stat_info;
+            if (lstat(event_path, &stat_info) != 0)
             {
-                if (event->mask & IN_CREATE)
-                    fprintf(logs, "CREATED");
-                else if (event->mask & IN_CLOSE_WRITE)
-                    fprintf(logs, "CLOSE_WRITE");
-                else
-                    fprintf(logs, "MOVED_TO");
-
-                // check if file is a symlink
-                struct stat stat_info;
-                char* file_path = src2target_path(event_path, src, target);
-
-                if (lstat(event_path, &stat_info) != 0)
+                if (errno != ENOENT)
                 {
                     ERR("lstat");
                     exit(EXIT_FAILURE);
                 }
-
-                // copy file or symlink
-                if (S_ISLNK(stat_info.st_mode))
-                {
-                    fprintf(logs, "\n");
-                    copy_symlink(event_path, file_path, src, target, logs);
-                }
-                else
-                {
-                    copy_file(event_path, file_path);
-                }
-
-                free(file_path);
-            }
-            // handle deletion and moved from events (delete file)
-            if (event->mask & IN_DELETE || event->mask & IN_MOVED_FROM)
-            {
-                if (event->mask & IN_DELETE)
-                    fprintf(logs, "DELETED");
-                else
-                    fprintf(logs, "MOVED_FROM");
-
-                // delete file in the backup directory
-                char* file_path = src2target_path(event_path, src, target);
-                if (unlink(file_path) < 0)
-                {
-                    ERR("unlink");
-                    exit(EXIT_FAILURE);
-                }
-                free(file_path);
-            }
-            // file attributes changed
-            if (event->mask & IN_ATTRIB)
-            {
-                fprintf(logs, "ATTRIB_CHANGE");
-                char* file_path = src2target_path(event_path, src, target);
-                copy_permissions(event_path, file_path);
-                free(file_path);
+                // file is already gone or its dir was moved, type is checked again when op runs
+                stat_info.st_mode = S_IFREG;
             }
 
-            fprintf(logs, "\n");
+            // copy file or symlink, modified file can be updated only in changed blocks
+            // only created file can't be in the target yet, moved in file could replace a backed up one
+            int created = (event->mask & IN_CREATE) != 0;
+            if (S_ISLNK(stat_info.st_mode))
+                queue_file_op(wk, OP_SYMLINK, event_path, created);
+            else if (S_ISREG(stat_info.st_mode) && event->mask & IN_CLOSE_WRITE)
+                queue_file_op(wk, OP_UPDATE_FILE, event_path, 0);
+            else if (S_ISREG(stat_info.st_mode))
+                queue_file_op(wk, OP_COPY_FILE, event_path, created);
+        }
+        // handle deletion (delete file)
+        if (event->mask & IN_DELETE)
+        {
+            // delete file in the backup directory
+            queue_file_op(wk, OP_DELETE_FILE, event_path, 0);
+        }
+        // wait for moved to event, without it file is deleted
+        else if (event->mask & IN_MOVED_FROM)
+        {
+            wait_move(wk, event->cookie, event_path, 0);
+        }
+        // file attributes changed
+        if (event->mask & IN_ATTRIB)
+        {
+            queue_file_op(wk, OP_ATTRIB, event_path, 0);
         }
-
-        // flush logs
-        fflush(logs);
-        // skip to the next event struct
-        i += sizeof(struct inotify_event) + event->len;
-        // free
-        free(event_path);
     }
+
+    // free
+    free(event_path);
 }
 
 // change src path to target
 char* src2target_path(char* event_path, char* src, char* target)
 {
     int src_len = strlen(src);
+
+    // event on the source dir itself
+    if (event_path[src_len] == '\0')
+    {
+        char* path = strdup(target);
+        if (path == NULL)
+        {
+            ERR("strdup");
+            exit(EXIT_FAILURE);
+        }
+        return path;
+    }
+
     char* inside_path = event_path + src_len + 1;
 
     return join_paths(target, inside_path);
@@ -500,3 +1033,32 @@ void copy_permissions(char* file1, char* file2)
         exit(EXIT_FAILURE);
     }
 }
+
+// copy permissions and times of open file fd1 to open file fd2
+void copy_permissions_fd(int fd1, int fd2)
+{
+    struct stat stat_info;
+
+    // get fd1 permissions
+    if (fstat(fd1, &stat_info) != 0)
+    {
+        ERR("fstat");
+        exit(EXIT_FAILURE);
+    }
+    // set permissions for fd2
+    if (fchmod(fd2, stat_info.st_mode) != 0)
+    {
+        ERR("fchmod");
+        exit(EXIT_FAILURE);
+    }
+    // set atime and mtime
+    struct timespec times[2];
+    times[0] = stat_info.st_atim; // atime
+    times[1] = stat_info.st_mtim; // mtime
+
+    if (futimens(fd2, times) < 0)
+    {
+        ERR("futimens");
+        exit(EXIT_FAILURE);
+    }
+}
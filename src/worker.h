@@ -1,26 +1,122 @@
 #ifndef WORKER_H
 #define WORKER_H
 
+#include "coalesce.h"
+#include "copy.h"
+#include "delta.h"
+#include "fanout.h"
+#include "log.h"
+#include "op.h"
+#include "pool.h"
 #include "signal_handler.h"
+#include "stats.h"
+#include "trace.h"
 #include "utils.h"
 #include "watchers.h"
 
-void start_worker(char* src, char* target, FILE* logs);
+#define MOVE_WAIT 20  // ms that IN_MOVED_FROM waits for its IN_MOVED_TO in the next read
 
-void write_log(FILE* logs, char* src, char* target, char* msg, char* arg);
+// who changes watches of worker when its source changes
+typedef enum WatchRole
+{
+    WATCH_OWN,     // worker has its own watches
+    WATCH_SHARED,  // watches are shared with workers of overlapping sources, keeper changes them
+    WATCH_KEEPER,  // worker keeps shared watches up to date and runs no ops
+} WatchRole;
 
-void copy_file(char* file1, char* file2);
+typedef struct WorkerOptions
+{
+    int threads;           // threads used for initial copy
+    int fanout;            // one worker reads source once for all targets
+    int debounce;          // window in ms in which file events of one path are merged
+    WatchBackend backend;  // how source is watched
+    int resume;            // target already has a backup, only differences are copied
+    char* trace;           // file where read events are recorded for replay, NULL if they aren't
+    Watchers* watchers;    // watches of keeper shared by overlapping sources, NULL for own watches
+} WorkerOptions;
 
-void copy_symlink(char* file1, char* file2, char* src, char* target, FILE* logs);
+typedef struct Worker
+{
+    char* src;                // source root
+    char* target;             // target root, NULL for fan-out worker
+    Log* logs;                // logs file
+    Watchers* watchers;       // inotify watches of source
+    DeltaCache* cache;        // block hashes of updated target files
+    Manifest* manifest;       // entries of target files, NULL for fan-out worker or when it can't be made
+    FanOut* fanout;           // targets of fan-out worker, NULL with one target
+    Coalescer* pending;       // file ops waiting for the end of their debounce window
+    unsigned long events;     // inotify events received
+    unsigned long ops;        // ops executed or queued for fan-out targets
+    uint32_t move_cookie;     // cookie of IN_MOVED_FROM waiting for its IN_MOVED_TO, 0 if none
+    char* move_path;          // source path of waiting move
+    int move_dir;             // waiting move is a directory
+    long long move_deadline;  // time when waiting move is treated as move out of source, in ms
+    int rescan;               // events were lost, source has to be rescanned
+    long long checkpoint;     // wall clock in ns since when changes could be missing in the target
+    unsigned long overflows;  // event queue overflows recovered by rescan
+    long long resync_ms;      // time spent in rescans, in ms
+    WorkerStats* stats;       // live counters read by stats command, NULL when every slot is taken
+    long long event_us;       // monotonic us when handled events were read, 0 outside of read_watch
+    Trace* trace;             // recorded events and watches, NULL if they aren't recorded
+    char** targets;           // target roots owned by worker
+    int count;                // number of targets
+    WatchRole watch_role;     // who changes watches
+} Worker;
 
-void copy_dir(char* path1, char* path2, char* src_path, char* target_path, FILE* logs);
+void start_worker(char* src, char** targets, int count, WorkerOptions* opts, WorkerStats* stats, Log* logs);
+
+int worker_setup(Worker* wk, char* src, char** targets, int count, WorkerOptions* opts, WorkerStats* stats, Log* logs);
+
+void worker_tick(Worker* wk);
+
+int worker_timeout(Worker* wk, long long now);
+
+void worker_finish(Worker* wk);
+
+void keeper_setup(Worker* wk, Worker* owner);
+
+int keeper_add_source(Worker* wk, char* src);
+
+void keeper_finish(Worker* wk);
+
+void run_op(Worker* wk, OpType type, char* path);
+
+void run_move_op(Worker* wk, OpType type, char* from, char* path);
+
+void run_pending_ops(Worker* wk, long long now);
+
+void finish_move(Worker* wk, long long now);
+
+void write_log(Log* logs, char* src, char* target, char* msg, char* arg);
+
+CopyMethod copy_file(char* file1, char* file2, Log* logs);
+
+CopyMethod copy_file_at(int dirfd1, char* name1, int dirfd2, char* name2, Log* logs);
+
+void copy_symlink(char* file1, char* file2, char* src, char* target, Log* logs);
+
+void copy_symlink_at(char* file1, int dirfd2, char* name2, char* src, char* target, Log* logs);
+
+char* symlink_copy_path(char* file1, char* src, char* target, int* inside);
+
+void copy_dir(char* path1, char* path2, char* src_path, char* target_path, Log* logs);
+
+void copy_dir_at(int fd1, int fd2, char* path1, char* src_path, char* target_path, Log* logs);
+
+void copy_dir_parallel(char* path1, char* path2, char* src_path, char* target_path, int threads, Log* logs);
 
 int path_cmp(char* path1, char* path2);
 
-void read_watch(Watchers* w, char* src, char* target, FILE* logs);
+void read_watch(Worker* wk);
+
+void handle_events(Worker* wk, char* buffer, ssize_t len);
+
+void handle_event(Worker* wk, struct inotify_event* event);
 
 char* src2target_path(char* event_path, char* src_path, char* target);
 
 void copy_permissions(char* file1, char* file2);
 
+void copy_permissions_fd(int fd1, int fd2);
+
 #endif